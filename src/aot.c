@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "aot.h"
+#include "memory.h"
+#include "metrics.h"
+
+/* -----Ahead-of-time translation-----
+ * aotTranslate walks the guest code reachable from an entry PC and writes it
+ * out as a single C function, cero_aot_run. Every PC control can transfer to
+ * becomes a label, direct jumps and calls become gotos and everything else
+ * falls through in address order. The guest registers and condition codes are
+ * locals of the function, which leaves gcc free to keep them in host registers
+ * and to drop every condition code nobody reads.
+ *
+ * ret and entering the function go through a switch over every label (the
+ * dispatch table). A PC that was not translated leaves the function, as does
+ * a memory access that would fault, a halt, or a store to the translated bytes.
+ * runAot then interprets a basic block from the PC it left at before entering
+ * the translation again, so code that was not (or can not be) translated still
+ * runs exactly as it would have without it.
+ *
+ * The translation counts the instructions it retires in a local, and a jump or
+ * the dispatch table leaves once it reached the slice of the state, such that
+ * runAot publishes the metrics every METRICS_SLICE of them.
+ *
+ * Only code within AOT_WINDOW bytes from the page of the entry is translated,
+ * and memory is accessed through the load and store callbacks of the state.
+ *
+ * The generated source only depends on the AOT_STATE definition it embeds, and
+ * records a checksum of the bytes it was translated from. loadAot refuses a
+ * library whose bytes do not match the memory of the VM.
+ */
+
+#define AOT_STRINGIFY(...)        #__VA_ARGS__
+#define AOT_EXPAND_STRINGIFY(...) AOT_STRINGIFY(__VA_ARGS__)
+
+typedef struct Aot {
+    void* library;                 /* Handle returned by dlopen               */
+    void (*entry)(AotState* state); /* cero_aot_run                            */
+    vm_quad_t start;               /* First guest byte of the translation     */
+    vm_quad_t end;                 /* One past the last guest byte            */
+    bool stale;                    /* Set once the guest wrote to start - end */
+} Aot;
+
+typedef struct {
+    VM* vm;
+    FILE* file;
+    vm_quad_t base;       /* First guest byte of the window              */
+    bool* reached;        /* Instruction starts reachable from the entry */
+    bool* labelled;       /* Instruction starts control transfers to     */
+    vm_quad_t* pending;   /* Labels whose code is still to be walked     */
+    uint32_t pendingCount;
+    uint32_t pendingCapacity;
+} Translator;
+
+/* FNV-1a over the translated guest bytes */
+static uint64_t checksum(VM* vm, vm_quad_t start, vm_quad_t end) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (vm_quad_t pc = start; pc < end; ++pc) {
+        hash ^= m1r(vm, pc);
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/* -----Discovery----- */
+static inline bool inWindow(Translator* t, vm_quad_t pc) {
+    return addrInMem(t->vm, pc, 1) && pc >= t->base && pc < t->base + AOT_WINDOW;
+}
+
+#define REACHED(t, pc)  ((t)->reached[(pc) - (t)->base])
+#define LABELLED(t, pc) ((t)->labelled[(pc) - (t)->base])
+
+static void addLabel(Translator* t, vm_quad_t pc) {
+    if (!inWindow(t, pc)) {
+        return;
+    }
+    LABELLED(t, pc) = true;
+    if (REACHED(t, pc)) {
+        return;
+    }
+    if (t->pendingCount == t->pendingCapacity) {
+        uint32_t oldCapacity = t->pendingCapacity;
+        t->pendingCapacity = GROW_CAPACITY(oldCapacity);
+        t->pending = GROW_ARRAY(vm_quad_t, t->pending, oldCapacity, t->pendingCapacity);
+    }
+    t->pending[t->pendingCount++] = pc;
+}
+
+static bool fallsThrough(Operation operation) {
+    switch (operation) {
+        case OP_HALT: case OP_JMP: case OP_CALL: case OP_RET:
+        case OP_INVALID: case OP_BAD_FETCH:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static void discover(Translator* t, vm_quad_t entry) {
+    addLabel(t, entry);
+    while (t->pendingCount > 0) {
+        vm_quad_t pc = t->pending[--t->pendingCount];
+        while (inWindow(t, pc) && !REACHED(t, pc)) {
+            REACHED(t, pc) = true;
+            const Instruction* ins = fetch(t->vm, pc);
+            switch (ins->operation) {
+                case OP_JMP: case OP_JLE: case OP_JL: case OP_JE: case OP_JNE: case OP_JGE: case OP_JG:
+                    addLabel(t, ins->valC);
+                    break;
+                case OP_CALL:
+                    addLabel(t, ins->valC);
+                    addLabel(t, ins->valP);
+                    break;
+            }
+            if (!fallsThrough((Operation)ins->operation)) {
+                break;
+            }
+            pc = ins->valP;
+            if (inWindow(t, pc) && REACHED(t, pc)) {
+                LABELLED(t, pc) = true;
+            }
+        }
+    }
+    /* Instructions overlapping each other interleave in address order, the
+     * ones falling through to something else than the next emitted one need
+     * a label to jump to */
+    vm_quad_t previous = -1;
+    vm_quad_t end      = t->base + AOT_WINDOW;
+    for (vm_quad_t pc = t->base; pc <= end; ++pc) {
+        if (pc < end && !REACHED(t, pc)) {
+            continue;
+        }
+        if (previous >= 0) {
+            const Instruction* ins = fetch(t->vm, previous);
+            if (fallsThrough((Operation)ins->operation) && ins->valP != pc &&
+                inWindow(t, ins->valP) && REACHED(t, ins->valP)) {
+                LABELLED(t, ins->valP) = true;
+            }
+        }
+        previous = pc;
+    }
+}
+
+/* -----Emission----- */
+static void emitJump(Translator* t, vm_quad_t target) {
+    if (inWindow(t, target) && LABELLED(t, target)) {
+        fprintf(t->file, "{ if (retired >= slice) { s->pc = %" PRId64 "; goto leave; } goto L_%04" PRIx64 "; }",
+                target, target);
+    } else {
+        fprintf(t->file, "{ s->pc = %" PRId64 "; goto leave; }", target);
+    }
+}
+
+static void emitLeave(Translator* t, vm_quad_t pc) {
+    fprintf(t->file, "{ s->pc = %" PRId64 "; goto leave; }", pc);
+}
+
+/* Leaves before the instruction at pc retired, the interpreter executes it */
+static void emitFault(Translator* t, vm_quad_t pc) {
+    fprintf(t->file, "{ retired--; s->pc = %" PRId64 "; goto leave; }", pc);
+}
+
+static const char* conditionSource(Operation operation) {
+    switch (operation) {
+        case OP_JLE: case OP_CMOVLE: return "(cc & 3)";
+        case OP_JL:  case OP_CMOVL:  return "(cc & 2)";
+        case OP_JE:  case OP_CMOVE:  return "(cc & 1)";
+        case OP_JNE: case OP_CMOVNE: return "!(cc & 1)";
+        case OP_JGE: case OP_CMOVGE: return "!(cc & 2)";
+        default:                     return "!(cc & 3)";
+    }
+}
+
+static void emitInstruction(Translator* t, vm_quad_t pc, const Instruction* ins) {
+    FILE* file = t->file;
+    int rA = ins->rA;
+    int rB = ins->rB;
+    fprintf(file, "    /* 0x%04" PRIx64 " %s */\n    retired++; ", pc, operationName((Operation)ins->operation));
+    switch (ins->operation) {
+        case OP_HALT:
+            fprintf(file, "s->statusCondition = %d; ", STAT_HLT);
+            emitLeave(t, ins->valP);
+            break;
+        case OP_NOP:
+            fprintf(file, ";");
+            break;
+        case OP_RRMOVQ:
+            fprintf(file, "r%d = r%d;", rB, rA);
+            break;
+        case OP_IRMOVQ:
+            fprintf(file, "r%d = (int64_t)0x%" PRIx64 "u;", rB, (uint64_t)ins->valC);
+            break;
+        case OP_RMMOVQ:
+            fprintf(file, "{ int64_t a = ADDRESS(r%d, 0x%" PRIx64 "u); if (!IN_MEM(a)) ", rB, (uint64_t)ins->valC);
+            emitFault(t, pc);
+            fprintf(file, " if (s->store(s, a, r%d)) ", rA);
+            emitLeave(t, ins->valP);
+            fprintf(file, " }");
+            break;
+        case OP_MRMOVQ:
+            fprintf(file, "{ int64_t a = ADDRESS(r%d, 0x%" PRIx64 "u); if (!IN_MEM(a)) ", rB, (uint64_t)ins->valC);
+            emitFault(t, pc);
+            fprintf(file, " r%d = s->load(s, a); }", rA);
+            break;
+        case OP_ADDQ:
+            fprintf(file, "{ int64_t e; int o = __builtin_add_overflow(r%d, r%d, &e); cc = FLAGS(e, o); r%d = e; }", rB, rA, rB);
+            break;
+        case OP_SUBQ:
+            fprintf(file, "{ int64_t e; int o = __builtin_sub_overflow(r%d, r%d, &e); cc = FLAGS(e, o); r%d = e; }", rB, rA, rB);
+            break;
+        case OP_ANDQ:
+            fprintf(file, "{ int64_t e = r%d & r%d; cc = FLAGS(e, 0); r%d = e; }", rB, rA, rB);
+            break;
+        case OP_XORQ:
+            fprintf(file, "{ int64_t e = r%d ^ r%d; cc = FLAGS(e, 0); r%d = e; }", rB, rA, rB);
+            break;
+        case OP_JMP:
+            emitJump(t, ins->valC);
+            break;
+        case OP_JLE: case OP_JL: case OP_JE: case OP_JNE: case OP_JGE: case OP_JG:
+            fprintf(file, "if (%s) ", conditionSource((Operation)ins->operation));
+            emitJump(t, ins->valC);
+            break;
+        case OP_CMOVLE: case OP_CMOVL: case OP_CMOVE: case OP_CMOVNE: case OP_CMOVGE: case OP_CMOVG:
+            fprintf(file, "if (%s) r%d = r%d;", conditionSource((Operation)ins->operation), rB, rA);
+            break;
+        case OP_CALL:
+            fprintf(file, "{ int64_t a = ADDRESS(r%d, -8); if (!IN_MEM(a)) ", REG_RSP);
+            emitFault(t, pc);
+            fprintf(file, " int stale = s->store(s, a, %" PRId64 "); r%d = a; if (stale) ", ins->valP, REG_RSP);
+            emitLeave(t, ins->valC);
+            fprintf(file, " ");
+            emitJump(t, ins->valC);
+            fprintf(file, " }");
+            break;
+        case OP_RET:
+            fprintf(file, "{ int64_t a = r%d; if (!IN_MEM(a)) ", REG_RSP);
+            emitFault(t, pc);
+            fprintf(file, " s->pc = s->load(s, a); r%d = ADDRESS(a, 8); goto dispatch; }", REG_RSP);
+            break;
+        case OP_PUSHQ:
+            fprintf(file, "{ int64_t a = ADDRESS(r%d, -8); if (!IN_MEM(a)) ", REG_RSP);
+            emitFault(t, pc);
+            fprintf(file, " int stale = s->store(s, a, r%d); r%d = a; if (stale) ", rA, REG_RSP);
+            emitLeave(t, ins->valP);
+            fprintf(file, " }");
+            break;
+        case OP_POPQ:
+            fprintf(file, "{ int64_t a = r%d; if (!IN_MEM(a)) ", REG_RSP);
+            emitFault(t, pc);
+            fprintf(file, " int64_t v = s->load(s, a); r%d = ADDRESS(a, 8); r%d = v; }", REG_RSP, rA);
+            break;
+        default:
+            /* The interpreter raises the status of invalid instructions */
+            emitFault(t, pc);
+            break;
+    }
+    fprintf(file, "\n");
+}
+
+bool aotTranslate(VM* vm, vm_quad_t entry, FILE* file) {
+    Translator t;
+    t.vm              = vm;
+    t.file            = file;
+    t.base            = entry & ~PAGE_MASK;
+    t.reached         = INIT_ARRAY(bool, NULL, AOT_WINDOW);
+    t.labelled        = INIT_ARRAY(bool, NULL, AOT_WINDOW);
+    t.pending         = NULL;
+    t.pendingCount    = 0;
+    t.pendingCapacity = 0;
+    discover(&t, entry);
+
+    vm_quad_t start = VM_ADDRESS_LIMIT;
+    vm_quad_t end   = 0;
+    for (vm_quad_t pc = t.base; pc < t.base + AOT_WINDOW; ++pc) {
+        if (REACHED(&t, pc)) {
+            const Instruction* ins = fetch(vm, pc);
+            vm_quad_t last = pc + (ins->length > 0 ? ins->length : 1);
+            start = pc < start ? pc : start;
+            end   = last > end ? last : end;
+        }
+    }
+    if (end > VM_ADDRESS_LIMIT) {
+        end = VM_ADDRESS_LIMIT;
+    }
+    bool translated = start < end;
+    if (translated) {
+        fprintf(file, "/* Translated by cero from the guest bytes 0x%04" PRIx64 "-0x%04" PRIx64 ", do not edit */\n", start, end);
+        fprintf(file, "#include <stdint.h>\n#include <string.h>\n\n");
+        fprintf(file, "%s;\n\n", AOT_EXPAND_STRINGIFY(AOT_STATE));
+        fprintf(file, "#define MEM_LIMIT (%" PRId64 "ll)\n", VM_ADDRESS_LIMIT);
+        fprintf(file, "#define IN_MEM(a) ((a) >= 0 && (a) <= MEM_LIMIT - 8)\n");
+        fprintf(file, "#define ADDRESS(b, d) ((int64_t)((uint64_t)(b) + (uint64_t)(d)))\n");
+        fprintf(file, "#define FLAGS(e, o) ((uint8_t)(((e) == 0) << %d | ((e) < 0) << %d | (o) << %d))\n\n", CC_ZF, CC_SF, CC_OF);
+        fprintf(file, "const uint32_t cero_aot_abi      = %d;\n", AOT_ABI_VERSION);
+        fprintf(file, "const int64_t  cero_aot_limit    = %" PRId64 ";\n", VM_ADDRESS_LIMIT);
+        fprintf(file, "const int64_t  cero_aot_start    = %" PRId64 ";\n", start);
+        fprintf(file, "const int64_t  cero_aot_end      = %" PRId64 ";\n", end);
+        fprintf(file, "const uint64_t cero_aot_checksum = 0x%" PRIx64 "u;\n\n", checksum(vm, start, end));
+
+        fprintf(file, "void cero_aot_run(struct AotState* s) {\n");
+        fprintf(file, "    uint8_t cc = s->conditionCodes;\n");
+        fprintf(file, "    int64_t retired = 0;\n");
+        fprintf(file, "    const int64_t slice = s->slice;\n");
+        for (int reg = 0; reg < REG_COUNT; ++reg) {
+            fprintf(file, "    int64_t r%d = s->registers[%d];\n", reg, reg);
+        }
+        fprintf(file, "    goto dispatch;\n");
+        for (vm_quad_t pc = t.base; pc < t.base + AOT_WINDOW; ++pc) {
+            if (!REACHED(&t, pc)) {
+                continue;
+            }
+            const Instruction* ins = fetch(vm, pc);
+            if (LABELLED(&t, pc)) {
+                fprintf(file, "L_%04" PRIx64 ":\n", pc);
+            }
+            emitInstruction(&t, pc, ins);
+            if (fallsThrough((Operation)ins->operation)) {
+                vm_quad_t next = pc + 1;
+                while (next < t.base + AOT_WINDOW && !REACHED(&t, next)) {
+                    next++;
+                }
+                if (next != ins->valP) {
+                    fprintf(file, "    ");
+                    emitJump(&t, ins->valP);
+                    fprintf(file, "\n");
+                }
+            }
+        }
+        fprintf(file, "dispatch:\n    if (retired >= slice) goto leave;\n    switch (s->pc) {\n");
+        for (vm_quad_t pc = t.base; pc < t.base + AOT_WINDOW; ++pc) {
+            if (LABELLED(&t, pc)) {
+                fprintf(file, "        case %" PRId64 ": goto L_%04" PRIx64 ";\n", pc, pc);
+            }
+        }
+        fprintf(file, "        default: break;\n    }\n");
+        fprintf(file, "leave:\n");
+        for (int reg = 0; reg < REG_COUNT; ++reg) {
+            fprintf(file, "    s->registers[%d] = r%d;\n", reg, reg);
+        }
+        fprintf(file, "    s->conditionCodes = cc;\n");
+        fprintf(file, "    s->retired = retired;\n}\n");
+    }
+
+    FREE_ARRAY(bool, t.reached, AOT_WINDOW);
+    FREE_ARRAY(bool, t.labelled, AOT_WINDOW);
+    FREE_ARRAY(vm_quad_t, t.pending, t.pendingCapacity);
+    return translated && !ferror(file);
+}
+
+/* Most words AOT_CC and AOT_CFLAGS can hold together */
+#define AOT_MAX_ARGUMENTS (32)
+
+/* Runs the compiler without a shell, the paths are passed as they are */
+bool aotCompile(const char* source, const char* library) {
+    char words[] = AOT_CC " " AOT_CFLAGS;
+    char* arguments[AOT_MAX_ARGUMENTS + 4];
+    int count = 0;
+    for (char* word = strtok(words, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+        if (count == AOT_MAX_ARGUMENTS) {
+            CERO_ERROR("aot::compile more than %d words in AOT_CC and AOT_CFLAGS\n", AOT_MAX_ARGUMENTS);
+            return false;
+        }
+        arguments[count++] = word;
+    }
+    arguments[count++] = "-o";
+    arguments[count++] = (char*)library;
+    arguments[count++] = (char*)source;
+    arguments[count]   = NULL;
+    CERO_DEBUG("aot::compile " AOT_CC " " AOT_CFLAGS " -o %s %s\n", library, source);
+    fflush(NULL);
+    pid_t child = fork();
+    if (child == -1) {
+        CERO_ERROR("aot::compile unable to fork: %s\n", strerror(errno));
+        return false;
+    }
+    if (child == 0) {
+        execvp(arguments[0], arguments);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(child, &status, 0) == -1) {
+        if (errno != EINTR) {
+            CERO_ERROR("aot::compile unable to wait for " AOT_CC ": %s\n", strerror(errno));
+            return false;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        CERO_ERROR("aot::compile " AOT_CC " failed on %s\n", source);
+        return false;
+    }
+    return true;
+}
+
+static int64_t aotLoad(AotState* state, int64_t addr) {
+    return m8r(state->vm, addr);
+}
+
+/* Stores from translated code, the translation is stale once it wrote to its own bytes */
+static int aotStore(AotState* state, int64_t addr, int64_t value) {
+    VM* vm = state->vm;
+    m8w(vm, addr, value);
+    if (addr + 8 > vm->cold->aot->start && addr < vm->cold->aot->end) {
+        vm->cold->aot->stale = true;
+        return 1;
+    }
+    return 0;
+}
+
+bool loadAot(VM* vm, const char* library) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", strchr(library, '/') != NULL ? "" : "./", library);
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        CERO_ERROR("aot::load %s\n", dlerror());
+        return false;
+    }
+    const uint32_t* abi      = dlsym(handle, "cero_aot_abi");
+    const int64_t* limit     = dlsym(handle, "cero_aot_limit");
+    const int64_t* start     = dlsym(handle, "cero_aot_start");
+    const int64_t* end       = dlsym(handle, "cero_aot_end");
+    const uint64_t* sum      = dlsym(handle, "cero_aot_checksum");
+    void* entry              = dlsym(handle, "cero_aot_run");
+    if (abi == NULL || limit == NULL || start == NULL || end == NULL || sum == NULL || entry == NULL ||
+        *abi != AOT_ABI_VERSION || *limit != VM_ADDRESS_LIMIT) {
+        CERO_ERROR("aot::load %s was not translated for this VM\n", path);
+        dlclose(handle);
+        return false;
+    }
+    if (*start < 0 || *end > VM_ADDRESS_LIMIT || *start >= *end || checksum(vm, *start, *end) != *sum) {
+        CERO_ERROR("aot::load %s was translated from other guest bytes\n", path);
+        dlclose(handle);
+        return false;
+    }
+    freeAot(vm);
+    Aot* aot     = INIT_ARRAY(Aot, NULL, 1);
+    aot->library = handle;
+    aot->entry   = (void (*)(AotState*))entry;
+    aot->start   = *start;
+    aot->end     = *end;
+    aot->stale   = false;
+    vm->cold->aot = aot;
+    return true;
+}
+
+bool buildAot(VM* vm, vm_quad_t entry, const char* name) {
+    char source[512];
+    char library[512];
+    snprintf(source, sizeof(source), "%s.c", name);
+    snprintf(library, sizeof(library), "%s.so", name);
+    FILE* file = fopen(source, "w");
+    if (file == NULL) {
+        CERO_ERROR("aot::build unable to write %s\n", source);
+        return false;
+    }
+    bool translated = aotTranslate(vm, entry, file);
+    fclose(file);
+    return translated && aotCompile(source, library) && loadAot(vm, library);
+}
+
+void runAot(VM* vm) {
+    while (vm->statusCondition == STAT_AOK) {
+        if (vm->cold->aot != NULL && !vm->cold->aot->stale) {
+            syncConditionCodes(vm);
+            AotState state;
+            state.pc              = vm->pc;
+            state.statusCondition = vm->statusCondition;
+            state.conditionCodes  = vm->conditionCodes;
+            state.registers       = vm->registers;
+            state.vm              = vm;
+            state.retired         = 0;
+            state.slice           = vm->cold->metrics != NULL ? METRICS_SLICE : INT64_MAX;
+            state.load            = aotLoad;
+            state.store           = aotStore;
+            vm->cold->aot->entry(&state);
+            vm->pc              = state.pc;
+            vm->statusCondition = (StatusCondition)state.statusCondition;
+            vm->conditionCodes  = state.conditionCodes;
+            if (vm->cold->metrics != NULL) {
+                retireBlock(vm, (uint64_t)state.retired);
+            }
+            if (vm->cold->aot->stale) {
+                CERO_WARN("aot::stale the guest wrote to its translated code, interpreting instead\n");
+            }
+            if (vm->statusCondition != STAT_AOK) {
+                break;
+            }
+        }
+        runBasicBlock(vm);
+    }
+}
+
+void freeAot(VM* vm) {
+    if (vm->cold->aot == NULL) {
+        return;
+    }
+    dlclose(vm->cold->aot->library);
+    FREE_ARRAY(Aot, vm->cold->aot, 1);
+    vm->cold->aot = NULL;
+}
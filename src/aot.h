@@ -0,0 +1,54 @@
+#ifndef cero_aot_h
+#define cero_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+/* Host C compiler and flags used by aotCompile */
+#ifndef AOT_CC
+#define AOT_CC "gcc"
+#endif
+
+#ifndef AOT_CFLAGS
+#define AOT_CFLAGS "-O2 -shared -fPIC"
+#endif
+
+/* Bumped whenever AOT_STATE or the symbols of the generated code change */
+#define AOT_ABI_VERSION (3)
+
+/* Size of the range of guest addresses around the entry that is translated */
+#ifndef AOT_WINDOW
+#define AOT_WINDOW (1 << 20)
+#endif
+
+/* The state translated code runs on. The generated translation unit gets the
+ * very same definition as source text, so it never includes any header of the
+ * VM. Registers and the condition codes are copied into locals on entry and
+ * written back on every exit. */
+#define AOT_STATE                                                                                \
+    struct AotState {                                                                            \
+        int64_t pc;                                        /* PC to start at, and where it left */ \
+        int32_t statusCondition;                           /* Set to STAT_HLT by halt            */ \
+        uint8_t conditionCodes;                            /* CC_ZF, CC_SF and CC_OF             */ \
+        int64_t* registers;                                /* The 16 registers of the VM         */ \
+        void* vm;                                          /* The VM, opaque to translated code  */ \
+        int64_t retired;                                   /* Instructions retired before leaving */ \
+        int64_t slice;                                     /* Jumps leave once that many retired */ \
+        int64_t (*load)(struct AotState* state, int64_t addr);             /* Reads guest memory  */ \
+        int (*store)(struct AotState* state, int64_t addr, int64_t value); /* Non-zero if stale */ \
+    }
+
+AOT_STATE;
+
+typedef struct AotState AotState;
+
+bool aotTranslate(VM* vm, vm_quad_t entry, FILE* file);
+bool aotCompile(const char* source, const char* library);
+bool loadAot(VM* vm, const char* library);
+bool buildAot(VM* vm, vm_quad_t entry, const char* name);
+void runAot(VM* vm);
+void freeAot(VM* vm);
+
+#endif
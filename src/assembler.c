@@ -0,0 +1,546 @@
+#include <string.h>
+
+#include "assembler.h"
+#include "memory.h"
+
+/* -----Assembler-----
+ * A single pass over the source. The tokenizer reads one statement at a time
+ * straight from the source, and every instruction is encoded by the Writer as
+ * soon as it is read. A quad naming a label that is not defined yet is written
+ * as 0 and left to the Writer to fix up once the source has been read (see
+ * fixupQuad). Assembling is therefore linear in the size of the source.
+ *
+ * The syntax is that of the CS:APP yas assembler:
+ *     # comment, and C comments
+ *     label:
+ *         irmovq $10, %rax          irmovq label, %rax
+ *         rmmovq %rax, 8(%rbx)      mrmovq label(%rbx), %rax    mrmovq (%rbx), %rax
+ *         addq %rax, %rbx           jne label                    pushq %rax
+ *         .pos 0x100                .align 8                     .quad 0x10    .quad label
+ * Numbers are decimal or 0x hexadecimal, optionally negative. Immediates may
+ * have a leading $.
+ */
+
+struct AsmLabel {
+    const char* name;
+    uint32_t length;
+    uint32_t hash;
+    WriterLabel label;
+    uint32_t line;           /* Where it was first named   */
+};
+
+typedef enum {
+    ASM_NONE,                /* halt                       */
+    ASM_RR,                  /* addq rA, rB                */
+    ASM_IR,                  /* irmovq V, rB               */
+    ASM_RM,                  /* rmmovq rA, D(rB)           */
+    ASM_MR,                  /* mrmovq D(rB), rA           */
+    ASM_DEST,                /* jmp Dest                   */
+    ASM_R                    /* pushq rA                   */
+} AsmOperands;
+
+typedef struct {
+    const char* name;
+    AsmOperands operands;
+    union {
+        void (*none)(Writer* writer);
+        void (*registers)(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
+        void (*registerQuad)(Writer* writer, vm_ubyte_t rA, vm_quad_t v);
+        void (*registersQuad)(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB, vm_quad_t d);
+        void (*quad)(Writer* writer, vm_quad_t dest);
+        void (*reg)(Writer* writer, vm_ubyte_t rA);
+    } write;
+} AsmMnemonic;
+
+static const AsmMnemonic mnemonics[] = {
+    { "halt",   ASM_NONE, { .none = haltWrite } },
+    { "nop",    ASM_NONE, { .none = nopWrite } },
+    { "ret",    ASM_NONE, { .none = retWrite } },
+    { "rrmovq", ASM_RR,   { .registers = rrmovqWrite } },
+    { "addq",   ASM_RR,   { .registers = addqWrite } },
+    { "subq",   ASM_RR,   { .registers = subqWrite } },
+    { "andq",   ASM_RR,   { .registers = andqWrite } },
+    { "xorq",   ASM_RR,   { .registers = xorqWrite } },
+    { "cmovle", ASM_RR,   { .registers = cmovleWrite } },
+    { "cmovl",  ASM_RR,   { .registers = cmovlWrite } },
+    { "cmove",  ASM_RR,   { .registers = cmoveWrite } },
+    { "cmovne", ASM_RR,   { .registers = cmovneWrite } },
+    { "cmovge", ASM_RR,   { .registers = cmovgeWrite } },
+    { "cmovg",  ASM_RR,   { .registers = cmovgWrite } },
+    { "irmovq", ASM_IR,   { .registerQuad = irmovqWrite } },
+    { "rmmovq", ASM_RM,   { .registersQuad = rmmovqWrite } },
+    { "mrmovq", ASM_MR,   { .registersQuad = mrmovqWrite } },
+    { "jmp",    ASM_DEST, { .quad = jmpWrite } },
+    { "jle",    ASM_DEST, { .quad = jleWrite } },
+    { "jl",     ASM_DEST, { .quad = jlWrite } },
+    { "je",     ASM_DEST, { .quad = jeWrite } },
+    { "jne",    ASM_DEST, { .quad = jneWrite } },
+    { "jge",    ASM_DEST, { .quad = jgeWrite } },
+    { "jg",     ASM_DEST, { .quad = jgWrite } },
+    { "call",   ASM_DEST, { .quad = callWrite } },
+    { "pushq",  ASM_R,    { .reg = pushqWrite } },
+    { "popq",   ASM_R,    { .reg = popqWrite } },
+};
+
+#define MNEMONIC_COUNT (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+/* Indexed by REG_X */
+static const char* registerNames[REG_COUNT - 1] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14"
+};
+
+/* Offset of the quad of an instruction, where a fixup goes */
+#define QUAD_OFFSET_DEST (1)
+#define QUAD_OFFSET_REGS (2)
+
+void initAssembler(Assembler* assembler) {
+    assembler->labels        = NULL;
+    assembler->labelCount    = 0;
+    assembler->labelCapacity = 0;
+    assembler->table         = NULL;
+    assembler->tableCapacity = 0;
+    assembler->current       = NULL;
+    assembler->end           = NULL;
+    assembler->line          = 1;
+    assembler->failed        = false;
+    initWriter(&assembler->writer, NULL, 0, 0);
+}
+
+void freeAssembler(Assembler* assembler) {
+    freeWriter(&assembler->writer);
+    FREE_ARRAY(AsmLabel, assembler->labels, assembler->labelCapacity);
+    FREE_ARRAY(uint32_t, assembler->table, assembler->tableCapacity);
+    initAssembler(assembler);
+}
+
+static void error(Assembler* assembler, const char* message, const char* token, size_t length) {
+    if (!assembler->failed) {
+        CERO_ERROR("asm::line %u: %s '%.*s'\n", assembler->line, message, (int)length, token);
+    }
+    assembler->failed = true;
+}
+
+/* -----Labels----- */
+static uint32_t hashName(const char* name, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; ++i) {
+        hash = (hash ^ (vm_ubyte_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* The slot of the table holding the label, or the empty one it goes in */
+static uint32_t* findSlot(Assembler* assembler, const char* name, uint32_t length, uint32_t hash) {
+    uint32_t mask  = assembler->tableCapacity - 1;
+    uint32_t index = hash & mask;
+    while (true) {
+        uint32_t* slot = &assembler->table[index];
+        if (*slot == 0) {
+            return slot;
+        }
+        AsmLabel* label = &assembler->labels[*slot - 1];
+        if (label->hash == hash && label->length == length && memcmp(label->name, name, length) == 0) {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void growTable(Assembler* assembler) {
+    FREE_ARRAY(uint32_t, assembler->table, assembler->tableCapacity);
+    assembler->tableCapacity = GROW_CAPACITY(assembler->tableCapacity);
+    assembler->table         = INIT_ARRAY(uint32_t, NULL, assembler->tableCapacity);
+    for (uint32_t i = 0; i < assembler->labelCount; ++i) {
+        AsmLabel* label = &assembler->labels[i];
+        *findSlot(assembler, label->name, label->length, label->hash) = i + 1;
+    }
+}
+
+/* Index of the label in labels, added undefined if it was not named before */
+static uint32_t findLabel(Assembler* assembler, const char* name, uint32_t length) {
+    if (assembler->labelCount + 1 > assembler->tableCapacity / 4 * 3) {
+        growTable(assembler);
+    }
+    uint32_t hash  = hashName(name, length);
+    uint32_t* slot = findSlot(assembler, name, length, hash);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    if (assembler->labelCount == assembler->labelCapacity) {
+        uint32_t oldCapacity = assembler->labelCapacity;
+        assembler->labelCapacity = GROW_CAPACITY(oldCapacity);
+        assembler->labels        = GROW_ARRAY(AsmLabel, assembler->labels, oldCapacity, assembler->labelCapacity);
+    }
+    AsmLabel* label = &assembler->labels[assembler->labelCount];
+    label->name    = name;
+    label->length  = length;
+    label->hash    = hash;
+    label->label   = newLabel(&assembler->writer);
+    label->line    = assembler->line;
+    *slot = ++assembler->labelCount;
+    return assembler->labelCount - 1;
+}
+
+/* -----Tokenizer----- */
+static inline bool isIdentifierStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
+
+static inline bool isIdentifier(char c) {
+    return isIdentifierStart(c) || (c >= '0' && c <= '9');
+}
+
+/* Skips blanks and comments, not the end of the line */
+static void skipBlanks(Assembler* assembler) {
+    const char* current = assembler->current;
+    const char* end     = assembler->end;
+    while (current < end) {
+        char c = *current;
+        if (c == ' ' || c == '\t' || c == '\r') {
+            current++;
+        } else if (c == '#') {
+            while (current < end && *current != '\n') {
+                current++;
+            }
+        } else if (c == '/' && current + 1 < end && current[1] == '*') {
+            current += 2;
+            while (current < end && !(*current == '*' && current + 1 < end && current[1] == '/')) {
+                assembler->line += *current == '\n';
+                current++;
+            }
+            current = current < end ? current + 2 : end;
+        } else {
+            break;
+        }
+    }
+    assembler->current = current;
+}
+
+static bool match(Assembler* assembler, char expected) {
+    skipBlanks(assembler);
+    if (assembler->current < assembler->end && *assembler->current == expected) {
+        assembler->current++;
+        return true;
+    }
+    return false;
+}
+
+static bool expect(Assembler* assembler, char expected, const char* message) {
+    if (!match(assembler, expected)) {
+        const char* token = assembler->current;
+        error(assembler, message, token, token < assembler->end && *token != '\n' ? 1 : 0);
+        return false;
+    }
+    return true;
+}
+
+static uint32_t identifierLength(Assembler* assembler) {
+    const char* current = assembler->current;
+    while (current < assembler->end && isIdentifier(*current)) {
+        current++;
+    }
+    return (uint32_t)(current - assembler->current);
+}
+
+static bool readRegister(Assembler* assembler, vm_ubyte_t* reg) {
+    if (!expect(assembler, '%', "expected a register at")) {
+        return false;
+    }
+    const char* name = assembler->current;
+    uint32_t length  = identifierLength(assembler);
+    for (vm_ubyte_t r = 0; r < REG_COUNT - 1; ++r) {
+        if (strlen(registerNames[r]) == length && memcmp(registerNames[r], name, length) == 0) {
+            assembler->current += length;
+            *reg = r;
+            return true;
+        }
+    }
+    error(assembler, "unknown register", name, length);
+    return false;
+}
+
+static bool readNumber(Assembler* assembler, vm_quad_t* value) {
+    const char* current = assembler->current;
+    const char* end     = assembler->end;
+    bool negative = current < end && *current == '-';
+    current += negative;
+    uint64_t number = 0;
+    bool overflow   = false;
+    const char* digits = current;
+    if (current + 1 < end && current[0] == '0' && (current[1] == 'x' || current[1] == 'X')) {
+        current += 2;
+        digits   = current;
+        while (current < end) {
+            char c = *current;
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                break;
+            }
+            overflow |= number >> 60 != 0;
+            number    = number << 4 | (uint64_t)digit;
+            current++;
+        }
+    } else {
+        while (current < end && *current >= '0' && *current <= '9') {
+            uint64_t digit = (uint64_t)(*current - '0');
+            overflow |= number > (UINT64_MAX - digit) / 10;
+            number    = number * 10 + digit;
+            current++;
+        }
+    }
+    /* More than 64 bits, or than 16 hex digits, do not fit a quad */
+    if (current == digits || overflow || (current < end && isIdentifier(*current))) {
+        error(assembler, "malformed number", assembler->current, current - assembler->current + (!overflow && current < end));
+        return false;
+    }
+    assembler->current = current;
+    *value = (vm_quad_t)(negative ? 0 - number : number);
+    return true;
+}
+
+/* A number or a label. A label that is not defined yet reads as 0 and
+ * *label is set to its index, otherwise to UINT32_MAX */
+static bool readValue(Assembler* assembler, vm_quad_t* value, uint32_t* label) {
+    skipBlanks(assembler);
+    *label = UINT32_MAX;
+    if (assembler->current < assembler->end && isIdentifierStart(*assembler->current)) {
+        const char* name = assembler->current;
+        uint32_t length  = identifierLength(assembler);
+        assembler->current += length;
+        uint32_t index = findLabel(assembler, name, length);
+        *value = labelAddress(&assembler->writer, assembler->labels[index].label);
+        if (*value == WRITER_UNBOUND) {
+            *value = 0;
+            *label = index;
+        }
+        return true;
+    }
+    return readNumber(assembler, value);
+}
+
+/* A quad of the instruction being written at offset of its first byte */
+static void fixupLater(Assembler* assembler, uint32_t label, uint32_t offset) {
+    if (label != UINT32_MAX) {
+        fixupQuad(&assembler->writer, assembler->writer.offset + offset, assembler->labels[label].label);
+    }
+}
+
+/* D(rB), where either side may be left out */
+static bool readMemory(Assembler* assembler, vm_quad_t* displacement, uint32_t* label, vm_ubyte_t* rB) {
+    skipBlanks(assembler);
+    *displacement = 0;
+    *label        = UINT32_MAX;
+    if (assembler->current < assembler->end && *assembler->current != '(' &&
+        !readValue(assembler, displacement, label)) {
+        return false;
+    }
+    *rB = REG_F;
+    if (match(assembler, '(')) {
+        return readRegister(assembler, rB) && expect(assembler, ')', "expected ')' at");
+    }
+    return true;
+}
+
+/* -----Statements----- */
+static void instruction(Assembler* assembler, const char* name, uint32_t length) {
+    const AsmMnemonic* mnemonic = NULL;
+    for (size_t i = 0; i < MNEMONIC_COUNT; ++i) {
+        if (mnemonics[i].name[0] == name[0] && strlen(mnemonics[i].name) == length && memcmp(mnemonics[i].name, name, length) == 0) {
+            mnemonic = &mnemonics[i];
+            break;
+        }
+    }
+    if (mnemonic == NULL) {
+        error(assembler, "unknown instruction", name, length);
+        return;
+    }
+    Writer* writer = &assembler->writer;
+    vm_ubyte_t rA;
+    vm_ubyte_t rB;
+    vm_quad_t value;
+    uint32_t label;
+    switch (mnemonic->operands) {
+        case ASM_NONE:
+            mnemonic->write.none(writer);
+            break;
+        case ASM_RR:
+            if (readRegister(assembler, &rA) && expect(assembler, ',', "expected ',' at") && readRegister(assembler, &rB)) {
+                mnemonic->write.registers(writer, rA, rB);
+            }
+            break;
+        case ASM_IR:
+            match(assembler, '$');
+            if (readValue(assembler, &value, &label) && expect(assembler, ',', "expected ',' at") &&
+                readRegister(assembler, &rB)) {
+                fixupLater(assembler, label, QUAD_OFFSET_REGS);
+                mnemonic->write.registerQuad(writer, rB, value);
+            }
+            break;
+        case ASM_RM:
+            if (readRegister(assembler, &rA) && expect(assembler, ',', "expected ',' at") &&
+                readMemory(assembler, &value, &label, &rB)) {
+                fixupLater(assembler, label, QUAD_OFFSET_REGS);
+                mnemonic->write.registersQuad(writer, rA, rB, value);
+            }
+            break;
+        case ASM_MR:
+            if (readMemory(assembler, &value, &label, &rB) && expect(assembler, ',', "expected ',' at") &&
+                readRegister(assembler, &rA)) {
+                fixupLater(assembler, label, QUAD_OFFSET_REGS);
+                mnemonic->write.registersQuad(writer, rA, rB, value);
+            }
+            break;
+        case ASM_DEST:
+            if (readValue(assembler, &value, &label)) {
+                fixupLater(assembler, label, QUAD_OFFSET_DEST);
+                mnemonic->write.quad(writer, value);
+            }
+            break;
+        case ASM_R:
+            if (readRegister(assembler, &rA)) {
+                mnemonic->write.reg(writer, rA);
+            }
+            break;
+    }
+}
+
+/* The value of .pos and .align, labels have to be defined before */
+static bool readAddress(Assembler* assembler, vm_quad_t* value) {
+    uint32_t label;
+    const char* token = assembler->current;
+    if (!readValue(assembler, value, &label)) {
+        return false;
+    }
+    if (label != UINT32_MAX) {
+        error(assembler, "label not defined yet", token, assembler->current - token);
+        return false;
+    }
+    if (*value < 0 || *value > ASSEMBLER_MAX_ADDRESS) {
+        error(assembler, "address out of range", token, assembler->current - token);
+        return false;
+    }
+    return true;
+}
+
+static void directive(Assembler* assembler, const char* name, uint32_t length) {
+    vm_quad_t value;
+    uint32_t label;
+    if (length == 4 && memcmp(name, ".pos", 4) == 0) {
+        if (readAddress(assembler, &value)) {
+            assembler->writer.offset = (uint32_t)value;
+        }
+    } else if (length == 6 && memcmp(name, ".align", 6) == 0) {
+        if (readAddress(assembler, &value)) {
+            if (value == 0 || (value & (value - 1)) != 0) {
+                error(assembler, "alignment is not a power of two", name, length);
+                return;
+            }
+            vm_quad_t offset = ((vm_quad_t)assembler->writer.offset + value - 1) & ~(value - 1);
+            if (offset > ASSEMBLER_MAX_ADDRESS) {
+                error(assembler, "address out of range", name, length);
+                return;
+            }
+            assembler->writer.offset = (uint32_t)offset;
+        }
+    } else if (length == 5 && memcmp(name, ".quad", 5) == 0) {
+        match(assembler, '$');
+        if (readValue(assembler, &value, &label)) {
+            fixupLater(assembler, label, 0);
+            quadWrite(&assembler->writer, value);
+        }
+    } else {
+        error(assembler, "unknown directive", name, length);
+    }
+}
+
+static void defineLabel(Assembler* assembler, const char* name, uint32_t length) {
+    uint32_t index    = findLabel(assembler, name, length);
+    WriterLabel label = assembler->labels[index].label;
+    if (labelAddress(&assembler->writer, label) != WRITER_UNBOUND) {
+        error(assembler, "label defined twice", name, length);
+        return;
+    }
+    bindLabel(&assembler->writer, label);
+}
+
+/* Labels, then at most one instruction or directive, up to the end of the line */
+static void statement(Assembler* assembler) {
+    while (true) {
+        skipBlanks(assembler);
+        if (assembler->current >= assembler->end || *assembler->current == '\n') {
+            return;
+        }
+        const char* name = assembler->current;
+        uint32_t length  = isIdentifierStart(*name) ? identifierLength(assembler) : 0;
+        if (length == 0) {
+            error(assembler, "unexpected", name, 1);
+            return;
+        }
+        assembler->current += length;
+        if (match(assembler, ':')) {
+            defineLabel(assembler, name, length);
+            continue;
+        }
+        if (name[0] == '.') {
+            directive(assembler, name, length);
+        } else {
+            instruction(assembler, name, length);
+        }
+        if (assembler->failed) {
+            return;
+        }
+        skipBlanks(assembler);
+        if (assembler->current < assembler->end && *assembler->current != '\n') {
+            error(assembler, "unexpected", assembler->current, 1);
+        }
+        return;
+    }
+}
+
+/* Reports the first label named but never defined, the Writer sets the rest */
+static void resolveLabelsOf(Assembler* assembler) {
+    for (uint32_t i = 0; i < assembler->labelCount && !assembler->failed; ++i) {
+        AsmLabel* label = &assembler->labels[i];
+        if (labelAddress(&assembler->writer, label->label) == WRITER_UNBOUND) {
+            assembler->line = label->line;
+            error(assembler, "undefined label", label->name, label->length);
+        }
+    }
+    if (!assembler->failed && !resolveLabels(&assembler->writer)) {
+        assembler->failed = true;
+    }
+}
+
+/* Assembles the source, false after logging the first error */
+bool assemble(Assembler* assembler, const char* source, size_t length) {
+    assembler->current = source;
+    assembler->end     = source + length;
+    assembler->line    = 1;
+    while (assembler->current < assembler->end && !assembler->failed) {
+        statement(assembler);
+        if (assembler->writer.failed) {
+            error(assembler, "image past the highest address at", "", 0);
+        }
+        /* Skips the rest of the line after an error, there is nothing more to do */
+        while (assembler->current < assembler->end && *assembler->current != '\n') {
+            assembler->current++;
+        }
+        if (assembler->current < assembler->end) {
+            assembler->current++;
+            assembler->line++;
+        }
+    }
+    resolveLabelsOf(assembler);
+    return !assembler->failed;
+}
+
+bool assembleFile(Assembler* assembler, const char* path) {
+    MappedFile* file = mapFile(path);
+    if (file == NULL) {
+        return false;
+    }
+    bool assembled = assemble(assembler, (const char*)file->bytes, file->size);
+    unmapFile(file);
+    return assembled;
+}
@@ -0,0 +1,35 @@
+#ifndef cero_assembler_h
+#define cero_assembler_h
+
+#include "common.h"
+#include "writer.h"
+
+/* Highest address an assembled image may reach, the offset of a Writer. The
+ * Writer only holds the pages written, so .pos may go anywhere below it */
+#define ASSEMBLER_MAX_ADDRESS ((vm_quad_t)UINT32_MAX)
+
+typedef struct AsmLabel AsmLabel;
+
+/* -----Assembler-----
+ * Assembles Y86-64 source (.ys) into the Writer, at the guest addresses the
+ * source gives, see assembler.c for the syntax. The labels point into the
+ * source, an assembler assembles a single one. */
+typedef struct {
+    Writer writer;           /* The image, see loadWriter and saveWriter      */
+    AsmLabel* labels;        /* In the order they were first named            */
+    uint32_t labelCount;
+    uint32_t labelCapacity;
+    uint32_t* table;         /* Hash table of 1 + the index of the labels     */
+    uint32_t tableCapacity;  /* A power of two                                */
+    const char* current;     /* Where the tokenizer is                        */
+    const char* end;
+    uint32_t line;
+    bool failed;
+} Assembler;
+
+void initAssembler(Assembler* assembler);
+void freeAssembler(Assembler* assembler);
+bool assemble(Assembler* assembler, const char* source, size_t length);
+bool assembleFile(Assembler* assembler, const char* path);
+
+#endif
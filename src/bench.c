@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "common.h"
+#include "vm.h"
+#include "memory.h"
+#include "writer.h"
+#include "aot.h"
+
+/* -----Benchmarks-----
+ * Runs Y86-64 kernels generated with the Writer on the engines and reports the
+ * time the VM took to run them (make bench). Every run starts from a fork of
+ * the loaded kernel, such that all runs execute the same instructions, and is
+ * checked against what the kernel computes before its time is counted.
+ *
+ * The number of instructions a kernel retires comes from a C model of its
+ * control flow. Builds with VM_FUSION_STATS check the model against the
+ * handlers the interpreting engines executed.
+ *
+ * Usage: bench [--runs=N] [--engine=NAME] [--kernel=NAME] [--csv]
+ * Every engine is measured unless --engine picks one. AOT compiles each kernel
+ * with AOT_CC into BENCH_AOT_PREFIX followed by its name.
+ * --csv prints one line per kernel and engine on stdout, and nothing else there
+ * as the logger writes to stderr instead:
+ *     kernel,engine,instructions,runs,mean_ns,min_ns,stddev_ns,cv_percent,ns_per_instruction,mips
+ */
+
+#define BENCH_DEFAULT_RUNS (10)
+/* Where the AOT translations of the kernels are written, followed by their names */
+#ifndef BENCH_AOT_PREFIX
+#define BENCH_AOT_PREFIX "build/objs/bench/aot-"
+#endif
+#define BENCH_DATA         (0x100000)    /* Where the kernels keep their data      */
+#define BENCH_DATA2        (0x1000000)   /* Where they keep a second array         */
+#define BENCH_STACK        (0x4000000)
+
+/* What a run of a kernel must end with */
+typedef struct {
+    uint64_t instructions;           /* Instructions retired, halt included   */
+    vm_quad_t registers[REG_COUNT];
+    uint32_t checked;                /* Bit r is set if registers[r] is known */
+    vm_quad_t memory;                /* Address of quads to hash, 0 for none  */
+    vm_quad_t memoryCount;
+    uint64_t memoryHash;
+} Expected;
+
+typedef struct {
+    const char* name;
+    void (*generate)(Writer* writer, Expected* expected);
+} Kernel;
+
+static uint64_t random64(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static uint64_t hashQuad(uint64_t hash, vm_quad_t quad) {
+    return (hash ^ (uint64_t)quad) * 0x100000001b3ULL;
+}
+
+static void expectRegister(Expected* expected, vm_ubyte_t reg, vm_quad_t value) {
+    expected->registers[reg] = value;
+    expected->checked       |= 1u << reg;
+}
+
+static void expectMemory(Expected* expected, vm_quad_t address, const vm_quad_t* quads, vm_quad_t count) {
+    expected->memory      = address;
+    expected->memoryCount = count;
+    expected->memoryHash  = 0xcbf29ce484222325ULL;
+    for (vm_quad_t i = 0; i < count; ++i) {
+        expected->memoryHash = hashQuad(expected->memoryHash, quads[i]);
+    }
+}
+
+/* -----Kernels----- */
+
+/* Sums an array of quads */
+static void sumKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t n = 1 << 20;
+    WriterLabel loop = newLabel(writer);
+    WriterLabel test = newLabel(writer);
+    irmovqWrite(writer, REG_RDI, BENCH_DATA);
+    irmovqWrite(writer, REG_RSI, n);
+    irmovqWrite(writer, REG_R8, 8);
+    irmovqWrite(writer, REG_R9, 1);
+    xorqWrite(writer, REG_RAX, REG_RAX);
+    andqWrite(writer, REG_RSI, REG_RSI);
+    jmpLabelWrite(writer, test);
+    bindLabel(writer, loop);
+    mrmovqWrite(writer, REG_R10, REG_RDI, 0);
+    addqWrite(writer, REG_R10, REG_RAX);
+    addqWrite(writer, REG_R8, REG_RDI);
+    subqWrite(writer, REG_R9, REG_RSI);
+    bindLabel(writer, test);
+    jneLabelWrite(writer, loop);
+    haltWrite(writer);
+
+    uint64_t state = 1;
+    vm_quad_t sum  = 0;
+    writer->offset = BENCH_DATA;
+    for (vm_quad_t i = 0; i < n; ++i) {
+        vm_quad_t quad = (vm_quad_t)(random64(&state) >> 16);
+        quadWrite(writer, quad);
+        sum += quad;
+    }
+    expected->instructions = 7 + 4 * n + (n + 1) + 1;
+    expectRegister(expected, REG_RAX, sum);
+}
+
+static uint64_t fibInstructions(vm_quad_t n) {
+    return n < 2 ? 5 : 14 + fibInstructions(n - 1) + fibInstructions(n - 2);
+}
+
+static vm_quad_t fib(vm_quad_t n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+/* Recursive Fibonacci through call and ret, the argument saved on the stack */
+static void fibKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t n = 27;
+    WriterLabel function = newLabel(writer);
+    WriterLabel done     = newLabel(writer);
+    irmovqWrite(writer, REG_RDI, n);
+    irmovqWrite(writer, REG_R9, 1);
+    irmovqWrite(writer, REG_R8, 2);
+    callLabelWrite(writer, function);
+    haltWrite(writer);
+    bindLabel(writer, function);
+    rrmovqWrite(writer, REG_RDI, REG_RAX);
+    rrmovqWrite(writer, REG_RDI, REG_RCX);
+    subqWrite(writer, REG_R8, REG_RCX);
+    jlLabelWrite(writer, done);
+    pushqWrite(writer, REG_RDI);
+    subqWrite(writer, REG_R9, REG_RDI);
+    callLabelWrite(writer, function);
+    popqWrite(writer, REG_RDI);
+    pushqWrite(writer, REG_RAX);
+    subqWrite(writer, REG_R8, REG_RDI);
+    callLabelWrite(writer, function);
+    popqWrite(writer, REG_RCX);
+    addqWrite(writer, REG_RCX, REG_RAX);
+    retWrite(writer);
+    bindLabel(writer, done);
+    retWrite(writer);
+
+    expected->instructions = 5 + fibInstructions(n);
+    expectRegister(expected, REG_RAX, fib(n));
+}
+
+/* Bubble sort of random quads, branching on every comparison */
+static void bubbleKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t n = 1200;
+    WriterLabel outer  = newLabel(writer);
+    WriterLabel inner  = newLabel(writer);
+    WriterLabel noSwap = newLabel(writer);
+    irmovqWrite(writer, REG_RBX, BENCH_DATA);
+    irmovqWrite(writer, REG_RSI, n - 1);
+    irmovqWrite(writer, REG_R8, 8);
+    irmovqWrite(writer, REG_R9, 1);
+    bindLabel(writer, outer);
+    rrmovqWrite(writer, REG_RBX, REG_RDI);
+    rrmovqWrite(writer, REG_RSI, REG_RDX);
+    bindLabel(writer, inner);
+    mrmovqWrite(writer, REG_RAX, REG_RDI, 0);
+    mrmovqWrite(writer, REG_RCX, REG_RDI, 8);
+    rrmovqWrite(writer, REG_RAX, REG_R10);
+    subqWrite(writer, REG_RCX, REG_R10);
+    jleLabelWrite(writer, noSwap);
+    rmmovqWrite(writer, REG_RCX, REG_RDI, 0);
+    rmmovqWrite(writer, REG_RAX, REG_RDI, 8);
+    bindLabel(writer, noSwap);
+    addqWrite(writer, REG_R8, REG_RDI);
+    subqWrite(writer, REG_R9, REG_RDX);
+    jneLabelWrite(writer, inner);
+    subqWrite(writer, REG_R9, REG_RSI);
+    jneLabelWrite(writer, outer);
+    haltWrite(writer);
+
+    vm_quad_t* quads = INIT_ARRAY(vm_quad_t, NULL, n);
+    uint64_t state   = 2;
+    writer->offset   = BENCH_DATA;
+    for (vm_quad_t i = 0; i < n; ++i) {
+        quads[i] = (vm_quad_t)(random64(&state) % 1000000);
+        quadWrite(writer, quads[i]);
+    }
+    uint64_t instructions = 4 + 1;
+    for (vm_quad_t remaining = n - 1; remaining > 0; --remaining) {
+        instructions += 2 + 2;
+        for (vm_quad_t i = 0; i < remaining; ++i) {
+            instructions += 8;
+            if (quads[i] > quads[i + 1]) {
+                vm_quad_t swap = quads[i];
+                quads[i]       = quads[i + 1];
+                quads[i + 1]   = swap;
+                instructions += 2;
+            }
+        }
+    }
+    expected->instructions = instructions;
+    expectMemory(expected, BENCH_DATA, quads, n);
+    FREE_ARRAY(vm_quad_t, quads, n);
+}
+
+/* Copies an array of quads one quad at a time */
+static void memcpyKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t n = 1 << 20;
+    WriterLabel loop = newLabel(writer);
+    WriterLabel test = newLabel(writer);
+    irmovqWrite(writer, REG_RSI, BENCH_DATA);
+    irmovqWrite(writer, REG_RDI, BENCH_DATA2);
+    irmovqWrite(writer, REG_RDX, n);
+    irmovqWrite(writer, REG_R8, 8);
+    irmovqWrite(writer, REG_R9, 1);
+    andqWrite(writer, REG_RDX, REG_RDX);
+    jmpLabelWrite(writer, test);
+    bindLabel(writer, loop);
+    mrmovqWrite(writer, REG_RAX, REG_RSI, 0);
+    rmmovqWrite(writer, REG_RAX, REG_RDI, 0);
+    addqWrite(writer, REG_R8, REG_RSI);
+    addqWrite(writer, REG_R8, REG_RDI);
+    subqWrite(writer, REG_R9, REG_RDX);
+    bindLabel(writer, test);
+    jneLabelWrite(writer, loop);
+    haltWrite(writer);
+
+    vm_quad_t* quads = INIT_ARRAY(vm_quad_t, NULL, n);
+    uint64_t state   = 3;
+    writer->offset   = BENCH_DATA;
+    for (vm_quad_t i = 0; i < n; ++i) {
+        quads[i] = (vm_quad_t)random64(&state);
+        quadWrite(writer, quads[i]);
+    }
+    expected->instructions = 7 + 5 * n + (n + 1) + 1;
+    expectMemory(expected, BENCH_DATA2, quads, n);
+    FREE_ARRAY(vm_quad_t, quads, n);
+}
+
+/* Follows a random cycle through nodes a cache line apart */
+static void chaseKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t nodes  = 1 << 16;
+    const vm_quad_t stride = 64;
+    const vm_quad_t steps  = 2000000;
+    WriterLabel loop = newLabel(writer);
+    irmovqWrite(writer, REG_RAX, BENCH_DATA);
+    irmovqWrite(writer, REG_RDX, steps);
+    irmovqWrite(writer, REG_R9, 1);
+    bindLabel(writer, loop);
+    mrmovqWrite(writer, REG_RAX, REG_RAX, 0);
+    subqWrite(writer, REG_R9, REG_RDX);
+    jneLabelWrite(writer, loop);
+    haltWrite(writer);
+
+    /* A random permutation of the nodes after the first one, linked in order */
+    vm_quad_t* order = INIT_ARRAY(vm_quad_t, NULL, nodes);
+    vm_quad_t* next  = INIT_ARRAY(vm_quad_t, NULL, nodes);
+    uint64_t state   = 4;
+    for (vm_quad_t i = 0; i < nodes; ++i) {
+        order[i] = i;
+    }
+    for (vm_quad_t i = nodes - 1; i > 1; --i) {
+        vm_quad_t j  = 1 + (vm_quad_t)(random64(&state) % (uint64_t)i);
+        vm_quad_t at = order[i];
+        order[i]     = order[j];
+        order[j]     = at;
+    }
+    for (vm_quad_t i = 0; i < nodes; ++i) {
+        next[order[i]] = order[(i + 1) % nodes];
+    }
+    for (vm_quad_t i = 0; i < nodes; ++i) {
+        writer->offset = BENCH_DATA + i * stride;
+        quadWrite(writer, BENCH_DATA + next[i] * stride);
+    }
+    vm_quad_t node = 0;
+    for (vm_quad_t i = 0; i < steps; ++i) {
+        node = next[node];
+    }
+    expected->instructions = 3 + 3 * steps + 1;
+    expectRegister(expected, REG_RAX, BENCH_DATA + node * stride);
+    FREE_ARRAY(vm_quad_t, order, nodes);
+    FREE_ARRAY(vm_quad_t, next, nodes);
+}
+
+/* Sorts random quads into three buckets with unpredictable branches */
+static void branchKernel(Writer* writer, Expected* expected) {
+    const vm_quad_t n         = 1 << 19;
+    const vm_quad_t threshold = 1 << 20;
+    WriterLabel loop    = newLabel(writer);
+    WriterLabel notNeg  = newLabel(writer);
+    WriterLabel big     = newLabel(writer);
+    WriterLabel advance = newLabel(writer);
+    irmovqWrite(writer, REG_RDI, BENCH_DATA);
+    irmovqWrite(writer, REG_RSI, n);
+    irmovqWrite(writer, REG_R8, 8);
+    irmovqWrite(writer, REG_R9, 1);
+    xorqWrite(writer, REG_RAX, REG_RAX);
+    xorqWrite(writer, REG_RBX, REG_RBX);
+    xorqWrite(writer, REG_RCX, REG_RCX);
+    irmovqWrite(writer, REG_R11, threshold);
+    bindLabel(writer, loop);
+    mrmovqWrite(writer, REG_R10, REG_RDI, 0);
+    andqWrite(writer, REG_R10, REG_R10);
+    jgeLabelWrite(writer, notNeg);
+    addqWrite(writer, REG_R9, REG_RAX);
+    jmpLabelWrite(writer, advance);
+    bindLabel(writer, notNeg);
+    rrmovqWrite(writer, REG_R10, REG_R12);
+    subqWrite(writer, REG_R11, REG_R12);
+    jgeLabelWrite(writer, big);
+    addqWrite(writer, REG_R9, REG_RBX);
+    jmpLabelWrite(writer, advance);
+    bindLabel(writer, big);
+    addqWrite(writer, REG_R9, REG_RCX);
+    bindLabel(writer, advance);
+    addqWrite(writer, REG_R8, REG_RDI);
+    subqWrite(writer, REG_R9, REG_RSI);
+    jneLabelWrite(writer, loop);
+    haltWrite(writer);
+
+    uint64_t state = 5;
+    uint64_t instructions = 8 + 1;
+    vm_quad_t negative = 0, small = 0, large = 0;
+    writer->offset = BENCH_DATA;
+    for (vm_quad_t i = 0; i < n; ++i) {
+        vm_quad_t quad = (vm_quad_t)(random64(&state) % (4 * threshold)) - threshold;
+        quadWrite(writer, quad);
+        if (quad < 0) {
+            negative++;
+            instructions += 8;
+        } else if (quad < threshold) {
+            small++;
+            instructions += 11;
+        } else {
+            large++;
+            instructions += 10;
+        }
+    }
+    expected->instructions = instructions;
+    expectRegister(expected, REG_RAX, negative);
+    expectRegister(expected, REG_RBX, small);
+    expectRegister(expected, REG_RCX, large);
+}
+
+static const Kernel kernels[] = {
+    { "sum",    sumKernel },
+    { "fib",    fibKernel },
+    { "bubble", bubbleKernel },
+    { "memcpy", memcpyKernel },
+    { "chase",  chaseKernel },
+    { "branch", branchKernel },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+/* -----Runs----- */
+static double nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+static bool checkRun(VM* vm, const Kernel* kernel, const Expected* expected) {
+    if (vm->statusCondition != STAT_HLT) {
+        CERO_ERROR("bench::%s stopped with status %d at 0x%" PRIx64 "\n", kernel->name, vm->statusCondition, vm->pc);
+        return false;
+    }
+    for (vm_ubyte_t r = 0; r < REG_COUNT; ++r) {
+        if ((expected->checked & (1u << r)) && vm->registers[r] != expected->registers[r]) {
+            CERO_ERROR("bench::%s register %u is 0x%" PRIx64 " instead of 0x%" PRIx64 "\n",
+                       kernel->name, r, vm->registers[r], expected->registers[r]);
+            return false;
+        }
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (vm_quad_t i = 0; i < expected->memoryCount; ++i) {
+        hash = hashQuad(hash, m8r(vm, expected->memory + i * 8));
+    }
+    if (expected->memoryCount > 0 && hash != expected->memoryHash) {
+        CERO_ERROR("bench::%s left the wrong bytes at 0x%" PRIx64 "\n", kernel->name, expected->memory);
+        return false;
+    }
+#ifdef VM_FUSION_STATS
+    /* The JIT and AOT engines do not count what their translations execute */
+    uint64_t retired = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        vm_quad_t length;
+        fusionLeader((Operation)op, &length);
+        retired += vm->cold->executed[op] * length;
+    }
+    if (vm->cold->engine != ENGINE_JIT && vm->cold->engine != ENGINE_AOT && retired != expected->instructions) {
+        CERO_ERROR("bench::%s retired %" PRIu64 " instructions, its model %" PRIu64 "\n", kernel->name, retired, expected->instructions);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Times runs forks of the kernel on the engine, after one run warming up the host.
+ * The AOT engine runs a translation built once from the loaded kernel, which
+ * every fork loads again as forking closes it (loading is not timed) */
+static bool benchKernel(const Kernel* kernel, Engine engine, uint32_t runs, bool csv) {
+    Writer writer;
+    Expected expected;
+    initWriter(&writer, NULL, 0, 0);
+    memset(&expected, 0, sizeof(expected));
+    kernel->generate(&writer, &expected);
+    if (!resolveLabels(&writer)) {
+        freeWriter(&writer);
+        return false;
+    }
+    VM loaded;
+    initVM(&loaded);
+    loadWriter(&writer, &loaded);
+    freeWriter(&writer);
+    loaded.registers[REG_RSP] = BENCH_STACK;
+    loaded.registers[REG_RBP] = BENCH_STACK;
+    loaded.cold->engine       = engine;
+    char library[256];
+    snprintf(library, sizeof(library), BENCH_AOT_PREFIX "%s", kernel->name);
+    if (engine == ENGINE_AOT && !buildAot(&loaded, loaded.pc, library)) {
+        CERO_ERROR("bench::%s unable to build its AOT translation %s\n", kernel->name, library);
+        freeVM(&loaded);
+        return false;
+    }
+    strncat(library, ".so", sizeof(library) - strlen(library) - 1);
+    VMSnapshot snapshot;
+    snapshotVM(&loaded, &snapshot);
+
+    VM vm;
+    initVM(&vm);
+    double* times = INIT_ARRAY(double, NULL, runs);
+    bool correct  = true;
+    for (uint32_t i = 0; i <= runs && correct; ++i) {
+        forkVM(&snapshot, &vm);
+        if (engine == ENGINE_AOT && !loadAot(&vm, library)) {
+            correct = false;
+            break;
+        }
+#ifdef VM_FUSION_STATS
+        memset(vm.cold->executed, 0, sizeof(vm.cold->executed));
+#endif
+        double start = nanoseconds();
+        run(&vm);
+        double time = nanoseconds() - start;
+        correct = checkRun(&vm, kernel, &expected);
+        if (i > 0) {
+            times[i - 1] = time;
+        }
+    }
+    if (correct) {
+        double mean = 0, min = times[0], variance = 0;
+        for (uint32_t i = 0; i < runs; ++i) {
+            mean += times[i] / runs;
+            min   = times[i] < min ? times[i] : min;
+        }
+        for (uint32_t i = 0; i < runs; ++i) {
+            variance += (times[i] - mean) * (times[i] - mean) / runs;
+        }
+        double stddev         = sqrt(variance);
+        double perInstruction = mean / expected.instructions;
+        if (csv) {
+            printf("%s,%s,%" PRIu64 ",%u,%.0f,%.0f,%.0f,%.2f,%.3f,%.1f\n", kernel->name, engineName(engine), expected.instructions,
+                   runs, mean, min, stddev, 100 * stddev / mean, perInstruction, 1e3 / perInstruction);
+        } else {
+            CERO_INFO("%-8s %-9s %12" PRIu64 " %10.3f %10.3f %7.2f%% %8.3f %9.1f\n", kernel->name, engineName(engine),
+                      expected.instructions, mean / 1e6, min / 1e6, 100 * stddev / mean, perInstruction, 1e3 / perInstruction);
+        }
+    }
+    FREE_ARRAY(double, times, runs);
+    freeVM(&vm);
+    freeSnapshot(&snapshot);
+    freeVM(&loaded);
+    return correct;
+}
+
+int main(int argc, const char* argv[]) {
+    uint32_t runs    = BENCH_DEFAULT_RUNS;
+    const char* only = NULL;
+    bool csv         = false;
+    bool engines[ENGINE_COUNT] = { [ENGINE_SWITCH] = true, [ENGINE_THREADED] = true, [ENGINE_JIT] = true, [ENGINE_AOT] = true };
+    for (int i = 1; i < argc; ++i) {
+        Engine engine;
+        if (strncmp(argv[i], "--runs=", 7) == 0 && atoi(argv[i] + 7) > 0) {
+            runs = (uint32_t)atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--engine=", 9) == 0 && engineFromName(argv[i] + 9, &engine)) {
+            memset(engines, 0, sizeof(engines));
+            engines[engine] = true;
+        } else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+            only = argv[i] + 9;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else {
+            CERO_FATAL("Usage: bench [--runs=N] [--engine=NAME] [--kernel=NAME] [--csv]\n");
+            return 1;
+        }
+    }
+    /* Keeps stdout to the rows, the lines of the logger go to stderr */
+    if (csv) {
+        loggerUseStream(stderr);
+        printf("kernel,engine,instructions,runs,mean_ns,min_ns,stddev_ns,cv_percent,ns_per_instruction,mips\n");
+    } else {
+        CERO_INFO("%-8s %-9s %12s %10s %10s %8s %8s %9s\n", "KERNEL", "ENGINE", "INSTRUCTIONS", "MEAN MS", "MIN MS", "CV", "NS/INS", "MIPS");
+    }
+    bool correct = true;
+    for (size_t k = 0; k < KERNEL_COUNT; ++k) {
+        if (only != NULL && strcmp(only, kernels[k].name) != 0) {
+            continue;
+        }
+        for (int engine = 0; engine < ENGINE_COUNT; ++engine) {
+            if (engines[engine]) {
+                correct &= benchKernel(&kernels[k], (Engine)engine, runs, csv);
+            }
+        }
+    }
+    loggerFlush();
+    return correct ? 0 : 1;
+}
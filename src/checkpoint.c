@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "memory.h"
+
+/* -----Checkpoints-----
+ * saveCheckpoint writes the state of a VM out in one sequential pass.
+ * loadCheckpoint maps the file instead of reading it: the pages of guest memory
+ * point straight into the mapping (see mapPage), so restoring only costs the
+ * page faults of the pages the VM goes on to touch. A page is copied out of the
+ * mapping on its first write. The mapping lives until the VM is reset or freed.
+ */
+
+static const vm_ubyte_t zeros[PAGE_SIZE];
+
+static vm_quad_t pagesOffsetOf(vm_quad_t pageCount) {
+    vm_quad_t tableEnd = sizeof(CheckpointHeader) + pageCount * sizeof(vm_quad_t);
+    return (tableEnd + PAGE_MASK) & ~PAGE_MASK;
+}
+
+bool saveCheckpoint(VM* vm, const char* path) {
+    /* The pages that are not all zeros, in ascending order */
+    vm_quad_t* numbers = NULL;
+    Page** pages       = NULL;
+    uint32_t count     = 0;
+    uint32_t capacity  = 0;
+    vm_quad_t pageNumber = 0;
+    for (Page* page = nextPage(&vm->memory, &pageNumber); page != NULL; page = nextPage(&vm->memory, &pageNumber)) {
+        if (memcmp(page->bytes, zeros, PAGE_SIZE) != 0) {
+            if (count == capacity) {
+                uint32_t oldCapacity = capacity;
+                capacity = GROW_CAPACITY(oldCapacity);
+                numbers  = GROW_ARRAY(vm_quad_t, numbers, oldCapacity, capacity);
+                pages    = GROW_ARRAY(Page*, pages, oldCapacity, capacity);
+            }
+            numbers[count] = pageNumber;
+            pages[count]   = page;
+            count++;
+        }
+        pageNumber++;
+    }
+
+    syncConditionCodes(vm);
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version        = CHECKPOINT_VERSION;
+    header.status         = vm->statusCondition;
+    header.pc             = vm->pc;
+    header.pageCount      = count;
+    header.pagesOffset    = pagesOffsetOf(count);
+    header.conditionCodes = vm->conditionCodes;
+    header.bigEndian      = VM_MEMORY_BIG_ENDIAN;
+    memcpy(header.registers, vm->registers, sizeof(header.registers));
+
+    bool written = false;
+    FILE* file   = fopen(path, "wb");
+    if (file == NULL) {
+        CERO_ERROR("checkpoint::save unable to write %s\n", path);
+    } else {
+        vm_quad_t tableEnd = sizeof(header) + count * sizeof(vm_quad_t);
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(numbers, sizeof(vm_quad_t), count, file);
+        fwrite(zeros, 1, header.pagesOffset - tableEnd, file);
+        for (uint32_t i = 0; i < count; ++i) {
+            fwrite(pages[i]->bytes, 1, PAGE_SIZE, file);
+        }
+        written = !ferror(file);
+        written &= fclose(file) == 0;
+        if (!written) {
+            CERO_ERROR("checkpoint::save unable to write %s\n", path);
+        }
+    }
+    FREE_ARRAY(vm_quad_t, numbers, capacity);
+    FREE_ARRAY(Page*, pages, capacity);
+    return written;
+}
+
+static bool validCheckpoint(const vm_ubyte_t* base, size_t size) {
+    const CheckpointHeader* header = (const CheckpointHeader*)base;
+    if (size < sizeof(CheckpointHeader) || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header->version != CHECKPOINT_VERSION || header->bigEndian != VM_MEMORY_BIG_ENDIAN ||
+        header->status > STAT_INS) {
+        return false;
+    }
+    if (header->pageCount < 0 || header->pageCount > PAGE_COUNT ||
+        header->pagesOffset != pagesOffsetOf(header->pageCount) ||
+        (uint64_t)header->pagesOffset + (uint64_t)header->pageCount * PAGE_SIZE != size) {
+        return false;
+    }
+    const vm_quad_t* numbers = (const vm_quad_t*)(base + sizeof(CheckpointHeader));
+    for (vm_quad_t i = 0; i < header->pageCount; ++i) {
+        if (numbers[i] < 0 || numbers[i] >= PAGE_COUNT || (i > 0 && numbers[i] <= numbers[i - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Replaces the memory, registers, condition codes, status and PC of the VM
+ * with those of the checkpoint. Its engine and trace are kept */
+bool loadCheckpoint(VM* vm, const char* path) {
+    MappedFile* file = mapFile(path);
+    if (file == NULL) {
+        return false;
+    }
+    if (!validCheckpoint(file->bytes, file->size)) {
+        CERO_ERROR("checkpoint::load %s is not a checkpoint of this VM\n", path);
+        unmapFile(file);
+        return false;
+    }
+    resetMemory(vm);
+    adoptFile(&vm->memory, file);
+
+    const CheckpointHeader* header = (const CheckpointHeader*)file->bytes;
+    const vm_quad_t* numbers       = (const vm_quad_t*)(header + 1);
+    const vm_ubyte_t* pages        = file->bytes + header->pagesOffset;
+    for (vm_quad_t i = 0; i < header->pageCount; ++i) {
+        mapPage(&vm->memory, numbers[i], pages + i * PAGE_SIZE);
+    }
+    memcpy(vm->registers, header->registers, sizeof(vm->registers));
+    vm->pc              = header->pc;
+    vm->statusCondition = (StatusCondition)header->status;
+    vm->conditionCodes  = header->conditionCodes;
+    vm->flags           = FLAGS_EAGER;
+    return true;
+}
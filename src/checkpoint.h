@@ -0,0 +1,30 @@
+#ifndef cero_checkpoint_h
+#define cero_checkpoint_h
+
+#include "common.h"
+#include "vm.h"
+
+#define CHECKPOINT_MAGIC   "CEROCKP"
+#define CHECKPOINT_VERSION (1)
+
+/* A checkpoint file is the header, pageCount vm_quad_t page numbers in
+ * ascending order, zeros up to pagesOffset and then the PAGE_SIZE bytes of each
+ * of those pages. Pages holding only zeros are left out. pagesOffset is a
+ * multiple of PAGE_SIZE such that the pages of a mapped file are host pages. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t status;          /* StatusCondition                          */
+    vm_quad_t pc;
+    vm_quad_t registers[REG_COUNT];
+    vm_quad_t pageCount;      /* Pages stored                             */
+    vm_quad_t pagesOffset;    /* Offset of the first of them in the file  */
+    vm_ubyte_t conditionCodes;
+    vm_ubyte_t bigEndian;     /* Whether the pages hold big-endian quads  */
+    vm_ubyte_t padding[6];
+} CheckpointHeader;
+
+bool saveCheckpoint(VM* vm, const char* path);
+bool loadCheckpoint(VM* vm, const char* path);
+
+#endif
@@ -8,6 +8,11 @@
 
 #include "logger.h"
 
-#define DEBUG_TRACE_EXECUTION
+/* Build configuration, set by the makefile (make app / make trace):
+ * DEBUG_TRACE_EXECUTION Logs every instruction and prints the VM after each step
+ * VM_FUSION_STATS       Counts the executed handlers for printFusionReport
+ * LOGGER_MIN_LEVEL      The least severe log level compiled in, see logger.h
+ * LOGGER_SYNC           Prints log lines on the calling thread instead of logger.c's
+ * VM_BIG_ENDIAN_MEMORY  Stores quads big-endian in guest memory, see value.h */
 
 #endif
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "counters.h"
+#include "memory.h"
+
+/* Linux ABI glibc only declares with _GNU_SOURCE, whose <signal.h> clashes with
+ * the REG_ names of vm.h */
+#ifndef F_SETOWN_EX
+#define F_SETOWN_EX (15)
+#define F_OWNER_TID (0)
+struct f_owner_ex {
+    int type;
+    pid_t pid;
+};
+#endif
+
+/* -----Host counters-----
+ * The events of FOREACH_COUNTER are opened as one perf_event group counting
+ * the thread calling startCounters in user space only. The leader overflows
+ * every COUNTERS_PERIOD nanoseconds of CPU time and stops, the SIGIO it raises
+ * reads the whole group, adds what every event counted since the previous
+ * sample to the handler dispatched last, and restarts the leader.
+ *
+ * runCounted runs the THREADED engine, which publishes every handler it
+ * dispatches, or else executes the decoded (fused) handlers through the switch
+ * of the SWITCH engine. The JIT and AOT engines run translated code, their VMs
+ * are measured on SWITCH and the table says so. A handler is charged for its
+ * own body and for fetching the instruction after it.
+ * Per-dispatch figures are the events of a handler over its dispatches, and
+ * per-instruction ones count the guest instructions of a superinstruction.
+ *
+ * Sampling is statistical, handlers below a few samples are noise. Only one
+ * VM per process can count at a time as they share SIGIO.
+ */
+
+typedef struct {
+    uint32_t type;
+    uint64_t config;
+} CounterEvent;
+
+static const CounterEvent counterEvents[COUNTER_COUNT] = {
+    [COUNTER_TASK_CLOCK]    = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK     },
+    [COUNTER_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES     },
+    [COUNTER_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS   },
+    [COUNTER_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES  },
+    [COUNTER_CACHE_MISSES]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES   },
+};
+
+/* The counters SIGIO samples, NULL unless some VM started them */
+static Counters* volatile sampling = NULL;
+
+static int openCounter(Counter counter, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = counterEvents[counter].type;
+    attr.config         = counterEvents[counter].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    if (group == -1) {
+        attr.disabled      = 1;
+        attr.sample_period = COUNTERS_PERIOD;
+        attr.wakeup_events = 1;
+        attr.read_format   = PERF_FORMAT_GROUP;
+    }
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Reads the group into values, in the order of FOREACH_COUNTER */
+static bool readCounters(Counters* counters, uint64_t values[COUNTER_COUNT]) {
+    uint64_t group[1 + COUNTER_COUNT];
+    ssize_t length = read(counters->fds[COUNTER_TASK_CLOCK], group, sizeof(group));
+    if (length < (ssize_t)sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t next = 1;
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        values[counter] = counters->fds[counter] != -1 && next <= group[0] ? group[next++] : 0;
+    }
+    return true;
+}
+
+static void sample(int signal, siginfo_t* info, void* context) {
+    (void)signal;
+    (void)info;
+    (void)context;
+    Counters* counters = sampling;
+    if (counters == NULL) {
+        return;
+    }
+    int saved = errno;
+    uint64_t values[COUNTER_COUNT];
+    if (readCounters(counters, values)) {
+        sig_atomic_t handler = counters->handler;
+        counters->samples[handler]++;
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            counters->events[handler][counter] += values[counter] - counters->last[counter];
+            counters->last[counter]             = values[counter];
+        }
+    }
+    ioctl(counters->fds[COUNTER_TASK_CLOCK], PERF_EVENT_IOC_REFRESH, 1);
+    errno = saved;
+}
+
+/* Opens the group for the calling thread, which has to be the one calling run() */
+bool startCounters(VM* vm) {
+    stopCounters(vm);
+    if (sampling != NULL) {
+        CERO_ERROR("counters::start another VM is already counting\n");
+        return false;
+    }
+    Counters* counters = INIT_ARRAY(Counters, NULL, 1);
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        counters->fds[counter] = -1;
+    }
+    counters->fds[COUNTER_TASK_CLOCK] = openCounter(COUNTER_TASK_CLOCK, -1);
+    if (counters->fds[COUNTER_TASK_CLOCK] == -1) {
+        CERO_ERROR("counters::start perf_event_open failed: %s\n", strerror(errno));
+        FREE_ARRAY(Counters, counters, 1);
+        return false;
+    }
+    for (int counter = COUNTER_TASK_CLOCK + 1; counter < COUNTER_COUNT; ++counter) {
+        counters->fds[counter] = openCounter((Counter)counter, counters->fds[COUNTER_TASK_CLOCK]);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = sample;
+    action.sa_flags     = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct f_owner_ex owner = { F_OWNER_TID, (pid_t)syscall(SYS_gettid) };
+    int leader = counters->fds[COUNTER_TASK_CLOCK];
+    if (sigaction(SIGIO, &action, &counters->previous) != 0
+        || fcntl(leader, F_SETFL, O_ASYNC | O_NONBLOCK) != 0
+        || fcntl(leader, F_SETOWN_EX, &owner) != 0) {
+        CERO_ERROR("counters::start unable to deliver the samples: %s\n", strerror(errno));
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (counters->fds[counter] != -1) {
+                close(counters->fds[counter]);
+            }
+        }
+        FREE_ARRAY(Counters, counters, 1);
+        return false;
+    }
+    sampling           = counters;
+    vm->cold->counters = counters;
+    return true;
+}
+
+void stopCounters(VM* vm) {
+    Counters* counters = vm->cold->counters;
+    if (counters == NULL) {
+        return;
+    }
+    pauseCounters(vm);
+    sampling = NULL;
+    sigaction(SIGIO, &counters->previous, NULL);
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        if (counters->fds[counter] != -1) {
+            close(counters->fds[counter]);
+        }
+    }
+    FREE_ARRAY(Counters, counters, 1);
+    vm->cold->counters = NULL;
+}
+
+/* Starts counting for runCounted, the events counted while paused are dropped */
+bool resumeCounters(VM* vm) {
+    Counters* counters = vm->cold->counters;
+    return readCounters(counters, counters->last)
+           && ioctl(counters->fds[COUNTER_TASK_CLOCK], PERF_EVENT_IOC_REFRESH, 1) == 0;
+}
+
+void pauseCounters(VM* vm) {
+    ioctl(vm->cold->counters->fds[COUNTER_TASK_CLOCK], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+#define GENERATE_COUNTER_STRING(NAME) #NAME,
+
+static const char* counterStrings[COUNTER_COUNT] = {
+    FOREACH_COUNTER(GENERATE_COUNTER_STRING)
+};
+
+#undef GENERATE_COUNTER_STRING
+
+/* Formats events over count into buffer, '-' if the host does not count them */
+static const char* ratio(Counters* counters, Counter counter, uint64_t events, uint64_t count, char buffer[16]) {
+    if (counters->fds[counter] == -1 || count == 0) {
+        return "-";
+    }
+    snprintf(buffer, 16, "%.3f", (double)events / count);
+    return buffer;
+}
+
+/* Prints, for every handler dispatched, the host time and cycles per guest
+ * instruction, the host instructions per cycle and the branch and cache misses
+ * per dispatch */
+void printCounters(VM* vm) {
+    Counters* counters = vm->cold->counters;
+    if (counters == NULL) {
+        CERO_WARN("Start the counters to print them\n");
+        return;
+    }
+    uint64_t samples = 0;
+    uint64_t totals[COUNTER_COUNT] = { 0 };
+    for (int op = 0; op < OP_COUNT; ++op) {
+        samples += counters->samples[op];
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            totals[counter] += counters->events[op][counter];
+        }
+    }
+    for (int counter = COUNTER_TASK_CLOCK + 1; counter < COUNTER_COUNT; ++counter) {
+        if (counters->fds[counter] == -1) {
+            CERO_INFO("%s is not counted by this host\n", counterStrings[counter]);
+        }
+    }
+    CERO_INFO("Handlers dispatched by the %s engine\n", engineName(counters->engine));
+    CERO_INFO("%-16s %14s %8s %7s %9s %9s %7s %11s %11s\n", "HANDLER", "DISPATCHED", "SAMPLES", "SHARE",
+              "NS/INS", "CYC/INS", "IPC", "BRMISS/DSP", "CMISS/DSP");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (counters->dispatched[op] == 0) {
+            continue;
+        }
+        vm_quad_t length;
+        fusionLeader((Operation)op, &length);
+        uint64_t instructions = counters->dispatched[op] * length;
+        const uint64_t* events = counters->events[op];
+        char ns[16], cycles[16], ipc[16], branches[16], caches[16];
+        CERO_INFO("%-16s %14" PRIu64 " %8" PRIu64 " %6.2f%% %9s %9s %7s %11s %11s\n", operationName((Operation)op),
+                  counters->dispatched[op], counters->samples[op], samples == 0 ? 0.0 : 100.0 * counters->samples[op] / samples,
+                  ratio(counters, COUNTER_TASK_CLOCK, events[COUNTER_TASK_CLOCK], instructions, ns),
+                  ratio(counters, COUNTER_CYCLES, events[COUNTER_CYCLES], instructions, cycles),
+                  ratio(counters, COUNTER_INSTRUCTIONS, events[COUNTER_INSTRUCTIONS], events[COUNTER_CYCLES], ipc),
+                  ratio(counters, COUNTER_BRANCH_MISSES, events[COUNTER_BRANCH_MISSES], counters->dispatched[op], branches),
+                  ratio(counters, COUNTER_CACHE_MISSES, events[COUNTER_CACHE_MISSES], counters->dispatched[op], caches));
+    }
+    CERO_INFO("%" PRIu64 " samples over %.3f ms of host CPU time\n", samples, totals[COUNTER_TASK_CLOCK] / 1e6);
+}
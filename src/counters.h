@@ -0,0 +1,54 @@
+#ifndef cero_counters_h
+#define cero_counters_h
+
+#include <signal.h>
+
+#include "common.h"
+#include "vm.h"
+
+/* Nanoseconds of host CPU time between two samples */
+#ifndef COUNTERS_PERIOD
+#define COUNTERS_PERIOD (50000)
+#endif
+
+/* The host events every sample reads. TASK_CLOCK is a software event leading
+ * the group, the hardware ones are left out on hosts without a PMU (which is
+ * common inside virtual machines) and printed as '-'. */
+#define FOREACH_COUNTER(wrapper)\
+        wrapper(TASK_CLOCK)\
+        wrapper(CYCLES)\
+        wrapper(INSTRUCTIONS)\
+        wrapper(BRANCH_MISSES)\
+        wrapper(CACHE_MISSES)\
+
+#define GENERATE_COUNTER_ENUM(NAME) COUNTER_##NAME,
+
+typedef enum {
+    FOREACH_COUNTER(GENERATE_COUNTER_ENUM)
+    COUNTER_COUNT
+} Counter;
+
+#undef GENERATE_COUNTER_ENUM
+
+/* -----Host counters-----
+ * Attributes the host events spent by runCounted to the handler it was
+ * dispatching, see counters.c. Only handler and dispatched, which the dispatch
+ * writes, are meant to be touched outside of counters.c. */
+typedef struct Counters {
+    volatile sig_atomic_t handler;               /* The Operation dispatched last                       */
+    Engine engine;                               /* Whose dispatch runCounted measured                  */
+    uint64_t dispatched[OP_COUNT];               /* Times each handler was dispatched                   */
+    uint64_t samples[OP_COUNT];                  /* Samples taken while it was the one dispatched       */
+    uint64_t events[OP_COUNT][COUNTER_COUNT];    /* Events of the periods ended by those samples        */
+    uint64_t last[COUNTER_COUNT];                /* Values read by the previous sample                  */
+    int fds[COUNTER_COUNT];                      /* -1 for the events the host does not count           */
+    struct sigaction previous;                   /* The action of SIGIO before startCounters            */
+} Counters;
+
+bool startCounters(VM* vm);
+void stopCounters(VM* vm);
+bool resumeCounters(VM* vm);
+void pauseCounters(VM* vm);
+void printCounters(VM* vm);
+
+#endif
@@ -0,0 +1,129 @@
+#include <string.h>
+
+#include "dedup.h"
+#include "memory.h"
+
+/* -----Page deduplication-----
+ * Like KSM, scanDedup hashes every page of the VMs it is given. A page whose
+ * bytes equal those of a page seen before takes the frame of that one, and
+ * releases its own. Shared frames are copied before their next write (see
+ * fillWriteTlb), so the sharing is broken by the first VM writing to the page
+ * again. Pages of zeros release their frame and read the zero page.
+ *
+ * The table maps the hashes of the frames seen during the scan to them and
+ * holds no reference, it is emptied by the next scan. The VMs must not run
+ * while they are scanned.
+ */
+
+#define DEDUP_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+struct DedupEntry {
+    uint64_t hash;
+    Frame* frame;            /* NULL for empty entries             */
+    AddressSpace* space;     /* The first page found with frame    */
+    vm_quad_t pageNumber;
+};
+
+static const vm_ubyte_t zeros[PAGE_SIZE];
+
+void initDedup(Dedup* dedup) {
+    dedup->entries  = NULL;
+    dedup->count    = 0;
+    dedup->capacity = 0;
+    memset(&dedup->stats, 0, sizeof(dedup->stats));
+}
+
+void freeDedup(Dedup* dedup) {
+    FREE_ARRAY(DedupEntry, dedup->entries, dedup->capacity);
+    initDedup(dedup);
+}
+
+static uint64_t hashPage(const vm_ubyte_t* bytes) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (vm_quad_t i = 0; i < PAGE_SIZE; i += 8) {
+        uint64_t quad;
+        memcpy(&quad, bytes + i, sizeof(quad));
+        hash = (hash ^ quad) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static DedupEntry* findEntry(DedupEntry* entries, uint32_t capacity, uint64_t hash, const vm_ubyte_t* bytes) {
+    uint32_t index = (uint32_t)hash & (capacity - 1);
+    while (true) {
+        DedupEntry* entry = &entries[index];
+        if (entry->frame == NULL ||
+            (entry->hash == hash && (entry->frame->bytes == bytes || memcmp(entry->frame->bytes, bytes, PAGE_SIZE) == 0))) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growTable(Dedup* dedup) {
+    uint32_t oldCapacity = dedup->capacity;
+    DedupEntry* old      = dedup->entries;
+    dedup->capacity = GROW_CAPACITY(oldCapacity);
+    dedup->entries  = INIT_ARRAY(DedupEntry, NULL, dedup->capacity);
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        if (old[i].frame != NULL) {
+            *findEntry(dedup->entries, dedup->capacity, old[i].hash, old[i].frame->bytes) = old[i];
+        }
+    }
+    FREE_ARRAY(DedupEntry, old, oldCapacity);
+}
+
+static void scanPage(Dedup* dedup, AddressSpace* space, Page* page, vm_quad_t pageNumber) {
+    if (memcmp(page->bytes, zeros, PAGE_SIZE) == 0) {
+        mergePage(space, page, pageNumber, NULL);
+        dedup->stats.zeroed++;
+        return;
+    }
+    dedup->stats.pages++;
+    if (dedup->count + 1 > DEDUP_MAX_LOAD(dedup->capacity)) {
+        growTable(dedup);
+    }
+    uint64_t hash     = hashPage(page->bytes);
+    DedupEntry* entry = findEntry(dedup->entries, dedup->capacity, hash, page->bytes);
+    if (entry->frame == NULL) {
+        entry->hash       = hash;
+        entry->frame      = page->frame;
+        entry->space      = space;
+        entry->pageNumber = pageNumber;
+        dedup->count++;
+        return;
+    }
+    if (entry->frame == page->frame) {
+        return;
+    }
+    /* The first page must not be written in place anymore either */
+    flushTlbPage(entry->space, entry->pageNumber);
+    mergePage(space, page, pageNumber, entry->frame);
+    dedup->stats.merged++;
+}
+
+/* Merges the identical pages of the VMs and returns what the scan found */
+DedupStats scanDedup(Dedup* dedup, VM** vms, uint32_t count) {
+    memset(&dedup->stats, 0, sizeof(dedup->stats));
+    if (dedup->count > 0) {
+        memset(dedup->entries, 0, sizeof(DedupEntry) * dedup->capacity);
+        dedup->count = 0;
+    }
+    for (uint32_t v = 0; v < count; ++v) {
+        AddressSpace* space  = &vms[v]->memory;
+        vm_quad_t pageNumber = 0;
+        for (Page* page = nextPage(space, &pageNumber); page != NULL; page = nextPage(space, &pageNumber)) {
+            /* Pages without a frame read zeros or a mapped checkpoint */
+            if (page->frame != NULL) {
+                scanPage(dedup, space, page, pageNumber);
+            }
+            pageNumber++;
+        }
+    }
+    dedup->stats.frames     = dedup->count;
+    dedup->stats.bytesSaved = (dedup->stats.pages - dedup->stats.frames) * PAGE_SIZE;
+    CERO_DEBUG("dedup::scan %" PRIu64 " pages in %" PRIu64 " frames, %" PRIu64 " merged, %" PRIu64 " bytes saved\n",
+               dedup->stats.pages, dedup->stats.frames, dedup->stats.merged, dedup->stats.bytesSaved);
+    return dedup->stats;
+}
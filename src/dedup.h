@@ -0,0 +1,32 @@
+#ifndef cero_dedup_h
+#define cero_dedup_h
+
+#include "common.h"
+#include "vm.h"
+
+/* What the last scan found, over all the VMs it was given */
+typedef struct {
+    uint64_t pages;          /* Pages holding a frame                          */
+    uint64_t frames;         /* Distinct frames they hold after the scan       */
+    uint64_t merged;         /* Pages the scan moved to another frame          */
+    uint64_t zeroed;         /* Pages of zeros the scan released the frame of  */
+    uint64_t bytesSaved;     /* Bytes the shared frames save, (pages - frames) */
+} DedupStats;
+
+typedef struct DedupEntry DedupEntry;
+
+/* -----Page deduplication-----
+ * Merges the pages with the same bytes of a fleet of VMs into shared frames,
+ * see scanDedup. The table is only kept between scans for its allocation. */
+typedef struct {
+    DedupEntry* entries;
+    uint32_t count;
+    uint32_t capacity;       /* A power of two                                 */
+    DedupStats stats;
+} Dedup;
+
+void initDedup(Dedup* dedup);
+void freeDedup(Dedup* dedup);
+DedupStats scanDedup(Dedup* dedup, VM** vms, uint32_t count);
+
+#endif
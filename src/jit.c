@@ -0,0 +1,971 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "metrics.h"
+
+/* -----Basic block JIT-----
+ * The JIT engine interprets code with runBasicBlock until the block starting
+ * at some PC has been reached JIT_HOT_THRESHOLD times. The block, up to and
+ * including the first jXX, call, ret or halt, is then translated into x86-64
+ * machine code in an executable buffer.
+ *
+ * Translated blocks are entered through a trampoline which saves the callee-saved
+ * host registers and keeps the VM and its registers in R15 and R14. The guest
+ * registers a block uses the most are cached in the callee-saved RBX, RBP, R12 and
+ * R13 for the duration of the block. Every exit of a block writes them back such
+ * that the VM state is exactly what the interpreter would have produced at every
+ * block boundary.
+ *
+ * Exits with a known target end in a jmp which initially falls through to code
+ * storing the target PC and returning to runJit. Once the target has been
+ * translated the jmp is patched to go straight to it, chaining the blocks. The
+ * target of ret is looked up in the block table at runtime instead.
+ *
+ * Memory is accessed through jitLoad and jitStore. If an access would fault
+ * the block exits with the PC at the faulting instruction, and the interpreter
+ * re-executes it to raise the fault exactly as it would have. A write to the
+ * bytes of a translated block discards every translation once the block has
+ * exited back to runJit. Pages holding translated bytes keep a bitmap of them.
+ *
+ * Blocks translated while the VM publishes metrics add the instructions they
+ * retired to a counter on every exit, and leave on entry once it reached
+ * METRICS_SLICE such that runJit publishes them even from chained loops.
+ *
+ * https://www.felixcloutier.com/x86/
+ */
+
+#ifdef JIT_SUPPORTED
+#include <sys/mman.h>
+
+/* x86-64 general purpose registers */
+#define HOST_RAX (0)
+#define HOST_RCX (1)
+#define HOST_RDX (2)
+#define HOST_RBX (3)
+#define HOST_RSP (4)
+#define HOST_RBP (5)
+#define HOST_RSI (6)
+#define HOST_RDI (7)
+#define HOST_R8  (8)
+#define HOST_R12 (12)
+#define HOST_R13 (13)
+#define HOST_R14 (14)
+#define HOST_R15 (15)
+
+/* Host registers with a fixed purpose inside translated code */
+#define HOST_VM        HOST_R15 /* VM*           */
+#define HOST_REGISTERS HOST_R14 /* vm->registers */
+
+/* Callee-saved host registers guest registers are cached in */
+static const int cacheRegisters[] = { HOST_RBX, HOST_RBP, HOST_R12, HOST_R13 };
+#define CACHE_REGISTER_COUNT (sizeof(cacheRegisters) / sizeof(cacheRegisters[0]))
+
+/* x86-64 condition codes (the low nibble of jcc, setcc and cmovcc) */
+#define HOST_CC_O  (0x0)
+#define HOST_CC_B  (0x2)
+#define HOST_CC_E  (0x4)
+#define HOST_CC_NE (0x5)
+#define HOST_CC_S  (0x8)
+
+/* Opcodes of the r/m64, r64 forms of the arithmetic and logical instructions */
+#define HOST_ADD  (0x01)
+#define HOST_AND  (0x21)
+#define HOST_SUB  (0x29)
+#define HOST_XOR  (0x31)
+#define HOST_TEST (0x85)
+
+/* Free space required before translating a block, the largest translation
+ * of a single instruction including its side exit is well below 256 bytes */
+#define JIT_BLOCK_RESERVE (JIT_MAX_BLOCK_LENGTH * 256 + 256)
+
+typedef struct {
+    bool used;          /* Whether this slot of the table holds a block     */
+    bool failed;        /* Whether the block could not be translated        */
+    uint32_t hits;      /* Times the block was interpreted                  */
+    vm_quad_t pc;       /* Guest PC of the first instruction of the block   */
+    uint8_t* code;      /* Entry of the translation, NULL if not translated */
+} JitBlock;
+
+typedef struct {
+    vm_quad_t target;   /* The guest PC the exit continues at               */
+    uint8_t* patch;     /* rel32 of the jmp chaining the exit to the target */
+} JitExit;
+
+typedef struct Jit {
+    uint8_t* code;                       /* The executable buffer                          */
+    uint32_t used;                       /* Number of bytes of the buffer in use           */
+    uint32_t trampolineSize;             /* Bytes at the start of the buffer never flushed */
+    void (*enter)(VM* vm, uint8_t* code);/* Trampoline running translated code             */
+    uint8_t* leave;                      /* Returns from the trampoline back to runJit     */
+    JitBlock* blocks;                    /* Open addressing table of blocks by PC          */
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    JitExit* exits;                      /* Every exit with a known target                 */
+    uint32_t exitCount;
+    uint32_t exitCapacity;
+    bool flushPending;                   /* Set when translated guest bytes were written   */
+    bool faulted;                        /* Set when a block left at a faulting access     */
+    bool metered;                        /* Whether the blocks count what they retire      */
+    uint64_t retired;                    /* Instructions they retired since runJit took it */
+} Jit;
+
+typedef struct {
+    vm_quad_t value;
+    uint64_t ok;
+} JitLoad;
+
+/* -----Runtime helpers called from translated code----- */
+static JitLoad jitLoad(VM* vm, vm_quad_t addr) {
+    JitLoad load = { 0, addrInMem(vm, addr, 8) };
+    if (load.ok) {
+        load.value = m8r(vm, addr);
+    }
+    return load;
+}
+
+static uint64_t jitStore(VM* vm, vm_quad_t addr, vm_quad_t value) {
+    if (!addrInMem(vm, addr, 8)) {
+        return 0;
+    }
+    m8w(vm, addr, value);
+    return 1;
+}
+
+static JitBlock* findBlock(Jit* jit, vm_quad_t pc, bool insert);
+
+static uint8_t* jitLookup(VM* vm, vm_quad_t pc) {
+    JitBlock* block = findBlock(vm->cold->jit, pc, false);
+    return block != NULL ? block->code : NULL;
+}
+
+/* -----Block table----- */
+static inline uint32_t hashPc(vm_quad_t pc) {
+    uint64_t hash = (uint64_t)pc * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash >> 32);
+}
+
+static JitBlock* findBlock(Jit* jit, vm_quad_t pc, bool insert) {
+    if (insert && (jit->blockCount + 1) * 2 > jit->blockCapacity) {
+        uint32_t oldCapacity = jit->blockCapacity;
+        JitBlock* oldBlocks  = jit->blocks;
+        jit->blockCapacity = GROW_CAPACITY(oldCapacity);
+        jit->blocks        = INIT_ARRAY(JitBlock, NULL, jit->blockCapacity);
+        jit->blockCount    = 0;
+        for (uint32_t i = 0; i < oldCapacity; ++i) {
+            if (oldBlocks[i].used) {
+                *findBlock(jit, oldBlocks[i].pc, true) = oldBlocks[i];
+            }
+        }
+        FREE_ARRAY(JitBlock, oldBlocks, oldCapacity);
+    }
+    if (jit->blockCapacity == 0) {
+        return NULL;
+    }
+    uint32_t mask = jit->blockCapacity - 1;
+    for (uint32_t i = hashPc(pc) & mask; ; i = (i + 1) & mask) {
+        JitBlock* block = &jit->blocks[i];
+        if (block->used && block->pc == pc) {
+            return block;
+        }
+        if (!block->used) {
+            if (!insert) {
+                return NULL;
+            }
+            memset(block, 0, sizeof(JitBlock));
+            block->used = true;
+            block->pc   = pc;
+            jit->blockCount++;
+            return block;
+        }
+    }
+}
+
+/* -----Emitter----- */
+static inline uint8_t* here(Jit* jit) {
+    return jit->code + jit->used;
+}
+
+static inline void emit8(Jit* jit, uint8_t byte) {
+    jit->code[jit->used++] = byte;
+}
+
+static inline void emit32(Jit* jit, uint32_t value) {
+    memcpy(here(jit), &value, 4);
+    jit->used += 4;
+}
+
+static inline void emit64(Jit* jit, uint64_t value) {
+    memcpy(here(jit), &value, 8);
+    jit->used += 8;
+}
+
+static inline void emitRex(Jit* jit, bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) {
+        emit8(jit, rex);
+    }
+}
+
+/* ModRM for a register operand */
+static inline void emitDirect(Jit* jit, int reg, int rm) {
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* ModRM (and SIB) for a [base + disp32] operand */
+static inline void emitIndirect(Jit* jit, int reg, int base, int32_t disp) {
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == HOST_RSP) {
+        emit8(jit, 0x24);
+    }
+    emit32(jit, (uint32_t)disp);
+}
+
+static inline void patchRel32(uint8_t* rel32, uint8_t* target) {
+    int32_t rel = (int32_t)(target - (rel32 + 4));
+    memcpy(rel32, &rel, 4);
+}
+
+/* mov dst, src */
+static void movRegReg(Jit* jit, int dst, int src) {
+    if (dst != src) {
+        emitRex(jit, true, src, dst);
+        emit8(jit, 0x89);
+        emitDirect(jit, src, dst);
+    }
+}
+
+/* mov dst, [base + disp] */
+static void movRegMem(Jit* jit, int dst, int base, int32_t disp) {
+    emitRex(jit, true, dst, base);
+    emit8(jit, 0x8B);
+    emitIndirect(jit, dst, base, disp);
+}
+
+/* mov [base + disp], src */
+static void movMemReg(Jit* jit, int base, int32_t disp, int src) {
+    emitRex(jit, true, src, base);
+    emit8(jit, 0x89);
+    emitIndirect(jit, src, base, disp);
+}
+
+/* lea dst, [base + disp] */
+static void leaRegMem(Jit* jit, int dst, int base, int32_t disp) {
+    emitRex(jit, true, dst, base);
+    emit8(jit, 0x8D);
+    emitIndirect(jit, dst, base, disp);
+}
+
+/* mov dst, imm */
+static void movRegImm(Jit* jit, int dst, uint64_t imm) {
+    if ((int64_t)(int32_t)imm == (int64_t)imm) {
+        emitRex(jit, true, 0, dst);
+        emit8(jit, 0xC7);
+        emitDirect(jit, 0, dst);
+        emit32(jit, (uint32_t)imm);
+    } else {
+        emitRex(jit, true, 0, dst);
+        emit8(jit, 0xB8 | (dst & 7));
+        emit64(jit, imm);
+    }
+}
+
+/* mov dword [base + disp], imm */
+static void movMem32Imm(Jit* jit, int base, int32_t disp, uint32_t imm) {
+    emitRex(jit, false, 0, base);
+    emit8(jit, 0xC7);
+    emitIndirect(jit, 0, base, disp);
+    emit32(jit, imm);
+}
+
+/* movzx dst, byte [base + disp] */
+static void movzxRegMem8(Jit* jit, int dst, int base, int32_t disp) {
+    emitRex(jit, false, dst, base);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB6);
+    emitIndirect(jit, dst, base, disp);
+}
+
+/* mov byte [base + disp], src (AL, CL, DL or BL) */
+static void movMem8Reg(Jit* jit, int base, int32_t disp, int src) {
+    emitRex(jit, false, src, base);
+    emit8(jit, 0x88);
+    emitIndirect(jit, src, base, disp);
+}
+
+/* add/sub/and/xor/test dst, src */
+static void aluRegReg(Jit* jit, uint8_t opcode, int dst, int src) {
+    emitRex(jit, true, src, dst);
+    emit8(jit, opcode);
+    emitDirect(jit, src, dst);
+}
+
+/* add qword [base + disp], imm */
+static void addMemImm32(Jit* jit, int base, int32_t disp, int32_t imm) {
+    emitRex(jit, true, 0, base);
+    emit8(jit, 0x81);
+    emitIndirect(jit, 0, base, disp);
+    emit32(jit, (uint32_t)imm);
+}
+
+/* cmp qword [base + disp], imm */
+static void cmpMemImm32(Jit* jit, int base, int32_t disp, int32_t imm) {
+    emitRex(jit, true, 0, base);
+    emit8(jit, 0x81);
+    emitIndirect(jit, 7, base, disp);
+    emit32(jit, (uint32_t)imm);
+}
+
+/* add dst, imm8 */
+static void addRegImm8(Jit* jit, int dst, int8_t imm) {
+    emitRex(jit, true, 0, dst);
+    emit8(jit, 0x83);
+    emitDirect(jit, 0, dst);
+    emit8(jit, (uint8_t)imm);
+}
+
+/* setcc dst (byte register) */
+static void setcc(Jit* jit, int cc, int dst) {
+    emitRex(jit, false, 0, dst);
+    emit8(jit, 0x0F);
+    emit8(jit, 0x90 | cc);
+    emitDirect(jit, 0, dst);
+}
+
+/* shl dst, imm (byte register) */
+static void shlReg8Imm(Jit* jit, int dst, uint8_t imm) {
+    emitRex(jit, false, 0, dst);
+    emit8(jit, 0xC0);
+    emitDirect(jit, 4, dst);
+    emit8(jit, imm);
+}
+
+/* or dst, src (byte registers) */
+static void orReg8Reg8(Jit* jit, int dst, int src) {
+    emitRex(jit, false, src, dst);
+    emit8(jit, 0x08);
+    emitDirect(jit, src, dst);
+}
+
+/* test dst, imm (AL, CL, DL or BL) */
+static void testReg8Imm(Jit* jit, int dst, uint8_t imm) {
+    emit8(jit, 0xF6);
+    emitDirect(jit, 0, dst);
+    emit8(jit, imm);
+}
+
+/* cmovcc dst, src */
+static void cmovRegReg(Jit* jit, int cc, int dst, int src) {
+    emitRex(jit, true, dst, src);
+    emit8(jit, 0x0F);
+    emit8(jit, 0x40 | cc);
+    emitDirect(jit, dst, src);
+}
+
+/* jcc rel32, returns the rel32 to patch */
+static uint8_t* jcc(Jit* jit, int cc) {
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 | cc);
+    emit32(jit, 0);
+    return here(jit) - 4;
+}
+
+/* jmp rel32, returns the rel32 to patch. Falls through until patched */
+static uint8_t* jmp(Jit* jit) {
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    return here(jit) - 4;
+}
+
+/* jmp target */
+static void jmpReg(Jit* jit, int target) {
+    emitRex(jit, false, 0, target);
+    emit8(jit, 0xFF);
+    emitDirect(jit, 4, target);
+}
+
+/* call function, clobbers RAX */
+static void callAbs(Jit* jit, void* function) {
+    movRegImm(jit, HOST_RAX, (uint64_t)(uintptr_t)function);
+    emit8(jit, 0xFF);
+    emitDirect(jit, 2, HOST_RAX);
+}
+
+static void push(Jit* jit, int reg) {
+    emitRex(jit, false, 0, reg);
+    emit8(jit, 0x50 | (reg & 7));
+}
+
+static void pop(Jit* jit, int reg) {
+    emitRex(jit, false, 0, reg);
+    emit8(jit, 0x58 | (reg & 7));
+}
+
+/* -----Translation----- */
+typedef struct {
+    uint8_t* rel32;     /* Branch to the side exit                    */
+    vm_quad_t pc;       /* Guest PC the side exit leaves at           */
+    bool fault;         /* Whether the instruction at pc has to fault */
+    uint32_t retired;   /* Instructions of the block retired by then  */
+} SideExit;
+
+typedef struct {
+    Jit* jit;
+    int cached[REG_COUNT];   /* Host register caching each guest register, -1 if none */
+    SideExit sideExits[JIT_MAX_BLOCK_LENGTH * 2];
+    uint32_t sideExitCount;
+    uint32_t index;          /* Instruction of the block being translated */
+} Translation;
+
+static void loadGuest(Translation* t, int host, vm_ubyte_t guest) {
+    if (t->cached[guest] >= 0) {
+        movRegReg(t->jit, host, t->cached[guest]);
+    } else {
+        movRegMem(t->jit, host, HOST_REGISTERS, 8 * guest);
+    }
+}
+
+static void storeGuest(Translation* t, vm_ubyte_t guest, int host) {
+    if (t->cached[guest] >= 0) {
+        movRegReg(t->jit, t->cached[guest], host);
+    } else {
+        movMemReg(t->jit, HOST_REGISTERS, 8 * guest, host);
+    }
+}
+
+static void writeBack(Translation* t) {
+    for (int guest = 0; guest < REG_COUNT; ++guest) {
+        if (t->cached[guest] >= 0) {
+            movMemReg(t->jit, HOST_REGISTERS, 8 * guest, t->cached[guest]);
+        }
+    }
+}
+
+/* Adds the instructions of the block retired so far to jit->retired, clobbers RCX */
+static void emitRetire(Translation* t, uint32_t retired) {
+    if (t->jit->metered && retired > 0) {
+        movRegImm(t->jit, HOST_RCX, (uint64_t)(uintptr_t)&t->jit->retired);
+        addMemImm32(t->jit, HOST_RCX, 0, (int32_t)retired);
+    }
+}
+
+static void leaveAt(Translation* t, vm_quad_t pc) {
+    movRegImm(t->jit, HOST_RAX, (uint64_t)pc);
+    movMemReg(t->jit, HOST_VM, offsetof(VM, pc), HOST_RAX);
+    patchRel32(jmp(t->jit), t->jit->leave);
+}
+
+static void addExit(Jit* jit, vm_quad_t target, uint8_t* patch) {
+    if (jit->exitCount == jit->exitCapacity) {
+        uint32_t oldCapacity = jit->exitCapacity;
+        jit->exitCapacity = GROW_CAPACITY(oldCapacity);
+        jit->exits = GROW_ARRAY(JitExit, jit->exits, oldCapacity, jit->exitCapacity);
+    }
+    jit->exits[jit->exitCount].target = target;
+    jit->exits[jit->exitCount].patch  = patch;
+    jit->exitCount++;
+    JitBlock* block = findBlock(jit, target, false);
+    if (block != NULL && block->code != NULL) {
+        patchRel32(patch, block->code);
+    }
+}
+
+/* Leaves the block for target, chained once target is translated */
+static void emitExit(Translation* t, vm_quad_t target) {
+    writeBack(t);
+    emitRetire(t, t->index + 1);
+    addExit(t->jit, target, jmp(t->jit));
+    leaveAt(t, target);
+}
+
+/* Branches to an out of line exit at pc when the condition holds */
+static void emitSideExit(Translation* t, int cc, vm_quad_t pc, bool fault) {
+    SideExit* exit = &t->sideExits[t->sideExitCount++];
+    exit->rel32 = jcc(t->jit, cc);
+    exit->pc      = pc;
+    exit->fault   = fault;
+    exit->retired = fault ? t->index : t->index + 1;
+}
+
+/* Leaves after an instruction which wrote to translated guest bytes */
+static void emitFlushCheck(Translation* t, vm_quad_t pc) {
+    movRegImm(t->jit, HOST_RAX, (uint64_t)(uintptr_t)&t->jit->flushPending);
+    emit8(t->jit, 0x80);                   /* cmp byte [rax], 0 */
+    emitIndirect(t->jit, 7, HOST_RAX, 0);
+    emit8(t->jit, 0);
+    emitSideExit(t, HOST_CC_NE, pc, false);
+}
+
+/* Calls jitStore(vm, [RSI], RDX) and leaves at pc if it faulted */
+static void emitStore(Translation* t, vm_quad_t pc) {
+    movRegReg(t->jit, HOST_RDI, HOST_VM);
+    callAbs(t->jit, (void*)jitStore);
+    aluRegReg(t->jit, HOST_TEST, HOST_RAX, HOST_RAX);
+    emitSideExit(t, HOST_CC_E, pc, true);
+}
+
+/* Calls jitLoad(vm, [RSI]) into RAX and leaves at pc if it faulted */
+static void emitLoad(Translation* t, vm_quad_t pc) {
+    movRegReg(t->jit, HOST_RDI, HOST_VM);
+    callAbs(t->jit, (void*)jitLoad);
+    aluRegReg(t->jit, HOST_TEST, HOST_RDX, HOST_RDX);
+    emitSideExit(t, HOST_CC_E, pc, true);
+}
+
+/* Packs the flags of the last host ALU instruction into vm->conditionCodes */
+static void emitConditionCodes(Translation* t) {
+    Jit* jit = t->jit;
+    setcc(jit, HOST_CC_E, HOST_RAX);
+    setcc(jit, HOST_CC_S, HOST_RDX);
+    setcc(jit, HOST_CC_O, HOST_R8);
+    shlReg8Imm(jit, HOST_RDX, CC_SF);
+    shlReg8Imm(jit, HOST_R8,  CC_OF);
+    orReg8Reg8(jit, HOST_RAX, HOST_RDX);
+    orReg8Reg8(jit, HOST_RAX, HOST_R8);
+    movMem8Reg(jit, HOST_VM, offsetof(VM, conditionCodes), HOST_RAX);
+}
+
+/* The condition of a jXX or cmovXX as a test of the conditionCodes byte:
+ * it holds when (conditionCodes & mask) is non-zero, or zero if inverted */
+static void conditionOf(Operation operation, uint8_t* mask, bool* inverted) {
+    const uint8_t ZF = 1 << CC_ZF, SF = 1 << CC_SF;
+    switch (operation) {
+        case OP_JLE: case OP_CMOVLE: *mask = SF | ZF; *inverted = false; break;
+        case OP_JL:  case OP_CMOVL:  *mask = SF;      *inverted = false; break;
+        case OP_JE:  case OP_CMOVE:  *mask = ZF;      *inverted = false; break;
+        case OP_JNE: case OP_CMOVNE: *mask = ZF;      *inverted = true;  break;
+        case OP_JGE: case OP_CMOVGE: *mask = SF;      *inverted = true;  break;
+        default:                     *mask = SF | ZF; *inverted = true;  break;
+    }
+}
+
+static void emitCondition(Translation* t, Operation operation) {
+    uint8_t mask;
+    bool inverted;
+    conditionOf(operation, &mask, &inverted);
+    movzxRegMem8(t->jit, HOST_RDX, HOST_VM, offsetof(VM, conditionCodes));
+    testReg8Imm(t->jit, HOST_RDX, mask);
+}
+
+static int conditionHostCc(Operation operation) {
+    uint8_t mask;
+    bool inverted;
+    conditionOf(operation, &mask, &inverted);
+    return inverted ? HOST_CC_E : HOST_CC_NE;
+}
+
+static bool isAlu(Operation operation) {
+    return operation == OP_ADDQ || operation == OP_SUBQ || operation == OP_ANDQ || operation == OP_XORQ;
+}
+
+/* Whether the conditionCodes can be observed right after the operation,
+ * either by the operation itself or by leaving the block */
+static bool observesFlags(Operation operation) {
+    switch (operation) {
+        case OP_ADDQ: case OP_SUBQ: case OP_ANDQ: case OP_XORQ:
+        case OP_NOP:  case OP_RRMOVQ: case OP_IRMOVQ: case OP_JMP:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/* Caches the guest registers used at least twice, the most used first */
+static void allocateRegisters(Translation* t, const Instruction* block, uint32_t length) {
+    uint32_t uses[REG_COUNT] = { 0 };
+    for (uint32_t i = 0; i < length; ++i) {
+        const Instruction* ins = &block[i];
+        switch (ins->operation) {
+            case OP_CALL: case OP_RET:
+                uses[REG_RSP] += 2;
+                break;
+            case OP_PUSHQ: case OP_POPQ:
+                uses[REG_RSP] += 2;
+                uses[ins->rA] += 1;
+                break;
+            default:
+                if (ins->rA != REG_F) {
+                    uses[ins->rA] += 1;
+                }
+                if (ins->rB != REG_F) {
+                    uses[ins->rB] += 1;
+                }
+                break;
+        }
+    }
+    for (int guest = 0; guest < REG_COUNT; ++guest) {
+        t->cached[guest] = -1;
+    }
+    for (size_t i = 0; i < CACHE_REGISTER_COUNT; ++i) {
+        int best = -1;
+        for (int guest = 0; guest < REG_COUNT; ++guest) {
+            if (t->cached[guest] < 0 && uses[guest] >= 2 && (best < 0 || uses[guest] > uses[best])) {
+                best = guest;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        t->cached[best] = cacheRegisters[i];
+    }
+}
+
+static void translateInstruction(Translation* t, const Instruction* ins, vm_quad_t pc, bool flagsLive) {
+    Jit* jit = t->jit;
+    switch (ins->operation) {
+        case OP_NOP:
+            break;
+        case OP_HALT:
+            movMem32Imm(jit, HOST_VM, offsetof(VM, statusCondition), STAT_HLT);
+            writeBack(t);
+            emitRetire(t, t->index + 1);
+            leaveAt(t, ins->valP);
+            break;
+        case OP_RRMOVQ:
+            loadGuest(t, HOST_RAX, ins->rA);
+            storeGuest(t, ins->rB, HOST_RAX);
+            break;
+        case OP_IRMOVQ:
+            if (t->cached[ins->rB] >= 0) {
+                movRegImm(jit, t->cached[ins->rB], (uint64_t)ins->valC);
+            } else {
+                movRegImm(jit, HOST_RAX, (uint64_t)ins->valC);
+                storeGuest(t, ins->rB, HOST_RAX);
+            }
+            break;
+        case OP_RMMOVQ:
+            loadGuest(t, HOST_RSI, ins->rB);
+            movRegImm(jit, HOST_RAX, (uint64_t)ins->valC);
+            aluRegReg(jit, HOST_ADD, HOST_RSI, HOST_RAX);
+            loadGuest(t, HOST_RDX, ins->rA);
+            emitStore(t, pc);
+            emitFlushCheck(t, ins->valP);
+            break;
+        case OP_MRMOVQ:
+            loadGuest(t, HOST_RSI, ins->rB);
+            movRegImm(jit, HOST_RAX, (uint64_t)ins->valC);
+            aluRegReg(jit, HOST_ADD, HOST_RSI, HOST_RAX);
+            emitLoad(t, pc);
+            storeGuest(t, ins->rA, HOST_RAX);
+            break;
+        case OP_ADDQ: case OP_SUBQ: case OP_ANDQ: case OP_XORQ: {
+            uint8_t opcode = ins->operation == OP_ADDQ ? HOST_ADD :
+                             ins->operation == OP_SUBQ ? HOST_SUB :
+                             ins->operation == OP_ANDQ ? HOST_AND : HOST_XOR;
+            loadGuest(t, HOST_RCX, ins->rB);
+            loadGuest(t, HOST_RAX, ins->rA);
+            aluRegReg(jit, opcode, HOST_RCX, HOST_RAX);
+            if (flagsLive) {
+                emitConditionCodes(t);
+            }
+            storeGuest(t, ins->rB, HOST_RCX);
+            break;
+        }
+        case OP_JMP:
+            emitExit(t, ins->valC);
+            break;
+        case OP_JLE: case OP_JL: case OP_JE: case OP_JNE: case OP_JGE: case OP_JG: {
+            emitCondition(t, (Operation)ins->operation);
+            uint8_t* taken = jcc(jit, conditionHostCc((Operation)ins->operation));
+            emitExit(t, ins->valP);
+            patchRel32(taken, here(jit));
+            emitExit(t, ins->valC);
+            break;
+        }
+        case OP_CMOVLE: case OP_CMOVL: case OP_CMOVE: case OP_CMOVNE: case OP_CMOVGE: case OP_CMOVG:
+            loadGuest(t, HOST_RAX, ins->rA);
+            loadGuest(t, HOST_RCX, ins->rB);
+            emitCondition(t, (Operation)ins->operation);
+            cmovRegReg(jit, conditionHostCc((Operation)ins->operation), HOST_RCX, HOST_RAX);
+            storeGuest(t, ins->rB, HOST_RCX);
+            break;
+        case OP_CALL:
+            loadGuest(t, HOST_RSI, REG_RSP);
+            addRegImm8(jit, HOST_RSI, -8);
+            movRegImm(jit, HOST_RDX, (uint64_t)ins->valP);
+            emitStore(t, pc);
+            loadGuest(t, HOST_RAX, REG_RSP);
+            addRegImm8(jit, HOST_RAX, -8);
+            storeGuest(t, REG_RSP, HOST_RAX);
+            emitFlushCheck(t, ins->valC);
+            emitExit(t, ins->valC);
+            break;
+        case OP_RET:
+            loadGuest(t, HOST_RSI, REG_RSP);
+            emitLoad(t, pc);
+            loadGuest(t, HOST_RCX, REG_RSP);
+            addRegImm8(jit, HOST_RCX, 8);
+            storeGuest(t, REG_RSP, HOST_RCX);
+            movMemReg(jit, HOST_VM, offsetof(VM, pc), HOST_RAX);
+            writeBack(t);
+            emitRetire(t, t->index + 1);
+            movRegReg(jit, HOST_RSI, HOST_RAX);
+            movRegReg(jit, HOST_RDI, HOST_VM);
+            callAbs(jit, (void*)jitLookup);
+            aluRegReg(jit, HOST_TEST, HOST_RAX, HOST_RAX);
+            patchRel32(jcc(jit, HOST_CC_E), jit->leave);
+            jmpReg(jit, HOST_RAX);
+            break;
+        case OP_PUSHQ:
+            loadGuest(t, HOST_RDX, ins->rA);
+            loadGuest(t, HOST_RSI, REG_RSP);
+            addRegImm8(jit, HOST_RSI, -8);
+            emitStore(t, pc);
+            loadGuest(t, HOST_RAX, REG_RSP);
+            addRegImm8(jit, HOST_RAX, -8);
+            storeGuest(t, REG_RSP, HOST_RAX);
+            emitFlushCheck(t, ins->valP);
+            break;
+        case OP_POPQ:
+            loadGuest(t, HOST_RSI, REG_RSP);
+            emitLoad(t, pc);
+            loadGuest(t, HOST_RCX, REG_RSP);
+            addRegImm8(jit, HOST_RCX, 8);
+            storeGuest(t, REG_RSP, HOST_RCX);
+            storeGuest(t, ins->rA, HOST_RAX);
+            break;
+    }
+}
+
+static void translate(VM* vm, Jit* jit, JitBlock* block) {
+    Instruction instructions[JIT_MAX_BLOCK_LENGTH];
+    vm_quad_t pcs[JIT_MAX_BLOCK_LENGTH];
+    uint32_t length = 0;
+    vm_quad_t pc    = block->pc;
+    bool ended      = false;
+    while (length < JIT_MAX_BLOCK_LENGTH && !ended) {
+        const Instruction* ins = fetch(vm, pc);
+        if (ins->operation == OP_INVALID || ins->operation == OP_BAD_FETCH) {
+            break;
+        }
+        instructions[length] = *ins;
+        pcs[length]          = pc;
+        ended = endsBasicBlock((Operation)ins->operation);
+        pc = ins->valP;
+        length++;
+    }
+    if (length == 0) {
+        block->failed = true;
+        return;
+    }
+    CERO_DEBUG("jit::translate 0x%04" PRIx64 "-0x%04" PRIx64 " (%u instructions)\n", block->pc, pc, length);
+
+    if (JIT_CODE_SIZE - jit->used < JIT_BLOCK_RESERVE) {
+        jit->flushPending = true;
+        return;
+    }
+
+    /* Only the last ALU instruction before the flags are observed needs
+     * to pack them into the conditionCodes */
+    bool flagsLive[JIT_MAX_BLOCK_LENGTH];
+    bool live = true;
+    for (int32_t i = (int32_t)length - 1; i >= 0; --i) {
+        Operation operation = (Operation)instructions[i].operation;
+        flagsLive[i] = live;
+        if (isAlu(operation)) {
+            live = false;
+        }
+        if (observesFlags(operation)) {
+            live = true;
+        }
+    }
+
+    Translation t;
+    t.jit = jit;
+    t.sideExitCount = 0;
+    allocateRegisters(&t, instructions, length);
+
+    uint8_t* entry = here(jit);
+    if (jit->metered) {
+        movRegImm(jit, HOST_RCX, (uint64_t)(uintptr_t)&jit->retired);
+        cmpMemImm32(jit, HOST_RCX, 0, METRICS_SLICE);
+        uint8_t* below = jcc(jit, HOST_CC_B);
+        leaveAt(&t, block->pc);
+        patchRel32(below, here(jit));
+    }
+    for (int guest = 0; guest < REG_COUNT; ++guest) {
+        if (t.cached[guest] >= 0) {
+            movRegMem(jit, t.cached[guest], HOST_REGISTERS, 8 * guest);
+        }
+    }
+    for (t.index = 0; t.index < length; ++t.index) {
+        translateInstruction(&t, &instructions[t.index], pcs[t.index], flagsLive[t.index]);
+    }
+    t.index = length - 1;
+    if (!ended) {
+        emitExit(&t, pc);
+    }
+    for (uint32_t i = 0; i < t.sideExitCount; ++i) {
+        patchRel32(t.sideExits[i].rel32, here(jit));
+        if (t.sideExits[i].fault) {
+            movRegImm(jit, HOST_RAX, (uint64_t)(uintptr_t)&jit->faulted);
+            emit8(jit, 0xC6);                  /* mov byte [rax], 1 */
+            emitIndirect(jit, 0, HOST_RAX, 0);
+            emit8(jit, 1);
+        }
+        writeBack(&t);
+        emitRetire(&t, t.sideExits[i].retired);
+        leaveAt(&t, t.sideExits[i].pc);
+    }
+
+    block->code = entry;
+    Page* page = NULL;
+    for (vm_quad_t byte = block->pc; byte < pc; ++byte) {
+        if (page == NULL || (byte & PAGE_MASK) == 0) {
+            page = findPage(&vm->memory, byte >> PAGE_BITS, true);
+            if (page->translated == NULL) {
+                page->translated = INIT_ARRAY(vm_ubyte_t, NULL, PAGE_BITMAP_SIZE);
+            }
+        }
+        page->translated[(byte & PAGE_MASK) / 8] |= 1 << (byte % 8);
+    }
+    for (uint32_t i = 0; i < jit->exitCount; ++i) {
+        if (jit->exits[i].target == block->pc) {
+            patchRel32(jit->exits[i].patch, entry);
+        }
+    }
+}
+
+static void flushJit(VM* vm, Jit* jit) {
+    CERO_DEBUG("jit::flush\n");
+    jit->used = jit->trampolineSize;
+    memset(jit->blocks, 0, sizeof(JitBlock) * jit->blockCapacity);
+    jit->blockCount   = 0;
+    jit->exitCount    = 0;
+    jit->flushPending = false;
+    vm_quad_t pageNumber = 0;
+    for (Page* page = nextPage(&vm->memory, &pageNumber); page != NULL; page = nextPage(&vm->memory, &pageNumber)) {
+        if (page->translated != NULL) {
+            memset(page->translated, 0, PAGE_BITMAP_SIZE);
+        }
+        pageNumber++;
+    }
+}
+
+static Jit* newJit(VM* vm) {
+    void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        CERO_WARN("Unable to map the JIT buffer, interpreting instead\n");
+        return NULL;
+    }
+    Jit* jit = INIT_ARRAY(Jit, NULL, 1);
+    jit->code = code;
+
+    /* void enter(VM* vm, uint8_t* code) */
+    jit->enter = (void (*)(VM*, uint8_t*))here(jit);
+    push(jit, HOST_RBP);
+    push(jit, HOST_RBX);
+    push(jit, HOST_R12);
+    push(jit, HOST_R13);
+    push(jit, HOST_R14);
+    push(jit, HOST_R15);
+    addRegImm8(jit, HOST_RSP, -8);
+    movRegReg(jit, HOST_VM, HOST_RDI);
+    leaRegMem(jit, HOST_REGISTERS, HOST_VM, offsetof(VM, registers));
+    jmpReg(jit, HOST_RSI);
+
+    jit->leave = here(jit);
+    addRegImm8(jit, HOST_RSP, 8);
+    pop(jit, HOST_R15);
+    pop(jit, HOST_R14);
+    pop(jit, HOST_R13);
+    pop(jit, HOST_R12);
+    pop(jit, HOST_RBX);
+    pop(jit, HOST_RBP);
+    emit8(jit, 0xC3);
+
+    jit->trampolineSize = jit->used;
+    vm->cold->jit = jit;
+    return jit;
+}
+
+void runJit(VM* vm) {
+    Jit* jit = vm->cold->jit != NULL ? vm->cold->jit : newJit(vm);
+    const bool metered = vm->cold->metrics != NULL;
+    if (jit != NULL && jit->metered != metered) {
+        jit->metered      = metered;
+        jit->flushPending = true;
+    }
+    while (vm->statusCondition == STAT_AOK) {
+        if (jit == NULL) {
+            runBasicBlock(vm);
+            continue;
+        }
+        if (jit->flushPending) {
+            flushJit(vm, jit);
+        }
+        JitBlock* block = findBlock(jit, vm->pc, true);
+        if (block->code == NULL && !block->failed && ++block->hits >= JIT_HOT_THRESHOLD) {
+            translate(vm, jit, block);
+        }
+        if (block->code != NULL) {
+            syncConditionCodes(vm);
+            jit->retired = 0;
+            jit->enter(vm, block->code);
+            if (metered) {
+                retireBlock(vm, jit->retired);
+            }
+            if (jit->faulted) {
+                jit->faulted = false;
+                runBasicBlock(vm);
+            }
+        } else {
+            runBasicBlock(vm);
+        }
+    }
+}
+
+void jitInvalidate(VM* vm, vm_quad_t offset, vm_quad_t length) {
+    Jit* jit = vm->cold->jit;
+    Page* page = NULL;
+    for (vm_quad_t byte = offset; byte < offset + length; ++byte) {
+        if (page == NULL || (byte & PAGE_MASK) == 0) {
+            page = findPage(&vm->memory, byte >> PAGE_BITS, false);
+        }
+        if (page != NULL && page->translated != NULL && (page->translated[(byte & PAGE_MASK) / 8] & (1 << (byte % 8)))) {
+            jit->flushPending = true;
+            return;
+        }
+    }
+}
+
+/* Keeps the executable buffer, the blocks are discarded before the next run */
+void resetJit(VM* vm) {
+    if (vm->cold->jit != NULL) {
+        vm->cold->jit->flushPending = true;
+    }
+}
+
+void freeJit(VM* vm) {
+    Jit* jit = vm->cold->jit;
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, JIT_CODE_SIZE);
+    FREE_ARRAY(JitBlock, jit->blocks, jit->blockCapacity);
+    FREE_ARRAY(JitExit, jit->exits, jit->exitCapacity);
+    FREE_ARRAY(Jit, jit, 1);
+    vm->cold->jit = NULL;
+}
+
+#else
+
+void runJit(VM* vm) {
+    while (vm->statusCondition == STAT_AOK) {
+        runBasicBlock(vm);
+    }
+}
+
+void jitInvalidate(VM* vm, vm_quad_t offset, vm_quad_t length) {
+}
+
+void resetJit(VM* vm) {
+}
+
+void freeJit(VM* vm) {
+}
+
+#endif
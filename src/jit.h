@@ -0,0 +1,29 @@
+#ifndef cero_jit_h
+#define cero_jit_h
+
+#include "common.h"
+#include "vm.h"
+
+/* Number of times a block is interpreted before it is translated */
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD (8)
+#endif
+
+/* Size of the executable buffer holding the translated blocks */
+#ifndef JIT_CODE_SIZE
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#endif
+
+/* Most instructions translated into a single block */
+#define JIT_MAX_BLOCK_LENGTH (64)
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+void runJit(VM* vm);
+void jitInvalidate(VM* vm, vm_quad_t offset, vm_quad_t length);
+void resetJit(VM* vm);
+void freeJit(VM* vm);
+
+#endif
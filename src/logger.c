@@ -0,0 +1,321 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "logger.h"
+
+void loggerPrefix(char* prefix, const struct tm* tm, LoggerLevel level, const char* fileName, unsigned lineNumber) {
+    snprintf(prefix, LOGGER_PREFIX_MAX,
+        ANSI_COLOR_BRIGHT_BLACK"%02i:%02i:%02i"ANSI_COLOR_RESET
+        " "
+        "%s%-5s"ANSI_COLOR_RESET
+        " "
+        ANSI_COLOR_BRIGHT_BLACK"%10s:%03u:"ANSI_COLOR_RESET,
+        tm->tm_hour, tm->tm_min, tm->tm_sec,
+        loggerLevelAnsiColorStrings[level], loggerLevelStrings[level] + 4,
+        fileName, lineNumber);
+}
+
+static FILE* stream = NULL;
+
+FILE* loggerStream(void) {
+    return stream != NULL ? stream : stdout;
+}
+
+void loggerUseStream(FILE* output) {
+    stream = output;
+}
+
+#ifdef LOGGER_SYNC
+
+void loggerLog(LoggerLevel level, const char* fileName, unsigned lineNumber, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    CERO_LEVEL_LOG(level, fileName, lineNumber);
+    vfprintf(loggerStream(), format, args);
+    va_end(args);
+}
+
+void loggerPrint(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(loggerStream(), format, args);
+    va_end(args);
+}
+
+void loggerFlush(void) {
+    fflush(loggerStream());
+}
+
+#else
+
+/* -----Asynchronous logger-----
+ * The queue is a bounded multi-producer single-consumer ring (after Dmitry
+ * Vyukov's bounded queue). Every slot has a sequence number telling whose turn
+ * it is: a producer may claim the slot of position p once its sequence is p,
+ * and publishes it by setting it to p + 1, which is what the consumer waits
+ * for. The consumer hands the slot back for the next round with p + SIZE.
+ * Producers only contend on the head counter, never on a lock.
+ *
+ * A CERO_* call with a level is the start of a line, CERO_PRINT calls continue
+ * the line last started by the thread (the printer builds lines piece by
+ * piece). Continuations share the fate of their line: dropped with it, or
+ * waiting for room like it did.
+ *
+ * The background thread starts with the first line and is stopped at exit,
+ * after writing out everything still queued. It formats the prefix of the lines
+ * with a clock refreshed once per second and writes through its own buffer.
+ * The messages themselves are formatted by the calling thread: the arguments
+ * of a va_list can not be copied without knowing their types, and the strings
+ * they point to may be gone by the time the background thread gets to them.
+ *
+ * The consumer writes out and flushes its buffer after every batch of at most
+ * LOGGER_QUEUE_SIZE lines, then publishes the position it reached in written.
+ * loggerFlush waits on that for the head it saw, which the consumer reaches
+ * once the producers of the lines before it published them.
+ *
+ * With nothing to read the consumer sleeps until woken. It raises sleeping
+ * before looking at the slot it waits for a last time, a producer looks at
+ * sleeping after publishing, so one of the two sees the other and only lines
+ * published to a sleeping consumer pay for the signal.
+ */
+
+#define LOGGER_QUEUE_MASK ((size_t)LOGGER_QUEUE_SIZE - 1)
+#define LOGGER_BUFFER_SIZE (1 << 16)
+
+typedef struct {
+    _Atomic size_t sequence;
+    LoggerLevel level;
+    bool continuation;             /* CERO_PRINT, written without a prefix */
+    const char* fileName;
+    unsigned lineNumber;
+    char message[LOGGER_MESSAGE_MAX];
+} LoggerSlot;
+
+static LoggerSlot slots[LOGGER_QUEUE_SIZE];
+static _Atomic size_t head;        /* Next position claimed by a producer    */
+static size_t tail;                /* Next position read, owned by consumer  */
+static _Atomic size_t written;     /* Positions written out and flushed      */
+static _Atomic uint64_t dropped;   /* Lines dropped since the last report    */
+static _Atomic bool running;       /* Whether lines go through the queue     */
+static _Atomic bool stopping;      /* Tells the background thread to end     */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_t consumer;
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle      = PTHREAD_COND_INITIALIZER; /* Signaled when the consumer has to wake */
+static _Atomic bool sleeping;      /* Whether the consumer waits on idle     */
+static pthread_mutex_t writtenLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writtenMoved = PTHREAD_COND_INITIALIZER; /* Broadcast whenever written moves */
+
+static _Thread_local bool lineDropped;
+static _Thread_local LoggerLevel lineLevel;
+
+typedef struct {
+    char data[LOGGER_BUFFER_SIZE];
+    size_t length;
+    time_t second;                 /* The second tm was computed for */
+    struct tm tm;
+} LoggerBuffer;
+
+static void flushBuffer(LoggerBuffer* buffer) {
+    fwrite(buffer->data, 1, buffer->length, loggerStream());
+    fflush(loggerStream());
+    buffer->length = 0;
+}
+
+static void append(LoggerBuffer* buffer, const char* text) {
+    size_t length = strlen(text);
+    if (buffer->length + length > LOGGER_BUFFER_SIZE) {
+        flushBuffer(buffer);
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+static void appendLine(LoggerBuffer* buffer, LoggerLevel level, const char* fileName, unsigned lineNumber, const char* message) {
+    char prefix[LOGGER_PREFIX_MAX];
+    loggerPrefix(prefix, &buffer->tm, level, fileName, lineNumber);
+    append(buffer, prefix);
+    append(buffer, message);
+}
+
+static void* consume(void* argument) {
+    static LoggerBuffer buffer;
+    buffer.length = 0;
+    buffer.second = -1;
+    while (true) {
+        bool stop = atomic_load_explicit(&stopping, memory_order_acquire);
+        time_t now = time(NULL);
+        if (now != buffer.second) {
+            buffer.second = now;
+            localtime_r(&now, &buffer.tm);
+        }
+        size_t count = 0;
+        while (count < LOGGER_QUEUE_SIZE) {
+            LoggerSlot* slot = &slots[tail & LOGGER_QUEUE_MASK];
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + 1) {
+                break;
+            }
+            if (slot->continuation) {
+                append(&buffer, slot->message);
+            } else {
+                appendLine(&buffer, slot->level, slot->fileName, slot->lineNumber, slot->message);
+            }
+            atomic_store_explicit(&slot->sequence, tail + LOGGER_QUEUE_SIZE, memory_order_release);
+            tail++;
+            count++;
+        }
+        uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+        if (lost != 0) {
+            char message[LOGGER_MESSAGE_MAX];
+            snprintf(message, sizeof(message), " logger::dropped %" PRIu64 " lines\n", lost);
+            appendLine(&buffer, LOG_WARN, __FILE__, __LINE__, message);
+        }
+        /* Writes out the batch, even an empty one moves written on */
+        if (buffer.length != 0) {
+            flushBuffer(&buffer);
+        }
+        if (atomic_load_explicit(&written, memory_order_relaxed) != tail) {
+            pthread_mutex_lock(&writtenLock);
+            atomic_store_explicit(&written, tail, memory_order_release);
+            pthread_cond_broadcast(&writtenMoved);
+            pthread_mutex_unlock(&writtenLock);
+        }
+        if (count != 0 || lost != 0) {
+            continue;
+        }
+        if (stop) {
+            break;
+        }
+        /* Sleeps until the next line is published or the logger stops */
+        pthread_mutex_lock(&idleLock);
+        atomic_store(&sleeping, true);
+        if (atomic_load(&slots[tail & LOGGER_QUEUE_MASK].sequence) != tail + 1 && !atomic_load(&stopping)) {
+            pthread_cond_wait(&idle, &idleLock);
+        }
+        atomic_store_explicit(&sleeping, false, memory_order_relaxed);
+        pthread_mutex_unlock(&idleLock);
+    }
+    flushBuffer(&buffer);
+    return NULL;
+}
+
+static void wakeConsumer(void) {
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_signal(&idle);
+    pthread_mutex_unlock(&idleLock);
+}
+
+static void stopLogger(void) {
+    atomic_store_explicit(&stopping, true, memory_order_release);
+    wakeConsumer();
+    pthread_join(consumer, NULL);
+    atomic_store_explicit(&running, false, memory_order_release);
+}
+
+static void startLogger(void) {
+    for (size_t i = 0; i < LOGGER_QUEUE_SIZE; ++i) {
+        atomic_init(&slots[i].sequence, i);
+    }
+    if (pthread_create(&consumer, NULL, consume, NULL) != 0) {
+        return;
+    }
+    atexit(stopLogger);
+    atomic_store_explicit(&running, true, memory_order_release);
+}
+
+/* Claims the next slot, NULL if the queue is full and the line may be dropped */
+static LoggerSlot* claim(bool mayDrop) {
+    size_t position = atomic_load_explicit(&head, memory_order_relaxed);
+    while (true) {
+        LoggerSlot* slot = &slots[position & LOGGER_QUEUE_MASK];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                return slot;
+            }
+        } else if (difference < 0) {
+            if (mayDrop) {
+                return NULL;
+            }
+            sched_yield();
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        } else {
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+}
+
+static void publish(LoggerSlot* slot) {
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed)) {
+        wakeConsumer();
+    }
+}
+
+void loggerLog(LoggerLevel level, const char* fileName, unsigned lineNumber, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_once(&once, startLogger);
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        time_t t = time(NULL);
+        char prefix[LOGGER_PREFIX_MAX];
+        loggerPrefix(prefix, localtime(&t), level, fileName, lineNumber);
+        fputs(prefix, loggerStream());
+        vfprintf(loggerStream(), format, args);
+        va_end(args);
+        return;
+    }
+    LoggerSlot* slot = claim(level < LOGGER_DROP_BELOW);
+    lineLevel   = level;
+    lineDropped = slot == NULL;
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    } else {
+        slot->level        = level;
+        slot->continuation = false;
+        slot->fileName     = fileName;
+        slot->lineNumber   = lineNumber;
+        vsnprintf(slot->message, LOGGER_MESSAGE_MAX, format, args);
+        publish(slot);
+    }
+    va_end(args);
+}
+
+void loggerPrint(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_once(&once, startLogger);
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        vfprintf(loggerStream(), format, args);
+    } else if (!lineDropped) {
+        LoggerSlot* slot = claim(false);
+        slot->level        = lineLevel;
+        slot->continuation = true;
+        vsnprintf(slot->message, LOGGER_MESSAGE_MAX, format, args);
+        publish(slot);
+    }
+    va_end(args);
+}
+
+/* Waits until every line queued so far is written out */
+void loggerFlush(void) {
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        fflush(loggerStream());
+        return;
+    }
+    size_t target = atomic_load_explicit(&head, memory_order_acquire);
+    if (atomic_load_explicit(&written, memory_order_acquire) >= target) {
+        return;
+    }
+    pthread_mutex_lock(&writtenLock);
+    while (atomic_load_explicit(&written, memory_order_acquire) < target) {
+        pthread_cond_wait(&writtenMoved, &writtenLock);
+    }
+    pthread_mutex_unlock(&writtenLock);
+}
+
+#endif
@@ -60,32 +60,108 @@ static const char* loggerLevelAnsiColorStrings[6] = {
 #define LOGGER_LOG_TIME
 #define LOGGER_LOG_FILE
 
-#define CERO_PRINT(...) (printf(__VA_ARGS__))
+/* Size in bytes of the prefix of a log line, colours included */
+#define LOGGER_PREFIX_MAX (96)
+
+/* LOGGER_SYNC: Every CERO_* call formats and prints its line on the calling
+ *              thread, as it happens. Useful when the process may crash before
+ *              the background thread wrote the last lines.
+ * Otherwise:   CERO_* calls format their arguments into a slot of a bounded
+ *              queue and return, a background thread adds the prefix and
+ *              writes the lines out in large chunks, see logger.c */
+#ifdef LOGGER_SYNC
+#define CERO_PRINT(...) (fprintf(loggerStream(), __VA_ARGS__))
 #define CERO_LEVEL_LOG(level, fileName, lineNumber)                           \
     do {                                                                      \
         time_t t = time(NULL);                                                \
-        struct tm* tm = localtime(&t);                                        \
-        CERO_PRINT(ANSI_COLOR_BRIGHT_BLACK"%02i:%02i:%02i"ANSI_COLOR_RESET    \
-                   " "                                                        \
-                   "%s%-5s"ANSI_COLOR_RESET                                   \
-                   " "                                                        \
-                   ANSI_COLOR_BRIGHT_BLACK"%10s:%03u:"ANSI_COLOR_RESET,       \
-            tm->tm_hour, tm->tm_min, tm->tm_sec,                              \
-            loggerLevelAnsiColorStrings[level], loggerLevelStrings[level] + 4,\
-            fileName, lineNumber);                                            \
+        char prefix[LOGGER_PREFIX_MAX];                                       \
+        loggerPrefix(prefix, localtime(&t), level, fileName, lineNumber);     \
+        CERO_PRINT("%s", prefix);                                             \
     } while (false)
 
 #define CERO_LOG(level, fileName, lineNumber, ...)  \
     do {                                            \
         CERO_LEVEL_LOG(level, fileName, lineNumber);\
-        printf(" "__VA_ARGS__);                     \
+        fprintf(loggerStream(), " "__VA_ARGS__);    \
     } while (false)
+#else
+#define CERO_PRINT(...) loggerPrint(__VA_ARGS__)
+#define CERO_LOG(level, fileName, lineNumber, ...) loggerLog(level, fileName, lineNumber, " "__VA_ARGS__)
+#endif
+
+/* Number of lines the queue holds, a power of two */
+#ifndef LOGGER_QUEUE_SIZE
+#define LOGGER_QUEUE_SIZE (4096)
+#endif
+
+/* Longest message of a single CERO_* call, longer ones are truncated */
+#ifndef LOGGER_MESSAGE_MAX
+#define LOGGER_MESSAGE_MAX (240)
+#endif
+
+void loggerPrefix(char* prefix, const struct tm* tm, LoggerLevel level, const char* fileName, unsigned lineNumber);
+void loggerLog(LoggerLevel level, const char* fileName, unsigned lineNumber, const char* format, ...);
+void loggerPrint(const char* format, ...);
+void loggerFlush(void);
+/* Where the lines go, stdout unless loggerUseStream is called before the first one */
+FILE* loggerStream(void);
+void loggerUseStream(FILE* stream);
 
+/* The least severe level compiled in, as the index of its LoggerLevel since the
+ * preprocessor can not compare enumerators. Logs below it compile to nothing,
+ * arguments included. Tracing builds keep everything, other builds start at
+ * LOG_INFO */
+#ifndef LOGGER_MIN_LEVEL
+#ifdef DEBUG_TRACE_EXECUTION
+#define LOGGER_MIN_LEVEL (0)
+#else
+#define LOGGER_MIN_LEVEL (2)
+#endif
+#endif
+
+/* When the queue is full, lines below this level are dropped (and counted)
+ * rather than waiting for the background thread. Builds compiling in every
+ * level want every line, the others only drop INFO */
+#ifndef LOGGER_DROP_BELOW
+#if LOGGER_MIN_LEVEL == 0
+#define LOGGER_DROP_BELOW (0)
+#else
+#define LOGGER_DROP_BELOW (3)
+#endif
+#endif
+
+#define CERO_DISCARD(...) ((void)0)
+
+#if LOGGER_MIN_LEVEL <= 0
 #define CERO_TRACE(...) CERO_LOG(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define CERO_TRACE(...) CERO_DISCARD(__VA_ARGS__)
+#endif
+#if LOGGER_MIN_LEVEL <= 1
 #define CERO_DEBUG(...) CERO_LOG(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define CERO_DEBUG(...) CERO_DISCARD(__VA_ARGS__)
+#endif
+#if LOGGER_MIN_LEVEL <= 2
 #define CERO_INFO(...)  CERO_LOG(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define CERO_INFO(...)  CERO_DISCARD(__VA_ARGS__)
+#endif
+#if LOGGER_MIN_LEVEL <= 3
 #define CERO_WARN(...)  CERO_LOG(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define CERO_WARN(...)  CERO_DISCARD(__VA_ARGS__)
+#endif
+#if LOGGER_MIN_LEVEL <= 4
 #define CERO_ERROR(...) CERO_LOG(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define CERO_FATAL(...) CERO_LOG(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#define CERO_ERROR(...) CERO_DISCARD(__VA_ARGS__)
+#endif
+/* Fatal lines are written out before the call returns, the caller is about to bail */
+#define CERO_FATAL(...)                                          \
+    do {                                                         \
+        CERO_LOG(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__);    \
+        loggerFlush();                                           \
+    } while (false)
 
 #endif
\ No newline at end of file
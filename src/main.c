@@ -5,21 +5,166 @@
 #include "writer.h"
 #include "common.h"
 #include "vm.h"
+#include "printer.h"
+#include "aot.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "object.h"
+#include "assembler.h"
+#include "profile.h"
+#include "counters.h"
+#include "metrics.h"
 
+/* Runs what the arguments ask for on the VM, the exit status of the process */
+static int runVM(VM* vm, int argc, const char* argv[]) {
+    const char* aotName        = NULL;
+    const char* checkpointName = NULL;
+    const char* restoreName    = NULL;
+    const char* objectName     = NULL;
+    const char* saveObjectName = NULL;
+    const char* profileName    = NULL;
+    bool counters              = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--engine=", 9) == 0 && !engineFromName(argv[i] + 9, &vm->cold->engine)) {
+            CERO_FATAL("Unknown engine '%s'\n", argv[i] + 9);
+            return 1;
+        }
+        if (strncmp(argv[i], "--aot=", 6) == 0) {
+            aotName = argv[i] + 6;
+        }
+        /* Saves the state the run ended in, and continues from such a state past its halt instead of the built-in program */
+        if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            checkpointName = argv[i] + 13;
+        }
+        if (strncmp(argv[i], "--restore=", 10) == 0) {
+            restoreName = argv[i] + 10;
+        }
+        /* Runs an object file or a .ys source instead of the built-in program, which --save-object writes out as one */
+        if (strncmp(argv[i], "--", 2) != 0) {
+            objectName = argv[i];
+        }
+        if (strncmp(argv[i], "--save-object=", 14) == 0) {
+            saveObjectName = argv[i] + 14;
+        }
+        /* Binary traces for build/tracedump, of every instruction or of the last ones before a fault */
+        if (strncmp(argv[i], "--trace=", 8) == 0 && !startTrace(vm, argv[i] + 8, TRACE_STREAM)) {
+            return 1;
+        }
+        if (strncmp(argv[i], "--trace-fault=", 14) == 0 && !startTrace(vm, argv[i] + 14, TRACE_FAULT)) {
+            return 1;
+        }
+        /* Counts what the program executed, printed at exit along with FILE holding its folded call stacks */
+        if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profileName = argv[i] + 10;
+        }
+        /* Samples host cycles, instructions, branch and cache misses per handler of the THREADED or SWITCH dispatch, printed at exit */
+        if (strcmp(argv[i], "--counters") == 0) {
+            counters = true;
+        }
+        /* Publishes instructions retired, PC, pages and run outcomes for build/vmtop from the engine running, printed at exit */
+        if (strcmp(argv[i], "--metrics") == 0 && !startMetrics(vm)) {
+            return 1;
+        }
+        /* Decodes every instruction on its own instead of fusing superinstructions */
+        if (strcmp(argv[i], "--no-fusion") == 0) {
+            vm->cold->fusion = false;
+        }
+#ifdef DEBUG_TRACE_EXECUTION
+        /* Dumps the whole state every N steps instead of only what changed */
+        if (strncmp(argv[i], "--full-dump=", 12) == 0) {
+            vm->cold->fullDumpEvery = strtoull(argv[i] + 12, NULL, 10);
+        }
+#endif
+    }
+    Writer builtin;
+    initWriter(&builtin, NULL, 0, 0);
+    WriterLabel skip = newLabel(&builtin);
+
+    irmovqWrite(&builtin, REG_R10, 0);
+    irmovqWrite(&builtin, REG_R11, 0);
+    addqWrite(&builtin, REG_R10, REG_R11);
+    jneLabelWrite(&builtin, skip); // Skips nop if true
+    nopWrite(&builtin);
+    bindLabel(&builtin, skip);
+    haltWrite(&builtin);
+    resolveLabels(&builtin);
+
+    /* The built-in program, or the .ys source given instead */
+    Writer* program = &builtin;
+    Assembler assembler;
+    initAssembler(&assembler);
+    if (objectName != NULL && strlen(objectName) > 3 && strcmp(objectName + strlen(objectName) - 3, ".ys") == 0) {
+        if (!assembleFile(&assembler, objectName)) {
+            CERO_FATAL("Unable to assemble '%s'\n", objectName);
+            return 1;
+        }
+        program = &assembler.writer;
+    }
+    if (saveObjectName != NULL && !saveWriter(program, saveObjectName, 0, VM_STACK_TOP)) {
+        return 1;
+    }
+    if (restoreName != NULL) {
+        if (!loadCheckpoint(vm, restoreName)) {
+            CERO_FATAL("Unable to restore '%s'\n", restoreName);
+            return 1;
+        }
+        /* A run saved at a halt goes on with the instruction after it, one saved at a fault stays there */
+        if (vm->statusCondition == STAT_HLT) {
+            vm->statusCondition = STAT_AOK;
+        }
+    } else if (objectName != NULL && program == &builtin) {
+        if (!loadObject(vm, objectName)) {
+            CERO_FATAL("Unable to load '%s'\n", objectName);
+            return 1;
+        }
+    } else {
+        loadWriter(program, vm);
+    }
+    freeAssembler(&assembler);
+    freeWriter(&builtin);
+
+    /* Translates the image to NAME.c, compiles it to NAME.so and runs that */
+    if (aotName != NULL) {
+        if (!buildAot(vm, vm->pc, aotName)) {
+            CERO_FATAL("Unable to build the AOT translation '%s'\n", aotName);
+            return 1;
+        }
+        vm->cold->engine = ENGINE_AOT;
+    }
+
+    if (profileName != NULL) {
+        startProfile(vm);
+    }
+    if (counters && !startCounters(vm)) {
+        return 1;
+    }
+    run(vm);
+    if (counters) {
+        printCounters(vm);
+    }
+    if (vm->cold->metrics != NULL) {
+        printMetrics(vm);
+    }
+    if (profileName != NULL) {
+        printProfile(vm);
+        if (!writeFoldedStacks(vm, profileName)) {
+            return 1;
+        }
+    }
+    if (checkpointName != NULL && !saveCheckpoint(vm, checkpointName)) {
+        return 1;
+    }
+#ifdef VM_FUSION_STATS
+    printFusionReport(vm);
+#endif
+    return 0;
+}
+
+/* Every exit goes through freeVM, which unlinks the metrics segment */
 int main(int argc, const char* argv[]) {
     VM vm;
     initVM(&vm);
-    Writer writer;
-    initWriter(&writer, vm.memory, 0);
-
-    irmovqWrite(&writer, REG_R10, 0);
-    irmovqWrite(&writer, REG_R11, 0);
-    addqWrite(&writer, REG_R10, REG_R11);
-    jneWrite(&writer, writer.offset + 1); // Skips nop if true
-    nopWrite(&writer);
-    haltWrite(&writer);
-
-    run(&vm);
+    int status = runVM(&vm, argc, argv);
     freeVM(&vm);
-    return 0;
+    return status;
 }
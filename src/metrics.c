@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+
+/* -----Live metrics-----
+ * The VMs of a process publishing metrics share the segment METRICS_PREFIX
+ * followed by the pid, created by the first startMetrics and unlinked by the
+ * last stopMetrics. Each VM claims one of its slots. The mapping reserves
+ * METRICS_MAX_SLOTS of them up front and the segment grows underneath it, so
+ * the slots claimed never move.
+ *
+ * Every engine keeps running as selected and hands the guest instructions it
+ * retires to retireBlock at its block boundaries: the end of a basic block for
+ * SWITCH and THREADED, and back in the loop of runJit or runAot for translated
+ * code, which leaves to it every METRICS_SLICE instructions. Once METRICS_SLICE
+ * of them retired they are published with the PC and the pages in use with
+ * relaxed stores. The hot loop never touches the shared cache lines. run()
+ * publishes what is left at the end of the run, counting on a memory fault the
+ * instructions of the faulting block before it. build/vmtop samples the
+ * segments.
+ */
+
+static pthread_mutex_t segmentLock = PTHREAD_MUTEX_INITIALIZER;
+static MetricsSegment* segment     = NULL;
+static int segmentFd               = -1;
+static uint32_t segmentUsers       = 0;
+static char segmentName[32];
+
+static uint64_t monotonicNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Creates the segment of the process, called with segmentLock held */
+static bool openSegment(void) {
+    snprintf(segmentName, sizeof(segmentName), METRICS_PREFIX "%d", (int)getpid());
+    int fd = shm_open(segmentName, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd == -1) {
+        CERO_ERROR("metrics::start unable to create %s: %s\n", segmentName, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, METRICS_SEGMENT_SIZE(METRICS_SLOTS)) != 0) {
+        CERO_ERROR("metrics::start unable to size %s: %s\n", segmentName, strerror(errno));
+        close(fd);
+        shm_unlink(segmentName);
+        return false;
+    }
+    void* bytes = mmap(NULL, METRICS_SEGMENT_SIZE(METRICS_MAX_SLOTS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (bytes == MAP_FAILED) {
+        CERO_ERROR("metrics::start unable to map %s: %s\n", segmentName, strerror(errno));
+        close(fd);
+        shm_unlink(segmentName);
+        return false;
+    }
+    segment            = bytes;
+    segmentFd          = fd;
+    segment->version   = METRICS_VERSION;
+    segment->slotSize  = sizeof(MetricsSlot);
+    segment->pid       = (int32_t)getpid();
+    atomic_store_explicit(&segment->slotCount, METRICS_SLOTS, memory_order_relaxed);
+    /* Readers only look at a segment once its magic is there */
+    atomic_thread_fence(memory_order_release);
+    memcpy(segment->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+    return true;
+}
+
+/* Unmaps and unlinks the segment, called with segmentLock held */
+static void closeSegment(void) {
+    munmap(segment, METRICS_SEGMENT_SIZE(METRICS_MAX_SLOTS));
+    close(segmentFd);
+    shm_unlink(segmentName);
+    segment   = NULL;
+    segmentFd = -1;
+}
+
+/* Doubles the slots of the segment, the new ones are zeros. Called with
+ * segmentLock held */
+static bool growSegment(void) {
+    uint32_t slotCount = atomic_load_explicit(&segment->slotCount, memory_order_relaxed);
+    if (slotCount >= METRICS_MAX_SLOTS) {
+        CERO_ERROR("metrics::start all %d slots of %s are in use\n", METRICS_MAX_SLOTS, segmentName);
+        return false;
+    }
+    uint32_t grown = slotCount * 2 > METRICS_MAX_SLOTS ? METRICS_MAX_SLOTS : slotCount * 2;
+    if (ftruncate(segmentFd, METRICS_SEGMENT_SIZE(grown)) != 0) {
+        CERO_ERROR("metrics::start unable to grow %s: %s\n", segmentName, strerror(errno));
+        return false;
+    }
+    atomic_store_explicit(&segment->slotCount, grown, memory_order_release);
+    return true;
+}
+
+/* Claims a slot for the VM, opening the segment of the process if needed */
+bool startMetrics(VM* vm) {
+    stopMetrics(vm);
+    pthread_mutex_lock(&segmentLock);
+    if (segment == NULL && !openSegment()) {
+        pthread_mutex_unlock(&segmentLock);
+        return false;
+    }
+    MetricsSlot* slot  = NULL;
+    uint32_t slotCount = atomic_load_explicit(&segment->slotCount, memory_order_relaxed);
+    for (uint32_t i = 0; i < slotCount && slot == NULL; ++i) {
+        if (atomic_load_explicit(&segment->slots[i].live, memory_order_relaxed) == 0) {
+            slot = &segment->slots[i];
+        }
+    }
+    if (slot == NULL) {
+        if (!growSegment()) {
+            if (segmentUsers == 0) {
+                closeSegment();
+            }
+            pthread_mutex_unlock(&segmentLock);
+            return false;
+        }
+        slot = &segment->slots[slotCount];
+    }
+    segmentUsers++;
+    atomic_store_explicit(&slot->retired, 0, memory_order_relaxed);
+    for (int status = 0; status < METRICS_STATUS_COUNT; ++status) {
+        atomic_store_explicit(&slot->runs[status], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->runNanos, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->generation, 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->live, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&segmentLock);
+
+    vm->cold->metrics = slot;
+    beginMetrics(vm);
+    return true;
+}
+
+/* Frees the slot of the VM, unlinking the segment with the last one */
+void stopMetrics(VM* vm) {
+    MetricsSlot* slot = vm->cold->metrics;
+    if (slot == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&segmentLock);
+    atomic_store_explicit(&slot->live, 0, memory_order_relaxed);
+    if (--segmentUsers == 0) {
+        closeSegment();
+    }
+    pthread_mutex_unlock(&segmentLock);
+    vm->cold->metrics = NULL;
+}
+
+/* Publishes the state of the VM, the time until the next publication is
+ * counted as running */
+void beginMetrics(VM* vm) {
+    MetricsSlot* slot = vm->cold->metrics;
+    atomic_store_explicit(&slot->pc, vm->pc, memory_order_relaxed);
+    atomic_store_explicit(&slot->status, vm->statusCondition, memory_order_relaxed);
+    atomic_store_explicit(&slot->pages, vm->memory.pageCount, memory_order_relaxed);
+    atomic_store_explicit(&slot->published, monotonicNanos(), memory_order_relaxed);
+}
+
+/* Adds the instructions retired since the previous publication */
+void publishMetrics(VM* vm, uint64_t retired) {
+    MetricsSlot* slot = vm->cold->metrics;
+    uint64_t now      = monotonicNanos();
+    uint64_t previous = atomic_load_explicit(&slot->published, memory_order_relaxed);
+    atomic_store_explicit(&slot->retired, atomic_load_explicit(&slot->retired, memory_order_relaxed) + retired,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->runNanos, atomic_load_explicit(&slot->runNanos, memory_order_relaxed) + (now - previous),
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->pc, vm->pc, memory_order_relaxed);
+    atomic_store_explicit(&slot->status, vm->statusCondition, memory_order_relaxed);
+    atomic_store_explicit(&slot->pages, vm->memory.pageCount, memory_order_relaxed);
+    atomic_store_explicit(&slot->published, now, memory_order_relaxed);
+}
+
+/* Publishes the end of a run, counted by the StatusCondition it ended in */
+void endMetrics(VM* vm, uint64_t retired) {
+    MetricsSlot* slot = vm->cold->metrics;
+    publishMetrics(vm, retired);
+    if (vm->statusCondition < METRICS_STATUS_COUNT) {
+        atomic_store_explicit(&slot->runs[vm->statusCondition],
+                              atomic_load_explicit(&slot->runs[vm->statusCondition], memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+    }
+}
+
+/* Prints what the VM published so far */
+void printMetrics(VM* vm) {
+    MetricsSlot* slot = vm->cold->metrics;
+    if (slot == NULL) {
+        CERO_WARN("Start the metrics to print them\n");
+        return;
+    }
+    CERO_INFO("metrics::retired %" PRIu64 "\n", atomic_load_explicit(&slot->retired, memory_order_relaxed));
+    CERO_INFO("metrics::pc 0x%" PRIx64 "\n", (uint64_t)atomic_load_explicit(&slot->pc, memory_order_relaxed));
+    CERO_INFO("metrics::runs AOK %" PRIu64 " HLT %" PRIu64 " ADR %" PRIu64 " INS %" PRIu64 "\n",
+              atomic_load_explicit(&slot->runs[STAT_AOK], memory_order_relaxed),
+              atomic_load_explicit(&slot->runs[STAT_HLT], memory_order_relaxed),
+              atomic_load_explicit(&slot->runs[STAT_ADR], memory_order_relaxed),
+              atomic_load_explicit(&slot->runs[STAT_INS], memory_order_relaxed));
+}
@@ -0,0 +1,90 @@
+#ifndef cero_metrics_h
+#define cero_metrics_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "vm.h"
+
+/* Name of the POSIX shared memory segment of a process, followed by its pid */
+#define METRICS_PREFIX  "/cero-vm-"
+#define METRICS_MAGIC   "CEROMET"
+#define METRICS_VERSION (2)
+
+/* Slots of a segment when it is created. It doubles whenever they are all in
+ * use, up to METRICS_MAX_SLOTS VMs of a process publishing at the same time */
+#ifndef METRICS_SLOTS
+#define METRICS_SLOTS (64)
+#endif
+#ifndef METRICS_MAX_SLOTS
+#define METRICS_MAX_SLOTS (1 << 20)
+#endif
+
+/* Guest instructions retired between two publications, checked at the end of
+ * basic blocks (translated ones check it on entry) */
+#ifndef METRICS_SLICE
+#define METRICS_SLICE (1 << 20)
+#endif
+
+#define METRICS_STATUS_COUNT (STAT_INS + 1)
+
+/* What a VM publishes, written by the thread running it and read by anyone.
+ * Every field is a relaxed atomic, a reader may see a publication half done */
+typedef struct MetricsSlot {
+    _Alignas(VM_CACHE_LINE)
+    _Atomic uint32_t live;                             /* Whether a VM owns the slot                     */
+    _Atomic uint32_t status;                           /* Its StatusCondition                            */
+    _Atomic uint64_t generation;                       /* Incremented whenever a VM claims the slot      */
+    _Atomic uint64_t retired;                          /* Guest instructions retired                     */
+    _Atomic int64_t pc;                                /* PC at the last publication                     */
+    _Atomic uint64_t pages;                            /* Guest pages allocated                          */
+    _Atomic uint64_t runs[METRICS_STATUS_COUNT];       /* Runs ended in each StatusCondition             */
+    _Atomic uint64_t runNanos;                         /* Host time spent running the guest              */
+    _Atomic uint64_t published;                        /* CLOCK_MONOTONIC ns of the last publication     */
+} MetricsSlot;
+
+/* The layout of the segment, a reader has to check magic, version and slotSize.
+ * The segment is slotCount slots long, a reader maps the size it finds and only
+ * reads the slots within it */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotSize;
+    _Atomic uint32_t slotCount;  /* Slots following, grows while the segment is in use */
+    int32_t pid;
+    MetricsSlot slots[];
+} MetricsSegment;
+
+#define METRICS_SEGMENT_SIZE(slotCount) (sizeof(MetricsSegment) + (size_t)(slotCount) * sizeof(MetricsSlot))
+
+bool startMetrics(VM* vm);
+void stopMetrics(VM* vm);
+void beginMetrics(VM* vm);
+void publishMetrics(VM* vm, uint64_t retired);
+void endMetrics(VM* vm, uint64_t retired);
+void printMetrics(VM* vm);
+
+/* Called by the engines of a VM publishing metrics at every block boundary with
+ * the instructions retired since the previous one. They are kept in vm->cold,
+ * where the guard of a memory fault finds them, and published every
+ * METRICS_SLICE */
+static inline void retireBlock(VM* vm, uint64_t retired) {
+    VMCold* cold = vm->cold;
+    cold->retired   += retired;
+    cold->blockStart = vm->pc;
+    if (cold->retired >= METRICS_SLICE) {
+        publishMetrics(vm, cold->retired);
+        cold->retired = 0;
+    }
+}
+
+/* Takes back instructions the engine counted for a handler before running it,
+ * which then stopped short of them. The engine retires its block right after,
+ * so the count never stays below what was retired */
+static inline void unretire(VM* vm, uint64_t retired) {
+    if (vm->cold->metrics != NULL) {
+        vm->cold->retired -= retired;
+    }
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "object.h"
+#include "memory.h"
+
+/* -----Object files-----
+ * writeObject lays the sections out after the section table, each starting on
+ * a PAGE_SIZE boundary of the file. loadObject maps the file and maps the whole
+ * pages of the sections straight into guest memory as regions (see mapRegion),
+ * only the last partial page of a section is copied. Loading therefore only
+ * reads the header and the section table whatever the size of the sections,
+ * guest pages are mapped and host pages faulted in as the program touches
+ * them. The pages are copied into frames of their own on their first write,
+ * which keeps the file itself untouched.
+ */
+
+#define GENERATE_SECTION_STRING(NAME) #NAME,
+
+static const char* sectionNames[] = {
+    FOREACH_SECTION(GENERATE_SECTION_STRING)
+};
+
+#undef GENERATE_SECTION_STRING
+
+const char* sectionName(SectionType type) {
+    return type < SECTION_COUNT ? sectionNames[type] : "UNKNOWN";
+}
+
+static const vm_ubyte_t zeros[PAGE_SIZE];
+
+static bool loaded(uint32_t type) {
+    return type == SECTION_CODE || type == SECTION_DATA;
+}
+
+static vm_quad_t pageAlign(vm_quad_t offset) {
+    return (offset + PAGE_MASK) & ~PAGE_MASK;
+}
+
+bool writeObject(const char* path, vm_quad_t entry, vm_quad_t stack, const ObjectSectionData* sections, uint32_t count) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        CERO_ERROR("object::write unable to write %s\n", path);
+        return false;
+    }
+    ObjectHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    header.version      = OBJECT_VERSION;
+    header.sectionCount = count;
+    header.entry        = entry;
+    header.stack        = stack;
+    header.bigEndian    = VM_MEMORY_BIG_ENDIAN;
+    fwrite(&header, sizeof(header), 1, file);
+
+    vm_quad_t offset = pageAlign(sizeof(ObjectHeader) + count * sizeof(ObjectSection));
+    for (uint32_t i = 0; i < count; ++i) {
+        ObjectSection section;
+        memset(&section, 0, sizeof(section));
+        section.type    = sections[i].type;
+        section.address = sections[i].address;
+        section.size    = sections[i].size;
+        if (loaded(section.type)) {
+            section.offset = offset;
+            offset = pageAlign(offset + section.size);
+        }
+        fwrite(&section, sizeof(section), 1, file);
+    }
+    vm_quad_t position = sizeof(ObjectHeader) + count * sizeof(ObjectSection);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!loaded(sections[i].type)) {
+            continue;
+        }
+        fwrite(zeros, 1, pageAlign(position) - position, file);
+        fwrite(sections[i].bytes, 1, sections[i].size, file);
+        position = pageAlign(position) + sections[i].size;
+    }
+    bool written = !ferror(file);
+    written &= fclose(file) == 0;
+    if (!written) {
+        CERO_ERROR("object::write unable to write %s\n", path);
+    }
+    return written;
+}
+
+static bool inSpace(vm_quad_t address, vm_quad_t size) {
+    return address >= 0 && size >= 0 && address <= VM_ADDRESS_LIMIT && size <= VM_ADDRESS_LIMIT - address;
+}
+
+static bool validObject(const vm_ubyte_t* bytes, size_t size) {
+    const ObjectHeader* header = (const ObjectHeader*)bytes;
+    if (size < sizeof(ObjectHeader) || memcmp(header->magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) != 0 ||
+        header->version != OBJECT_VERSION || header->bigEndian != VM_MEMORY_BIG_ENDIAN ||
+        header->sectionCount > (size - sizeof(ObjectHeader)) / sizeof(ObjectSection)) {
+        return false;
+    }
+    const ObjectSection* sections = (const ObjectSection*)(header + 1);
+    for (uint32_t i = 0; i < header->sectionCount; ++i) {
+        const ObjectSection* section = &sections[i];
+        if (section->type >= SECTION_COUNT || !inSpace(section->address, section->size)) {
+            return false;
+        }
+        if (loaded(section->type) &&
+            ((section->address & PAGE_MASK) != 0 || (section->offset & PAGE_MASK) != 0 || section->offset < 0 ||
+             (uint64_t)section->offset > size || (uint64_t)section->size > size - section->offset)) {
+            return false;
+        }
+        for (uint32_t j = 0; j < i; ++j) {
+            if (section->address < sections[j].address + sections[j].size &&
+                sections[j].address < section->address + section->size) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Replaces the memory, registers and status of the VM with the program of the
+ * object file, ready to run from its entry. Its engine and trace are kept */
+bool loadObject(VM* vm, const char* path) {
+    MappedFile* file = mapFile(path);
+    if (file == NULL) {
+        return false;
+    }
+    if (!validObject(file->bytes, file->size)) {
+        CERO_ERROR("object::load %s is not an object file of this VM\n", path);
+        unmapFile(file);
+        return false;
+    }
+    resetMemory(vm);
+    adoptFile(&vm->memory, file);
+
+    const ObjectHeader* header    = (const ObjectHeader*)file->bytes;
+    const ObjectSection* sections = (const ObjectSection*)(header + 1);
+    for (uint32_t i = 0; i < header->sectionCount; ++i) {
+        const ObjectSection* section = &sections[i];
+        if (!loaded(section->type)) {
+            continue;
+        }
+        const vm_ubyte_t* bytes = file->bytes + section->offset;
+        vm_quad_t whole         = section->size & ~PAGE_MASK;
+        mapRegion(&vm->memory, section->address >> PAGE_BITS, whole >> PAGE_BITS, bytes);
+        copyToMemory(vm, section->address + whole, bytes + whole, section->size - whole);
+    }
+    memset(vm->registers, 0, sizeof(vm->registers));
+    vm->registers[REG_RBP] = header->stack;
+    vm->registers[REG_RSP] = header->stack;
+    vm->pc                 = header->entry;
+    vm->statusCondition    = STAT_AOK;
+    vm->conditionCodes     = 0;
+    vm->flags              = FLAGS_EAGER;
+    CERO_DEBUG("object::load %s, %u sections, entry 0x%" PRIx64 "\n", path, header->sectionCount, header->entry);
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef cero_object_h
+#define cero_object_h
+
+#include "common.h"
+#include "vm.h"
+
+#define OBJECT_MAGIC   "CEROOBJ"
+#define OBJECT_VERSION (1)
+
+/* CODE and DATA sections are loaded from the file, BSS sections only reserve
+ * zeros which every page that is not loaded reads anyway */
+#define FOREACH_SECTION(wrapper)\
+        wrapper(CODE)\
+        wrapper(DATA)\
+        wrapper(BSS)\
+
+#define GENERATE_SECTION_ENUM(NAME) SECTION_##NAME,
+
+typedef enum {
+    FOREACH_SECTION(GENERATE_SECTION_ENUM)
+    SECTION_COUNT
+} SectionType;
+
+#undef GENERATE_SECTION_ENUM
+
+/* An object file is the header, sectionCount ObjectSections and the bytes of
+ * the CODE and DATA sections. The address and the file offset of those are
+ * multiples of PAGE_SIZE, such that the loader maps their pages instead of
+ * copying them. Sections do not overlap. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    vm_quad_t entry;          /* PC of the first instruction              */
+    vm_quad_t stack;          /* RSP and RBP the program starts with      */
+    vm_ubyte_t bigEndian;     /* Whether the sections hold big-endian quads */
+    vm_ubyte_t padding[7];
+} ObjectHeader;
+
+typedef struct {
+    uint32_t type;            /* SectionType                              */
+    uint32_t padding;
+    vm_quad_t address;        /* Guest address of the first byte          */
+    vm_quad_t size;           /* Number of bytes                          */
+    vm_quad_t offset;         /* Offset of the bytes in the file, 0 for BSS */
+} ObjectSection;
+
+/* A section of an object file to write, bytes is NULL for BSS */
+typedef struct {
+    SectionType type;
+    vm_quad_t address;
+    vm_quad_t size;
+    const vm_ubyte_t* bytes;
+} ObjectSectionData;
+
+bool writeObject(const char* path, vm_quad_t entry, vm_quad_t stack, const ObjectSectionData* sections, uint32_t count);
+bool loadObject(VM* vm, const char* path);
+const char* sectionName(SectionType type);
+
+#endif
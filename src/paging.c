@@ -0,0 +1,483 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "paging.h"
+#include "memory.h"
+#include "vm.h"
+
+/* Read through the read TLB for pages that were never written */
+static const vm_ubyte_t zeroPage[PAGE_SIZE];
+
+#define LAST_LEVEL (PAGE_LEVELS - 1)
+
+/* Number of pages covered by an entry of a directory of the given level */
+static inline vm_quad_t levelSpan(int level) {
+    return (vm_quad_t)1 << (PAGE_LEVEL_BITS * (LAST_LEVEL - level));
+}
+
+static inline size_t levelIndex(vm_quad_t pageNumber, int level) {
+    return ((uint64_t)pageNumber >> (PAGE_LEVEL_BITS * (LAST_LEVEL - level))) & (PAGE_LEVEL_SIZE - 1);
+}
+
+void initAddressSpace(AddressSpace* space) {
+    space->root            = NULL;
+    space->pageCount       = 0;
+    space->written         = NULL;
+    space->writtenCount    = 0;
+    space->writtenCapacity = 0;
+    space->files           = NULL;
+    space->regions         = NULL;
+    flushTlb(space);
+}
+
+static Frame* newFrame(void) {
+    Frame* frame = INIT_ARRAY(Frame, NULL, 1);
+    atomic_init(&frame->references, 1);
+    return frame;
+}
+
+/* The last page releasing a frame frees it. Pages of address spaces used by
+ * different threads may share frames, hence the atomic count */
+static void releaseFrame(Frame* frame) {
+    if (frame != NULL && atomic_fetch_sub_explicit(&frame->references, 1, memory_order_acq_rel) == 1) {
+        if (frame->decoded != NULL) {
+            FREE_ARRAY(Instruction, frame->decoded, PAGE_SIZE);
+        }
+        FREE_ARRAY(Frame, frame, 1);
+    }
+}
+
+/* Pages without a frame read the zero page, unless mapPage mapped other bytes */
+static void setFrame(Page* page, Frame* frame) {
+    page->frame = frame;
+    page->bytes = frame != NULL ? frame->bytes : (vm_ubyte_t*)zeroPage;
+}
+
+/* Whether the page can be written to in place */
+static inline bool ownsFrame(const Page* page) {
+    return page->frame != NULL && atomic_load_explicit(&page->frame->references, memory_order_acquire) == 1;
+}
+
+/* -----Mapped files-----
+ * Checkpoints and object files are mapped rather than read, and their pages
+ * are mapped into the address space with mapPage. The address space then owns
+ * the file and unmaps it once no page can map it anymore: on the next reset,
+ * which gives every mapped page the zero page back, or when it is freed. */
+MappedFile* mapFile(const char* path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        CERO_ERROR("paging::mapFile unable to read %s\n", path);
+        return NULL;
+    }
+    struct stat status;
+    void* bytes = MAP_FAILED;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+        bytes = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+    close(descriptor);
+    if (bytes == MAP_FAILED) {
+        CERO_ERROR("paging::mapFile unable to map %s\n", path);
+        return NULL;
+    }
+    MappedFile* file = INIT_ARRAY(MappedFile, NULL, 1);
+    file->bytes = bytes;
+    file->size  = status.st_size;
+    file->next  = NULL;
+    return file;
+}
+
+void unmapFile(MappedFile* file) {
+    munmap((void*)file->bytes, file->size);
+    FREE_ARRAY(MappedFile, file, 1);
+}
+
+void adoptFile(AddressSpace* space, MappedFile* file) {
+    file->next   = space->files;
+    space->files = file;
+}
+
+static void unmapFiles(AddressSpace* space) {
+    while (space->regions != NULL) {
+        MappedRegion* next = space->regions->next;
+        FREE_ARRAY(MappedRegion, space->regions, 1);
+        space->regions = next;
+    }
+    while (space->files != NULL) {
+        MappedFile* next = space->files->next;
+        unmapFile(space->files);
+        space->files = next;
+    }
+}
+
+static void freePage(Page* page) {
+    releaseFrame(page->frame);
+    if (page->translated != NULL) {
+        FREE_ARRAY(vm_ubyte_t, page->translated, PAGE_BITMAP_SIZE);
+    }
+    FREE_ARRAY(Page, page, 1);
+}
+
+static void freeDirectory(void** directory, int level) {
+    for (size_t i = 0; i < PAGE_LEVEL_SIZE; ++i) {
+        if (directory[i] == NULL) {
+            continue;
+        }
+        if (level == LAST_LEVEL) {
+            freePage(directory[i]);
+        } else {
+            freeDirectory(directory[i], level + 1);
+        }
+    }
+    FREE_ARRAY(void*, directory, PAGE_LEVEL_SIZE);
+}
+
+void freeAddressSpace(AddressSpace* space) {
+    if (space->root != NULL) {
+        freeDirectory(space->root, 0);
+    }
+    FREE_ARRAY(Page*, space->written, space->writtenCapacity);
+    unmapFiles(space);
+    initAddressSpace(space);
+}
+
+static void addWritten(AddressSpace* space, Page* page) {
+    if (space->writtenCount == space->writtenCapacity) {
+        uint32_t oldCapacity   = space->writtenCapacity;
+        space->writtenCapacity = GROW_CAPACITY(oldCapacity);
+        space->written         = GROW_ARRAY(Page*, space->written, oldCapacity, space->writtenCapacity);
+    }
+    space->written[space->writtenCount++] = page;
+    page->written = true;
+}
+
+/* Clears the part of the decode cache filled since the last reset */
+static void clearDecoded(Frame* frame) {
+    if (frame->decodedEnd > frame->decodedFirst) {
+        memset(frame->decoded + frame->decodedFirst, 0, sizeof(Instruction) * (frame->decodedEnd - frame->decodedFirst));
+    }
+    frame->decodedFirst = 0;
+    frame->decodedEnd   = 0;
+}
+
+/* Forgets what the VM of the address space derived from the page */
+static void clearCode(Page* page) {
+    if (page->translated != NULL) {
+        memset(page->translated, 0, PAGE_BITMAP_SIZE);
+    }
+    page->code = false;
+}
+
+/* Zeroes the pages written since the last reset and the parts of their decode
+ * caches that were filled. The pages stay allocated for the next run, pages
+ * that were only read still hold zeros and are not touched. Shared frames are
+ * released rather than cleared, along with their decode caches. */
+void resetAddressSpace(AddressSpace* space) {
+    for (uint32_t i = 0; i < space->writtenCount; ++i) {
+        Page* page = space->written[i];
+        if (ownsFrame(page)) {
+            memset(page->bytes, 0, PAGE_SIZE);
+            clearDecoded(page->frame);
+        } else {
+            releaseFrame(page->frame);
+            setFrame(page, NULL);
+        }
+        clearCode(page);
+        page->written = false;
+    }
+    space->writtenCount = 0;
+    unmapFiles(space);
+    flushTlb(space);
+}
+
+void flushTlb(AddressSpace* space) {
+    for (size_t i = 0; i < TLB_SIZE; ++i) {
+        space->readTlb[i].tag  = TLB_EMPTY;
+        space->writeTlb[i].tag = TLB_EMPTY;
+    }
+}
+
+/* Drops the TLB entries of the page, for when its bytes moved or it must not
+ * be written in place anymore */
+void flushTlbPage(AddressSpace* space, vm_quad_t pageNumber) {
+    size_t index = pageNumber & (TLB_SIZE - 1);
+    if (space->readTlb[index].tag == pageNumber) {
+        space->readTlb[index].tag = TLB_EMPTY;
+    }
+    if (space->writeTlb[index].tag == pageNumber) {
+        space->writeTlb[index].tag = TLB_EMPTY;
+    }
+}
+
+/* Walks the directories down to the slot of the page, allocating the missing
+ * ones if asked to. NULL if one is missing otherwise */
+static Page** pageSlot(AddressSpace* space, vm_quad_t pageNumber, bool allocate) {
+    void** slot = (void**)&space->root;
+    for (int level = 0; level <= LAST_LEVEL; ++level) {
+        if (*slot == NULL) {
+            if (!allocate) {
+                return NULL;
+            }
+            *slot = INIT_ARRAY(void*, NULL, PAGE_LEVEL_SIZE);
+        }
+        slot = &((void**)*slot)[levelIndex(pageNumber, level)];
+    }
+    return (Page**)slot;
+}
+
+static const vm_ubyte_t* regionBytes(AddressSpace* space, vm_quad_t pageNumber) {
+    for (MappedRegion* region = space->regions; region != NULL; region = region->next) {
+        if (pageNumber >= region->firstPage && pageNumber - region->firstPage < region->pageCount) {
+            return region->bytes + (pageNumber - region->firstPage) * PAGE_SIZE;
+        }
+    }
+    return NULL;
+}
+
+/* Allocates the page if asked to, its frame is only allocated once it is
+ * written to. Pages of mapped regions are mapped whether asked to or not */
+Page* findPage(AddressSpace* space, vm_quad_t pageNumber, bool allocate) {
+    Page** slot = pageSlot(space, pageNumber, allocate);
+    if (slot != NULL && *slot != NULL) {
+        return *slot;
+    }
+    const vm_ubyte_t* mapped = space->regions != NULL ? regionBytes(space, pageNumber) : NULL;
+    if (mapped != NULL) {
+        mapPage(space, pageNumber, mapped);
+        return *pageSlot(space, pageNumber, false);
+    }
+    if (!allocate) {
+        return NULL;
+    }
+    Page* page = INIT_ARRAY(Page, NULL, 1);
+    setFrame(page, NULL);
+    *slot = page;
+    space->pageCount++;
+    return page;
+}
+
+static Page* nextIn(void** directory, int level, vm_quad_t base, vm_quad_t* pageNumber) {
+    vm_quad_t span = levelSpan(level);
+    size_t first   = *pageNumber > base ? (size_t)((*pageNumber - base) / span) : 0;
+    for (size_t i = first; i < PAGE_LEVEL_SIZE; ++i) {
+        if (directory[i] == NULL) {
+            continue;
+        }
+        vm_quad_t entryBase = base + (vm_quad_t)i * span;
+        if (level == LAST_LEVEL) {
+            *pageNumber = entryBase;
+            return directory[i];
+        }
+        if (*pageNumber < entryBase) {
+            *pageNumber = entryBase;
+        }
+        Page* page = nextIn(directory[i], level + 1, entryBase, pageNumber);
+        if (page != NULL) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/* Maps the pages of the regions that were not looked up yet, such that
+ * pageCount counts them */
+void mapRegions(AddressSpace* space) {
+    MappedRegion* regions = space->regions;
+    space->regions = NULL;
+    while (regions != NULL) {
+        for (vm_quad_t i = 0; i < regions->pageCount; ++i) {
+            Page** slot = pageSlot(space, regions->firstPage + i, false);
+            if (slot == NULL || *slot == NULL) {
+                mapPage(space, regions->firstPage + i, regions->bytes + i * PAGE_SIZE);
+            }
+        }
+        MappedRegion* next = regions->next;
+        FREE_ARRAY(MappedRegion, regions, 1);
+        regions = next;
+    }
+}
+
+/* The first allocated page numbered *pageNumber or above, whose number is
+ * stored back into *pageNumber. NULL once there are no more pages. Every page
+ * of the mapped regions is mapped first, such that walking the pages sees them */
+Page* nextPage(AddressSpace* space, vm_quad_t* pageNumber) {
+    if (space->regions != NULL) {
+        mapRegions(space);
+    }
+    if (space->root == NULL) {
+        return NULL;
+    }
+    if (*pageNumber < 0) {
+        *pageNumber = 0;
+    }
+    return nextIn(space->root, 0, 0, pageNumber);
+}
+
+/* The page of to numbered pageNumber without frame and decoded instructions,
+ * ready to take other bytes */
+static Page* replacePage(AddressSpace* to, vm_quad_t pageNumber) {
+    Page** slot = pageSlot(to, pageNumber, true);
+    if (*slot == NULL) {
+        *slot = INIT_ARRAY(Page, NULL, 1);
+        to->pageCount++;
+    } else {
+        clearCode(*slot);
+        releaseFrame((*slot)->frame);
+    }
+    setFrame(*slot, NULL);
+    return *slot;
+}
+
+static void sharePage(AddressSpace* to, Page* page, vm_quad_t pageNumber) {
+    /* Mapped bytes are copied into a frame of the page first, see mapPage */
+    if (page->frame == NULL && page->bytes != zeroPage) {
+        Frame* frame = newFrame();
+        memcpy(frame->bytes, page->bytes, PAGE_SIZE);
+        setFrame(page, frame);
+    }
+    Page* copy = replacePage(to, pageNumber);
+    if (page->frame == NULL) {
+        return;
+    }
+    atomic_fetch_add_explicit(&page->frame->references, 1, memory_order_relaxed);
+    setFrame(copy, page->frame);
+    if (!copy->written) {
+        addWritten(to, copy);
+    }
+}
+
+static void shareDirectory(AddressSpace* to, void** directory, int level, vm_quad_t base) {
+    for (size_t i = 0; i < PAGE_LEVEL_SIZE; ++i) {
+        if (directory[i] == NULL) {
+            continue;
+        }
+        vm_quad_t entryBase = base + (vm_quad_t)i * levelSpan(level);
+        if (level == LAST_LEVEL) {
+            sharePage(to, directory[i], entryBase);
+        } else {
+            shareDirectory(to, directory[i], level + 1, entryBase);
+        }
+    }
+}
+
+/* Maps every page of from into to, sharing their frames. Only page tables are
+ * allocated, a frame is copied once either side writes to it. Pages to already
+ * holds are reused with the shared frame, the other ones are left as they are.
+ * The write TLB of from may still map the pages it shares now, it is flushed
+ * along with that of to. */
+void shareAddressSpace(AddressSpace* to, AddressSpace* from) {
+    if (from->regions != NULL) {
+        mapRegions(from);
+    }
+    if (from->root != NULL) {
+        shareDirectory(to, from->root, 0, 0);
+    }
+    flushTlb(from);
+    flushTlb(to);
+}
+
+/* Maps PAGE_SIZE bytes owned by someone else (a mapped file) read-only into
+ * the page, they are copied into a frame on the first write to it. The bytes
+ * must stay valid until the next reset, or until the address space is freed.
+ * Sharing the address space copies them as well. */
+void mapPage(AddressSpace* space, vm_quad_t pageNumber, const vm_ubyte_t* bytes) {
+    Page* page  = replacePage(space, pageNumber);
+    page->bytes = (vm_ubyte_t*)bytes;
+    if (!page->written) {
+        addWritten(space, page);
+    }
+    flushTlbPage(space, pageNumber);
+}
+
+/* Replaces the frame of the page with another holding the same bytes, or with
+ * none if they are all zeros. Both pages are copied on their next write. */
+void mergePage(AddressSpace* space, Page* page, vm_quad_t pageNumber, Frame* frame) {
+    if (frame != NULL) {
+        atomic_fetch_add_explicit(&frame->references, 1, memory_order_relaxed);
+    }
+    releaseFrame(page->frame);
+    setFrame(page, frame);
+    flushTlbPage(space, pageNumber);
+}
+
+/* Maps pageCount pages of a mapped file like mapPage does, but only once they
+ * are looked up. Only the pages of the region the address space already holds
+ * (those a pooled VM kept) are mapped right away, otherwise mapping a region
+ * costs the same whatever its size. */
+void mapRegion(AddressSpace* space, vm_quad_t firstPage, vm_quad_t pageCount, const vm_ubyte_t* bytes) {
+    vm_quad_t pageNumber = firstPage;
+    while (space->root != NULL && nextIn(space->root, 0, 0, &pageNumber) != NULL && pageNumber < firstPage + pageCount) {
+        mapPage(space, pageNumber, bytes + (pageNumber - firstPage) * PAGE_SIZE);
+        pageNumber++;
+    }
+    MappedRegion* region = INIT_ARRAY(MappedRegion, NULL, 1);
+    region->firstPage = firstPage;
+    region->pageCount = pageCount;
+    region->bytes     = bytes;
+    region->next      = space->regions;
+    space->regions    = region;
+}
+
+static inline bool pageInSpace(vm_quad_t pageNumber) {
+    return pageNumber >= 0 && pageNumber < PAGE_COUNT;
+}
+
+/* NULL for pages outside of the address space */
+vm_ubyte_t* fillReadTlb(AddressSpace* space, vm_quad_t pageNumber) {
+    if (!pageInSpace(pageNumber)) {
+        return NULL;
+    }
+    Page* page      = findPage(space, pageNumber, false);
+    TlbEntry* entry = &space->readTlb[pageNumber & (TLB_SIZE - 1)];
+    entry->tag   = pageNumber;
+    entry->page  = page;
+    entry->bytes = page != NULL ? page->bytes : (vm_ubyte_t*)zeroPage;
+    return entry->bytes;
+}
+
+/* Allocates the page on first touch, and its frame on the first write or a
+ * copy of it if it is shared.
+ * The read entry is replaced as well, it may still map the zero page or the
+ * shared frame. NULL for pages outside of the address space */
+Page* fillWriteTlb(AddressSpace* space, vm_quad_t pageNumber) {
+    if (!pageInSpace(pageNumber)) {
+        return NULL;
+    }
+    Page* page     = findPage(space, pageNumber, true);
+    if (!page->written) {
+        addWritten(space, page);
+    }
+    if (!ownsFrame(page)) {
+        Frame* frame = newFrame();
+        if (page->bytes != zeroPage) {
+            memcpy(frame->bytes, page->bytes, PAGE_SIZE);
+        }
+        releaseFrame(page->frame);
+        setFrame(page, frame);
+    }
+    size_t index   = pageNumber & (TLB_SIZE - 1);
+    TlbEntry entry = { pageNumber, page->bytes, page };
+    space->writeTlb[index] = entry;
+    space->readTlb[index]  = entry;
+    return page;
+}
+
+/* The frame of a page code is fetched from, which holds its decode cache. A
+ * page without one (reading zeros or a mapped file) is given a copy of the
+ * bytes it reads, as on its first write */
+Frame* codeFrame(AddressSpace* space, Page* page, vm_quad_t pageNumber) {
+    if (page->frame == NULL) {
+        Frame* frame = newFrame();
+        if (page->bytes != zeroPage) {
+            memcpy(frame->bytes, page->bytes, PAGE_SIZE);
+        }
+        setFrame(page, frame);
+        if (!page->written) {
+            addWritten(space, page);
+        }
+        flushTlbPage(space, pageNumber);
+    }
+    return page->frame;
+}
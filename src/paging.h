@@ -0,0 +1,130 @@
+#ifndef cero_paging_h
+#define cero_paging_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "value.h"
+
+/* Guest addresses are 47 bits wide, the lower half of an x86-64 address space.
+ * Accesses outside [0, VM_ADDRESS_LIMIT) fault with STAT_ADR. */
+#define VM_ADDRESS_BITS  (47)
+#define VM_ADDRESS_LIMIT ((vm_quad_t)1 << VM_ADDRESS_BITS)
+
+/* The stack grows down from the top of the address space, code sits at 0 */
+#define VM_STACK_TOP     (VM_ADDRESS_LIMIT)
+
+#define PAGE_BITS  (12)
+#define PAGE_SIZE  ((vm_quad_t)1 << PAGE_BITS)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+#define PAGE_COUNT (VM_ADDRESS_LIMIT >> PAGE_BITS)
+
+/* Size of the bitmap of the translated bytes of a page */
+#define PAGE_BITMAP_SIZE (PAGE_SIZE / 8)
+
+/* A page number is split into PAGE_LEVELS indices of PAGE_LEVEL_BITS bits,
+ * the top level directory is indexed with the bits that are left */
+#define PAGE_LEVEL_BITS (9)
+#define PAGE_LEVEL_SIZE (1 << PAGE_LEVEL_BITS)
+#define PAGE_LEVELS     (4)
+
+/* Number of entries of each of the direct mapped TLBs, a power of two */
+#ifndef TLB_SIZE
+#define TLB_SIZE (64)
+#endif
+
+/* Tag of TLB entries mapping nothing, no address shifts down to it */
+#define TLB_EMPTY (INT64_MIN)
+
+struct Instruction;
+
+/* The bytes of a page. Address spaces sharing pages (see shareAddressSpace)
+ * share their frames, a frame referenced more than once is copied before the
+ * first write to it through the page. The decode cache of the instructions
+ * starting in the frame is shared along with it: the copy starts without one.
+ * Entries only depend on the bytes of the frame (see decoded in vm.c), they
+ * are filled without synchronisation, so VMs sharing frames must not decode
+ * from them on different threads at the same time. */
+typedef struct {
+    vm_ubyte_t bytes[PAGE_SIZE];
+    _Atomic uint32_t references; /* Number of pages mapping the frame                           */
+    uint16_t decodedFirst;       /* First entry of the decode cache filled since the last reset */
+    uint16_t decodedEnd;         /* One past the last one, equal to decodedFirst if none was    */
+    struct Instruction* decoded; /* Decode cache of the instructions starting in it, or NULL    */
+} Frame;
+
+typedef struct Page {
+    vm_ubyte_t* bytes;           /* The PAGE_SIZE bytes of guest memory, those of frame            */
+    Frame* frame;                /* The frame holding them, NULL until written (see mapPage)       */
+    bool code;                   /* Whether bytes of the page were decoded                         */
+    bool written;                /* Whether the page is in the written list of its address space   */
+    vm_ubyte_t* translated;      /* Bitmap of the bytes translated by the JIT, NULL if none        */
+} Page;
+
+typedef struct {
+    vm_quad_t tag;               /* Number of the page the entry maps, or TLB_EMPTY              */
+    vm_ubyte_t* bytes;           /* Its bytes                                                    */
+    Page* page;                  /* Its page, NULL for pages read before they were ever written  */
+} TlbEntry;
+
+/* A file mapped read-only, whose bytes pages of an address space may map */
+typedef struct MappedFile {
+    const vm_ubyte_t* bytes;
+    size_t size;
+    struct MappedFile* next;     /* The next file mapped by the same address space */
+} MappedFile;
+
+/* Consecutive pages of a mapped file, mapped one page at a time the first time
+ * they are looked up (see mapRegion) */
+typedef struct MappedRegion {
+    vm_quad_t firstPage;
+    vm_quad_t pageCount;
+    const vm_ubyte_t* bytes;     /* The bytes of the first page                  */
+    struct MappedRegion* next;
+} MappedRegion;
+
+/* -----Address space-----
+ * A radix tree of directories mapping page numbers to pages which are only
+ * allocated when first written. Reading a page that was never written reads
+ * a shared page of zeros instead. The TLBs remember the last pages looked up
+ * for reading and for writing, see m1r in vm.c for the fast path.
+ * Page numbers outside [0, PAGE_COUNT) never enter a TLB, which makes the tag
+ * compare of the fast path the bounds check as well.
+ * Pages entering the write TLB are added to the written list, such that a
+ * reset only has to clear those. So are shared pages, whose bytes may not be
+ * zeros either. Shared pages never enter the write TLB before they were
+ * copied, which keeps the write fast path unaware of the sharing. */
+typedef struct {
+    TlbEntry readTlb[TLB_SIZE];
+    TlbEntry writeTlb[TLB_SIZE];
+    void** root;                 /* Top level directory, NULL until a page is allocated */
+    uint64_t pageCount;          /* Number of pages allocated                           */
+    Page** written;              /* Pages written or shared since the last reset        */
+    uint32_t writtenCount;
+    uint32_t writtenCapacity;
+    MappedFile* files;           /* Files mapPage mapped bytes of, until the next reset */
+    MappedRegion* regions;       /* Regions of them whose pages are not all mapped yet  */
+} AddressSpace;
+
+void initAddressSpace(AddressSpace* space);
+void freeAddressSpace(AddressSpace* space);
+void resetAddressSpace(AddressSpace* space);
+void shareAddressSpace(AddressSpace* to, AddressSpace* from);
+void mapPage(AddressSpace* space, vm_quad_t pageNumber, const vm_ubyte_t* bytes);
+void mapRegion(AddressSpace* space, vm_quad_t firstPage, vm_quad_t pageCount, const vm_ubyte_t* bytes);
+void mapRegions(AddressSpace* space);
+MappedFile* mapFile(const char* path);
+void unmapFile(MappedFile* file);
+void adoptFile(AddressSpace* space, MappedFile* file);
+void mergePage(AddressSpace* space, Page* page, vm_quad_t pageNumber, Frame* frame);
+void flushTlb(AddressSpace* space);
+void flushTlbPage(AddressSpace* space, vm_quad_t pageNumber);
+
+Page* findPage(AddressSpace* space, vm_quad_t pageNumber, bool allocate);
+Page* nextPage(AddressSpace* space, vm_quad_t* pageNumber);
+
+vm_ubyte_t* fillReadTlb(AddressSpace* space, vm_quad_t pageNumber);
+Page* fillWriteTlb(AddressSpace* space, vm_quad_t pageNumber);
+Frame* codeFrame(AddressSpace* space, Page* page, vm_quad_t pageNumber);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdint.h>
+
+#include "pool.h"
+#include "memory.h"
+#include "trace.h"
+#include "profile.h"
+#include "counters.h"
+#include "metrics.h"
+
+/* reallocate only aligns to what malloc does, chunks are over-allocated by a
+ * cache line and their VMs start at the first aligned byte */
+#define CHUNK_BYTES (sizeof(VM) * VM_POOL_CHUNK + VM_CACHE_LINE)
+
+static VM* chunkVMs(vm_ubyte_t* chunk) {
+    uintptr_t address = (uintptr_t)chunk;
+    return (VM*)((address + VM_CACHE_LINE - 1) & ~(uintptr_t)(VM_CACHE_LINE - 1));
+}
+
+void initVMPool(VMPool* pool) {
+    pool->chunks           = NULL;
+    pool->chunkCount       = 0;
+    pool->chunkCapacity    = 0;
+    pool->released         = NULL;
+    pool->releasedCount    = 0;
+    pool->releasedCapacity = 0;
+}
+
+/* Frees every VM of the pool, including those still acquired */
+void freeVMPool(VMPool* pool) {
+    for (uint32_t c = 0; c < pool->chunkCount; ++c) {
+        VM* vms = chunkVMs(pool->chunks[c]);
+        for (uint32_t i = 0; i < VM_POOL_CHUNK; ++i) {
+            freeVM(&vms[i]);
+        }
+        FREE_ARRAY(vm_ubyte_t, pool->chunks[c], CHUNK_BYTES);
+    }
+    FREE_ARRAY(vm_ubyte_t*, pool->chunks, pool->chunkCapacity);
+    FREE_ARRAY(VM*, pool->released, pool->releasedCapacity);
+    initVMPool(pool);
+}
+
+static void pushReleased(VMPool* pool, VM* vm) {
+    if (pool->releasedCount == pool->releasedCapacity) {
+        uint32_t oldCapacity   = pool->releasedCapacity;
+        pool->releasedCapacity = GROW_CAPACITY(oldCapacity);
+        pool->released         = GROW_ARRAY(VM*, pool->released, oldCapacity, pool->releasedCapacity);
+    }
+    pool->released[pool->releasedCount++] = vm;
+}
+
+static void growPool(VMPool* pool) {
+    if (pool->chunkCount == pool->chunkCapacity) {
+        uint32_t oldCapacity = pool->chunkCapacity;
+        pool->chunkCapacity  = GROW_CAPACITY(oldCapacity);
+        pool->chunks         = GROW_ARRAY(vm_ubyte_t*, pool->chunks, oldCapacity, pool->chunkCapacity);
+    }
+    vm_ubyte_t* chunk = INIT_ARRAY(vm_ubyte_t, NULL, CHUNK_BYTES);
+    pool->chunks[pool->chunkCount++] = chunk;
+    VM* vms = chunkVMs(chunk);
+    /* Pushed backwards such that the VMs are acquired in address order */
+    for (uint32_t i = VM_POOL_CHUNK; i > 0; --i) {
+        initVM(&vms[i - 1]);
+        pushReleased(pool, &vms[i - 1]);
+    }
+}
+
+VM* acquireVM(VMPool* pool) {
+    if (pool->releasedCount == 0) {
+        growPool(pool);
+    }
+    return pool->released[--pool->releasedCount];
+}
+
+/* Resets the VM now such that acquiring it again costs nothing. Whoever
+ * acquires it next starts without the trace, profile, counters or metrics */
+void releaseVM(VMPool* pool, VM* vm) {
+    stopTrace(vm);
+    stopProfile(vm);
+    stopCounters(vm);
+    stopMetrics(vm);
+    resetVM(vm);
+    pushReleased(pool, vm);
+}
@@ -0,0 +1,31 @@
+#ifndef cero_pool_h
+#define cero_pool_h
+
+#include "common.h"
+#include "vm.h"
+
+/* Number of VMs carved out of the arena at a time */
+#ifndef VM_POOL_CHUNK
+#define VM_POOL_CHUNK (16)
+#endif
+
+/* -----VM pool-----
+ * Hands out initialised VMs from an arena of chunks of VM_POOL_CHUNK cache
+ * line aligned VMs. Released VMs are reset (see resetVM) with their observers
+ * closed and handed out again by the next acquire, they are only freed with
+ * the pool. */
+typedef struct {
+    vm_ubyte_t** chunks;     /* The allocations of the chunks, not aligned */
+    uint32_t chunkCount;
+    uint32_t chunkCapacity;
+    VM** released;           /* VMs ready to be acquired, the last released first */
+    uint32_t releasedCount;
+    uint32_t releasedCapacity;
+} VMPool;
+
+void initVMPool(VMPool* pool);
+void freeVMPool(VMPool* pool);
+VM* acquireVM(VMPool* pool);
+void releaseVM(VMPool* pool, VM* vm);
+
+#endif
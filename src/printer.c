@@ -1,5 +1,20 @@
 #include "printer.h"
 
+static const char* registerNames[REG_COUNT] = {
+    "RAX", "RCX", "RDX", "RBX", "RSP", "RBP", "RSI", "RDI",
+    "R8",  "R9",  "R10", "R11", "R12", "R13", "R14", "F"
+};
+
+static const char* statusName(StatusCondition status) {
+    switch (status) {
+        case STAT_AOK: return "AOK";
+        case STAT_HLT: return "HLT";
+        case STAT_ADR: return "ADR";
+        case STAT_INS: return "INS";
+    }
+    return "???";
+}
+
 void printRegisters(VM* vm) {
     const vm_quad_t columnCount = 3;
     const vm_quad_t rowCount    = REG_COUNT / columnCount + 1;
@@ -14,24 +29,7 @@ void printRegisters(VM* vm) {
                 CERO_PRINT("                                    ");
                 continue;
             }
-            switch (i) {
-                case  0: CERO_PRINT("RAX     "); break;
-                case  1: CERO_PRINT("RCX     "); break;
-                case  2: CERO_PRINT("RDX     "); break;
-                case  3: CERO_PRINT("RBX     "); break;
-                case  4: CERO_PRINT("RSP     "); break;
-                case  5: CERO_PRINT("RBP     "); break;
-                case  6: CERO_PRINT("RSI     "); break;
-                case  7: CERO_PRINT("RDI     "); break;
-                case  8: CERO_PRINT("R8      "); break;
-                case  9: CERO_PRINT("R9      "); break;
-                case 10: CERO_PRINT("R10     "); break;
-                case 11: CERO_PRINT("R11     "); break;
-                case 12: CERO_PRINT("R12     "); break;
-                case 13: CERO_PRINT("R13     "); break;
-                case 14: CERO_PRINT("R14     "); break;
-                case 15: CERO_PRINT("F       "); break;
-            }
+            CERO_PRINT("%-8s", registerNames[i]);
             CERO_PRINT("0x%016" PRIx64, vm->registers[i]);
             CERO_PRINT("          ");
         }
@@ -41,16 +39,10 @@ void printRegisters(VM* vm) {
 
 void printFlagsAndStatusAndPc(VM* vm) {
     CERO_TRACE();
-    CERO_PRINT("ZF:%d   ", (vm->conditionCodes & 0b0001) >> CC_ZF);
-    CERO_PRINT("SF:%d   ", (vm->conditionCodes & 0b0010) >> CC_SF);
-    CERO_PRINT("OF:%d   ", (vm->conditionCodes & 0b0100) >> CC_OF);
-    CERO_PRINT("STAT:");
-    switch (vm->statusCondition) {
-        case STAT_AOK: CERO_PRINT("AOK"); break;
-        case STAT_HLT: CERO_PRINT("HLT"); break;
-        case STAT_ADR: CERO_PRINT("ADR"); break;
-        case STAT_INS: CERO_PRINT("INS"); break;
-    }
+    CERO_PRINT("ZF:%d   ", zf(vm));
+    CERO_PRINT("SF:%d   ", sf(vm));
+    CERO_PRINT("OF:%d   ", of(vm));
+    CERO_PRINT("STAT:%s", statusName(vm->statusCondition));
     CERO_PRINT("   ");
     CERO_PRINT("PC:0x%06" PRIxPTR, vm->pc);
     CERO_PRINT("\n");
@@ -63,56 +55,156 @@ void printStack(VM* vm) {
         CERO_TRACE("[ ]");
     } else {
         CERO_TRACE();
-        for (vm_quad_t mem = rsp; mem < rbp; mem += 8) {
+        vm_quad_t mem = rsp;
+        for (int depth = 0; mem < rbp && depth < PRINT_STACK_MAX_DEPTH; mem += 8, ++depth) {
+            /* Pages never written hold no frames, the rest of the walk would only print zeros */
+            if (findPage(&vm->memory, mem >> PAGE_BITS, false) == NULL) {
+                break;
+            }
             CERO_PRINT("[ %" PRId64 " ]", m8r(vm, mem));
         }
+        if (mem < rbp) {
+            CERO_PRINT("[ ... ]");
+        }
     }
     CERO_PRINT("\n");
 }
 
-void printMemory(VM* vm) {
+/* Whether RBP or RSP points into the quad ending at addr, *marker is set to the
+ * text printed after it either way */
+static bool stackMarker(VM* vm, vm_quad_t addr, const char** marker) {
     vm_quad_t rbp = vm->registers[REG_RBP];
     vm_quad_t rsp = vm->registers[REG_RSP];
-    const vm_quad_t memorySize     = MEM_MAX;
+    bool printRBP = rbp > addr - 8 && rbp <= addr;
+    bool printRSP = rsp > addr - 8 && rsp <= addr;
+    if (printRBP && printRSP) {
+        *marker = "<RBP RSP  ";
+    } else if (printRBP) {
+        *marker = "<RBP      ";
+    } else if (printRSP) {
+        *marker = "<RSP      ";
+    } else {
+        *marker = "          ";
+    }
+    return printRBP || printRSP;
+}
+
+/* Prints the pages that were written, three quads per row read in the byte
+ * order of the memory. Rows of zeros are left out unless RSP or RBP point into them */
+void printMemory(VM* vm) {
     const vm_quad_t bytesPerItem   = 8;
     const vm_quad_t columnCount    = 3;
     const vm_quad_t bytesPerColumn = columnCount * bytesPerItem;
-    const vm_quad_t rowCount       = (memorySize + bytesPerColumn) / bytesPerColumn;
-    for (vm_quad_t row = 0; row < rowCount; ++row) {
-        CERO_TRACE();
-        for (vm_quad_t column = 0; column < bytesPerColumn; ++column) {
-            vm_quad_t iRow    = rowCount - row - 1;
-            vm_quad_t iColumn = bytesPerColumn - column - 1;
-            vm_quad_t iByte   = ((rowCount * bytesPerItem * (iColumn / bytesPerItem)) + (iRow * bytesPerItem) + (bytesPerItem - 1) - ((iRow * bytesPerItem) + iColumn) % bytesPerItem);
-            if (iColumn % bytesPerItem == bytesPerItem - 1) {
-                CERO_PRINT("0x%04" PRIx64, iByte);
-                CERO_PRINT("  0x");
+    vm_quad_t pageNumber = 0;
+    for (Page* page = nextPage(&vm->memory, &pageNumber); page != NULL; page = nextPage(&vm->memory, &pageNumber)) {
+        vm_quad_t base = pageNumber * PAGE_SIZE;
+        for (vm_quad_t row = 0; row < PAGE_SIZE; row += bytesPerColumn) {
+            bool shown = false;
+            for (vm_quad_t i = row; i < row + bytesPerColumn && i < PAGE_SIZE; ++i) {
+                shown |= page->bytes[i] != 0;
             }
-            if (iByte >= 0 && iByte < memorySize) {
-                CERO_PRINT("%02" PRIx8, vm->memory[iByte]);
-            } else {
-                CERO_PRINT("__");
+            const char* marker;
+            for (vm_quad_t item = row; item < row + bytesPerColumn; item += bytesPerItem) {
+                shown |= stackMarker(vm, base + item + bytesPerItem - 1, &marker);
             }
-            if (iColumn > 0 && iColumn % 8 == 0) {
-                bool printRBP = false, printRSP = false;
-                if (rsp > iByte - 8 && rsp <= iByte) {
-                    printRSP = true;
-                }
-                if(rbp > iByte - 8 && rbp <= iByte) {
-                    printRBP = true;
-                }
+            if (!shown) {
+                continue;
+            }
+            CERO_TRACE();
+            for (vm_quad_t item = row; item < row + bytesPerColumn; item += bytesPerItem) {
+                stackMarker(vm, base + item + bytesPerItem - 1, &marker);
+                CERO_PRINT("0x%012" PRIx64 "  0x%016" PRIx64 "%s", base + item, m8r(vm, base + item), marker);
+            }
+            CERO_PRINT("\n");
+        }
+        pageNumber++;
+    }
+}
 
-                if (printRBP && printRSP) {
-                    CERO_PRINT("<RBP RSP  ");
-                } else if (printRBP) {
-                    CERO_PRINT("<RBP      ");
-                }  else if (printRSP) {
-                    CERO_PRINT("<RSP      ");
-                } else {
-                    CERO_PRINT("          ");
-                }
+#ifdef DEBUG_TRACE_EXECUTION
+/* Prints what the step wrote: the PC and status, the condition codes if they
+ * were set, then the written registers on one line and every written granule
+ * of the memory on its own line */
+static void printDelta(VM* vm) {
+    CERO_TRACE();
+    if (vm->cold->dirtyFlags) {
+        CERO_PRINT("ZF:%d   SF:%d   OF:%d   ", zf(vm), sf(vm), of(vm));
+    }
+    CERO_PRINT("STAT:%s   PC:0x%06" PRIxPTR "\n", statusName(vm->statusCondition), vm->pc);
+    if (vm->cold->dirtyRegisters != 0) {
+        CERO_TRACE();
+        for (int r = 0; r < REG_COUNT; ++r) {
+            if (vm->cold->dirtyRegisters & (1u << r)) {
+                CERO_PRINT("%-8s0x%016" PRIx64 "          ", registerNames[r], vm->registers[r]);
             }
         }
         CERO_PRINT("\n");
     }
+    vm_quad_t rbp = vm->registers[REG_RBP];
+    vm_quad_t rsp = vm->registers[REG_RSP];
+    for (uint32_t i = 0; i < vm->cold->dirtyMemoryCount; ++i) {
+        vm_quad_t addr = vm->cold->dirtyMemory[i];
+        CERO_TRACE("0x%012" PRIx64 "  0x%016" PRIx64 "%s\n", addr, m8r(vm, addr),
+            addr == rsp && addr == rbp ? "<RBP RSP" : addr == rsp ? "<RSP" : addr == rbp ? "<RBP" : "");
+    }
+}
+#endif
+
+/* Prints the state of the VM after a step of the tracing build. The first step,
+ * every fullDumpEvery steps and steps writing more granules than the dirty list
+ * holds dump everything, all others only print what the dirty sets of the VM
+ * say was written by the step */
+void printStep(VM* vm) {
+#ifdef DEBUG_TRACE_EXECUTION
+    if (vm->cold->steps == 0 || (vm->cold->fullDumpEvery != 0 && vm->cold->steps % vm->cold->fullDumpEvery == 0) ||
+        vm->cold->dirtyMemoryCount > DIRTY_MEMORY_MAX) {
+        printMemory(vm);
+        printRegisters(vm);
+        printStack(vm);
+        printFlagsAndStatusAndPc(vm);
+    } else {
+        printDelta(vm);
+    }
+    vm->cold->steps++;
+#endif
+}
+
+/* Prints how often each superinstruction was executed (HITS) and the share of
+ * all executions of its first instruction that ran as the fusion (RATE).
+ * The first instruction may lead several fusions (subq leads every SUBQ_JXX)
+ * so their rates add up to at most 100%. */
+void printFusionReport(VM* vm) {
+#ifdef VM_FUSION_STATS
+    uint64_t retired = 0, fused = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        vm_quad_t length;
+        fusionLeader((Operation)op, &length);
+        retired += vm->cold->executed[op] * length;
+        if (length > 1) {
+            fused += vm->cold->executed[op] * length;
+        }
+    }
+    CERO_INFO("%-16s %12s %12s %8s\n", "FUSION", "HITS", "LEADER", "RATE");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        vm_quad_t length;
+        Operation leader = fusionLeader((Operation)op, &length);
+        if (leader == OP_UNDECODED) {
+            continue;
+        }
+        uint64_t leaderCount = vm->cold->executed[leader];
+        for (int other = 0; other < OP_COUNT; ++other) {
+            vm_quad_t otherLength;
+            if (fusionLeader((Operation)other, &otherLength) == leader) {
+                leaderCount += vm->cold->executed[other];
+            }
+        }
+        double rate = leaderCount == 0 ? 0.0 : 100.0 * vm->cold->executed[op] / leaderCount;
+        CERO_INFO("%-16s %12" PRIu64 " %12" PRIu64 " %7.2f%%\n",
+            operationName((Operation)op), vm->cold->executed[op], leaderCount, rate);
+    }
+    CERO_INFO("%" PRIu64 " of %" PRIu64 " instructions retired in superinstructions (%.2f%%)\n",
+        fused, retired, retired == 0 ? 0.0 : 100.0 * fused / retired);
+#else
+    CERO_WARN("Build with VM_FUSION_STATS to count superinstructions\n");
+#endif
 }
\ No newline at end of file
@@ -4,13 +4,16 @@
 #include "common.h"
 #include "vm.h"
 
-#define DEBUG_TRACE_EXECUTION
-
-#include "printer.h"
+/* Most quads printStack prints between RSP and RBP, which may be far apart */
+#ifndef PRINT_STACK_MAX_DEPTH
+#define PRINT_STACK_MAX_DEPTH (64)
+#endif
 
 void printRegisters(VM* vm);
 void printFlagsAndStatusAndPc(VM* vm);
 void printStack(VM* vm);
 void printMemory(VM* vm);
+void printStep(VM* vm);
+void printFusionReport(VM* vm);
 
 #endif
\ No newline at end of file
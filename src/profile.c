@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "memory.h"
+
+/* -----Execution profile-----
+ * runProfiled executes every instruction on its own (never fused), like
+ * runTraced, and hands it to profileStep once it executed. The engines run()
+ * picks otherwise do not know about profiles, so a VM without one runs exactly
+ * as fast as in a build without this file.
+ *
+ * Every retired instruction is counted by Operation and by PC, jXX count
+ * whether they were taken and cmovXX whether they moved. A shadow call stack
+ * follows call and ret as a tree of frames, one per guest function reached
+ * through a distinct chain of calls. An instruction is counted in the frame
+ * it executed in, call in its caller and ret in the function returning.
+ * writeFoldedStacks prints the tree in the folded format of flamegraph.pl,
+ * functions being named by the address they were called at.
+ */
+
+typedef struct {
+    vm_quad_t pc;
+    uint64_t retired;          /* 0 for empty entries                          */
+    uint64_t taken;            /* Times a jXX jumped or a cmovXX moved         */
+    Operation operation;
+} ProfileSite;
+
+typedef struct {
+    vm_quad_t function;        /* Address the frame was called at              */
+    uint32_t parent;           /* Index of the caller, the root is its own one */
+    uint64_t self;             /* Instructions retired in the frame            */
+} ProfileFrame;
+
+typedef struct Profile {
+    uint64_t retired[OP_COUNT];
+    uint64_t taken[OP_COUNT];
+    ProfileSite* sites;        /* Hash table by PC                             */
+    uint32_t siteCount;
+    uint32_t siteCapacity;     /* A power of two                               */
+    ProfileFrame* frames;      /* The root, the entry of the program, is 0     */
+    uint32_t frameCount;
+    uint32_t frameCapacity;
+    uint32_t* children;        /* Hash table of 1 + the index of the frames,
+                                  by parent and function                       */
+    uint32_t childCapacity;    /* A power of two                               */
+    uint32_t frame;            /* The frame executing                          */
+    bool started;              /* Whether the root knows its function          */
+} Profile;
+
+#define PROFILE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+static inline uint32_t hashQuad(vm_quad_t quad) {
+    uint64_t hash = (uint64_t)quad * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(hash >> 32);
+}
+
+bool startProfile(VM* vm) {
+    stopProfile(vm);
+    Profile* profile = INIT_ARRAY(Profile, NULL, 1);
+    profile->frameCapacity = GROW_CAPACITY(0);
+    profile->frames        = INIT_ARRAY(ProfileFrame, NULL, profile->frameCapacity);
+    profile->frameCount    = 1;
+    vm->cold->profile = profile;
+    return true;
+}
+
+void stopProfile(VM* vm) {
+    Profile* profile = vm->cold->profile;
+    if (profile == NULL) {
+        return;
+    }
+    FREE_ARRAY(ProfileSite, profile->sites, profile->siteCapacity);
+    FREE_ARRAY(ProfileFrame, profile->frames, profile->frameCapacity);
+    FREE_ARRAY(uint32_t, profile->children, profile->childCapacity);
+    FREE_ARRAY(Profile, profile, 1);
+    vm->cold->profile = NULL;
+}
+
+/* -----Sites----- */
+static ProfileSite* findSite(ProfileSite* sites, uint32_t capacity, vm_quad_t pc) {
+    uint32_t index = hashQuad(pc) & (capacity - 1);
+    while (sites[index].retired != 0 && sites[index].pc != pc) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &sites[index];
+}
+
+static ProfileSite* site(Profile* profile, vm_quad_t pc) {
+    if (profile->siteCount + 1 > PROFILE_MAX_LOAD(profile->siteCapacity)) {
+        uint32_t oldCapacity = profile->siteCapacity;
+        ProfileSite* old     = profile->sites;
+        profile->siteCapacity = GROW_CAPACITY(oldCapacity);
+        profile->sites        = INIT_ARRAY(ProfileSite, NULL, profile->siteCapacity);
+        for (uint32_t i = 0; i < oldCapacity; ++i) {
+            if (old[i].retired != 0) {
+                *findSite(profile->sites, profile->siteCapacity, old[i].pc) = old[i];
+            }
+        }
+        FREE_ARRAY(ProfileSite, old, oldCapacity);
+    }
+    ProfileSite* site = findSite(profile->sites, profile->siteCapacity, pc);
+    if (site->retired == 0) {
+        site->pc = pc;
+        profile->siteCount++;
+    }
+    return site;
+}
+
+/* -----Frames----- */
+static uint32_t* findChild(Profile* profile, uint32_t parent, vm_quad_t function) {
+    uint32_t index = (hashQuad(function) ^ parent * 0x85ebca6bu) & (profile->childCapacity - 1);
+    while (profile->children[index] != 0) {
+        ProfileFrame* frame = &profile->frames[profile->children[index] - 1];
+        if (frame->parent == parent && frame->function == function) {
+            break;
+        }
+        index = (index + 1) & (profile->childCapacity - 1);
+    }
+    return &profile->children[index];
+}
+
+/* The frame of function called from parent, added on its first call */
+static uint32_t child(Profile* profile, uint32_t parent, vm_quad_t function) {
+    if (profile->frameCount + 1 > PROFILE_MAX_LOAD(profile->childCapacity)) {
+        FREE_ARRAY(uint32_t, profile->children, profile->childCapacity);
+        profile->childCapacity = GROW_CAPACITY(profile->childCapacity);
+        profile->children      = INIT_ARRAY(uint32_t, NULL, profile->childCapacity);
+        for (uint32_t i = 1; i < profile->frameCount; ++i) {
+            *findChild(profile, profile->frames[i].parent, profile->frames[i].function) = i + 1;
+        }
+    }
+    uint32_t* slot = findChild(profile, parent, function);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    if (profile->frameCount == profile->frameCapacity) {
+        uint32_t oldCapacity = profile->frameCapacity;
+        profile->frameCapacity = GROW_CAPACITY(oldCapacity);
+        profile->frames        = GROW_ARRAY(ProfileFrame, profile->frames, oldCapacity, profile->frameCapacity);
+    }
+    ProfileFrame* frame = &profile->frames[profile->frameCount];
+    frame->function = function;
+    frame->parent   = parent;
+    frame->self     = 0;
+    *slot = ++profile->frameCount;
+    return profile->frameCount - 1;
+}
+
+/* Counts the instruction that was at pc and just executed, taken telling
+ * whether it jumped or moved if it is a jXX or a cmovXX. Like the metrics it
+ * leaves out an instruction that faulted, it did not retire */
+void profileStep(VM* vm, const Instruction* ins, vm_quad_t pc, bool taken) {
+    if (vm->statusCondition != STAT_AOK && vm->statusCondition != STAT_HLT) {
+        return;
+    }
+    Profile* profile = vm->cold->profile;
+    if (!profile->started) {
+        profile->frames[0].function = pc;
+        profile->started            = true;
+    }
+    profile->retired[ins->operation]++;
+    profile->taken[ins->operation] += taken;
+    ProfileSite* at = site(profile, pc);
+    at->retired++;
+    at->taken    += taken;
+    at->operation = (Operation)ins->operation;
+    profile->frames[profile->frame].self++;
+
+    if (vm->statusCondition != STAT_AOK) {
+        return;
+    }
+    if (ins->operation == OP_CALL) {
+        profile->frame = child(profile, profile->frame, ins->valC);
+    } else if (ins->operation == OP_RET) {
+        profile->frame = profile->frames[profile->frame].parent;
+    }
+}
+
+/* -----Reports----- */
+static bool conditional(Operation operation) {
+    return (operation >= OP_JLE && operation <= OP_JG) || (operation >= OP_CMOVLE && operation <= OP_CMOVG);
+}
+
+static int bySitesRetired(const void* a, const void* b) {
+    const ProfileSite* siteA = *(const ProfileSite* const*)a;
+    const ProfileSite* siteB = *(const ProfileSite* const*)b;
+    return siteA->retired < siteB->retired ? 1 : siteA->retired > siteB->retired ? -1 : (siteA->pc > siteB->pc) - (siteA->pc < siteB->pc);
+}
+
+/* Prints the instructions retired by Operation, the taken rates of the jXX
+ * and cmovXX, and the PROFILE_TOP_SITES most executed PCs */
+void printProfile(VM* vm) {
+    Profile* profile = vm->cold->profile;
+    if (profile == NULL) {
+        CERO_WARN("Start a profile to print it\n");
+        return;
+    }
+    uint64_t total = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        total += profile->retired[op];
+    }
+    CERO_INFO("%-16s %14s %8s %14s %8s\n", "OPERATION", "RETIRED", "SHARE", "TAKEN", "RATE");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (profile->retired[op] == 0) {
+            continue;
+        }
+        if (conditional((Operation)op)) {
+            CERO_INFO("%-16s %14" PRIu64 " %7.2f%% %14" PRIu64 " %7.2f%%\n", operationName((Operation)op), profile->retired[op],
+                      100.0 * profile->retired[op] / total, profile->taken[op], 100.0 * profile->taken[op] / profile->retired[op]);
+        } else {
+            CERO_INFO("%-16s %14" PRIu64 " %7.2f%%\n", operationName((Operation)op), profile->retired[op],
+                      100.0 * profile->retired[op] / total);
+        }
+    }
+    CERO_INFO("%" PRIu64 " instructions retired at %u PCs in %u frames\n", total, profile->siteCount, profile->frameCount);
+
+    ProfileSite** sites = INIT_ARRAY(ProfileSite*, NULL, profile->siteCount + 1);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < profile->siteCapacity; ++i) {
+        if (profile->sites[i].retired != 0) {
+            sites[count++] = &profile->sites[i];
+        }
+    }
+    qsort(sites, count, sizeof(ProfileSite*), bySitesRetired);
+    CERO_INFO("%-14s %-16s %14s %8s %8s\n", "PC", "OPERATION", "RETIRED", "SHARE", "TAKEN");
+    for (uint32_t i = 0; i < count && i < PROFILE_TOP_SITES; ++i) {
+        ProfileSite* at = sites[i];
+        if (conditional(at->operation)) {
+            CERO_INFO("0x%012" PRIx64 " %-16s %14" PRIu64 " %7.2f%% %7.2f%%\n", at->pc, operationName(at->operation), at->retired,
+                      100.0 * at->retired / total, 100.0 * at->taken / at->retired);
+        } else {
+            CERO_INFO("0x%012" PRIx64 " %-16s %14" PRIu64 " %7.2f%%\n", at->pc, operationName(at->operation), at->retired,
+                      100.0 * at->retired / total);
+        }
+    }
+    FREE_ARRAY(ProfileSite*, sites, profile->siteCount + 1);
+}
+
+/* Writes one line per frame that retired instructions, the functions from the
+ * entry down to it and the number of instructions:
+ *     0x0;0x4a;0x96 1234 */
+bool writeFoldedStacks(VM* vm, const char* path) {
+    Profile* profile = vm->cold->profile;
+    if (profile == NULL) {
+        return false;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        CERO_ERROR("profile::write unable to write %s\n", path);
+        return false;
+    }
+    uint32_t* stack = INIT_ARRAY(uint32_t, NULL, profile->frameCount);
+    for (uint32_t i = 0; i < profile->frameCount; ++i) {
+        if (profile->frames[i].self == 0) {
+            continue;
+        }
+        uint32_t depth = 0;
+        for (uint32_t frame = i; frame != 0; frame = profile->frames[frame].parent) {
+            stack[depth++] = frame;
+        }
+        fprintf(file, "0x%" PRIx64, profile->frames[0].function);
+        while (depth > 0) {
+            fprintf(file, ";0x%" PRIx64, profile->frames[stack[--depth]].function);
+        }
+        fprintf(file, " %" PRIu64 "\n", profile->frames[i].self);
+    }
+    FREE_ARRAY(uint32_t, stack, profile->frameCount);
+    bool written = !ferror(file);
+    written &= fclose(file) == 0;
+    if (!written) {
+        CERO_ERROR("profile::write unable to write %s\n", path);
+    }
+    return written;
+}
@@ -0,0 +1,18 @@
+#ifndef cero_profile_h
+#define cero_profile_h
+
+#include "common.h"
+#include "vm.h"
+
+/* Number of PCs printProfile lists, the most executed first */
+#ifndef PROFILE_TOP_SITES
+#define PROFILE_TOP_SITES (20)
+#endif
+
+bool startProfile(VM* vm);
+void stopProfile(VM* vm);
+void profileStep(VM* vm, const Instruction* ins, vm_quad_t pc, bool taken);
+void printProfile(VM* vm);
+bool writeFoldedStacks(VM* vm, const char* path);
+
+#endif
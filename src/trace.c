@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "trace.h"
+#include "memory.h"
+
+/* -----Binary execution trace-----
+ * runTraced records the effects of every instruction into a ring buffer of
+ * TraceRecords, filled in two halves around the execution of the instruction:
+ * traceBegin saves what it is about to overwrite, traceEnd what it wrote.
+ *
+ * TRACE_STREAM: the VM thread is the only producer and the flush thread the
+ * only consumer, each owning one of the head and tail counters. The VM waits
+ * for the flush thread when the ring is full, nothing is ever dropped.
+ * TRACE_FAULT: there is no consumer, the oldest record is overwritten when the
+ * ring is full and the ring is dumped to the file once the VM faults.
+ *
+ * The decoder (tracedump.c) replays the records onto the state in the header.
+ */
+
+#define TRACE_RING_MASK ((uint64_t)TRACE_RING_SIZE - 1)
+
+typedef struct Trace {
+    TraceRecord* ring;
+    _Atomic uint64_t head;     /* Records published by the VM   */
+    _Atomic uint64_t tail;     /* Records written to the file   */
+    _Atomic bool stopping;     /* Tells the flush thread to end */
+    TraceMode mode;
+    FILE* file;
+    char* path;
+    bool flushing;             /* Whether the flush thread runs */
+    pthread_t flusher;
+} Trace;
+
+static vm_ubyte_t conditionCodesOf(VM* vm) {
+    return zf(vm) << CC_ZF | sf(vm) << CC_SF | of(vm) << CC_OF;
+}
+
+/* The pages of mapped regions are mapped before they are counted, nextPage
+ * would map them while they are written */
+static void writeHeader(VM* vm, FILE* file, TraceState state) {
+    mapRegions(&vm->memory);
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version        = TRACE_VERSION;
+    header.recordSize     = sizeof(TraceRecord);
+    header.state          = state;
+    header.status         = vm->statusCondition;
+    header.pageCount      = vm->memory.pageCount;
+    header.pc             = vm->pc;
+    header.conditionCodes = conditionCodesOf(vm);
+    header.bigEndian      = VM_MEMORY_BIG_ENDIAN;
+    memcpy(header.registers, vm->registers, sizeof(header.registers));
+    fwrite(&header, sizeof(header), 1, file);
+    vm_quad_t pageNumber = 0;
+    for (Page* page = nextPage(&vm->memory, &pageNumber); page != NULL; page = nextPage(&vm->memory, &pageNumber)) {
+        fwrite(&pageNumber, sizeof(pageNumber), 1, file);
+        fwrite(page->bytes, 1, PAGE_SIZE, file);
+        pageNumber++;
+    }
+}
+
+static void* flushTrace(void* argument) {
+    Trace* trace = argument;
+    while (true) {
+        uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load_explicit(&trace->stopping, memory_order_acquire) &&
+                atomic_load_explicit(&trace->head, memory_order_acquire) == tail) {
+                break;
+            }
+            struct timespec pause = { 0, 1000000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        /* Up to the end of the ring, the rest is written on the next round */
+        uint64_t first = tail & TRACE_RING_MASK;
+        uint64_t count = head - tail;
+        if (first + count > TRACE_RING_SIZE) {
+            count = TRACE_RING_SIZE - first;
+        }
+        fwrite(&trace->ring[first], sizeof(TraceRecord), count, trace->file);
+        atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+    }
+    fflush(trace->file);
+    return NULL;
+}
+
+bool startTrace(VM* vm, const char* path, TraceMode mode) {
+    stopTrace(vm);
+    Trace* trace = INIT_ARRAY(Trace, NULL, 1);
+    trace->ring     = INIT_ARRAY(TraceRecord, NULL, TRACE_RING_SIZE);
+    trace->mode     = mode;
+    trace->file     = NULL;
+    trace->flushing = false;
+    trace->path     = INIT_ARRAY(char, NULL, strlen(path) + 1);
+    strcpy(trace->path, path);
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stopping, false);
+    vm->cold->trace = trace;
+    if (mode == TRACE_STREAM) {
+        trace->file = fopen(path, "wb");
+        if (trace->file == NULL) {
+            CERO_ERROR("trace::start unable to write %s\n", path);
+            stopTrace(vm);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Called by runTraced before the first instruction, the header of a stream
+ * holds the state the program starts from rather than the one at startTrace */
+bool beginTrace(VM* vm) {
+    Trace* trace = vm->cold->trace;
+    if (trace->mode != TRACE_STREAM || trace->flushing) {
+        return true;
+    }
+    writeHeader(vm, trace->file, TRACE_STATE_BEFORE);
+    if (pthread_create(&trace->flusher, NULL, flushTrace, trace) != 0) {
+        CERO_ERROR("trace::begin unable to start the flush thread\n");
+        return false;
+    }
+    trace->flushing = true;
+    return true;
+}
+
+/* Writes the records still in the ring after the current state of the VM */
+bool dumpTrace(VM* vm) {
+    Trace* trace = vm->cold->trace;
+    if (trace == NULL || trace->mode != TRACE_FAULT) {
+        return false;
+    }
+    FILE* file = fopen(trace->path, "wb");
+    if (file == NULL) {
+        CERO_ERROR("trace::dump unable to write %s\n", trace->path);
+        return false;
+    }
+    writeHeader(vm, file, TRACE_STATE_AFTER);
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    for (uint64_t i = tail; i < head; ++i) {
+        fwrite(&trace->ring[i & TRACE_RING_MASK], sizeof(TraceRecord), 1, file);
+    }
+    bool written = !ferror(file);
+    fclose(file);
+    CERO_INFO("trace::dump %" PRIu64 " records to %s\n", head - tail, trace->path);
+    return written;
+}
+
+void stopTrace(VM* vm) {
+    Trace* trace = vm->cold->trace;
+    if (trace == NULL) {
+        return;
+    }
+    if (trace->flushing) {
+        atomic_store_explicit(&trace->stopping, true, memory_order_release);
+        pthread_join(trace->flusher, NULL);
+    }
+    if (trace->file != NULL) {
+        fclose(trace->file);
+    }
+    FREE_ARRAY(char, trace->path, strlen(trace->path) + 1);
+    FREE_ARRAY(TraceRecord, trace->ring, TRACE_RING_SIZE);
+    FREE_ARRAY(Trace, trace, 1);
+    vm->cold->trace = NULL;
+}
+
+TraceRecord* traceBegin(VM* vm, const Instruction* ins) {
+    Trace* trace = vm->cold->trace;
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        if (trace->mode == TRACE_FAULT) {
+            atomic_store_explicit(&trace->tail, head - TRACE_RING_SIZE + 1, memory_order_relaxed);
+        } else {
+            while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+                sched_yield();
+            }
+        }
+    }
+    TraceRecord* record = &trace->ring[head & TRACE_RING_MASK];
+    record->pc        = vm->pc;
+    record->operation = ins->operation;
+    record->ccOld     = conditionCodesOf(vm);
+    record->wrote     = 0;
+    switch (ins->operation) {
+        case OP_RRMOVQ: case OP_IRMOVQ:
+        case OP_ADDQ: case OP_SUBQ: case OP_ANDQ: case OP_XORQ:
+        case OP_CMOVLE: case OP_CMOVL: case OP_CMOVE: case OP_CMOVNE: case OP_CMOVGE: case OP_CMOVG:
+            record->reg = ins->rB;
+            break;
+        case OP_MRMOVQ: case OP_POPQ:
+            record->reg = ins->rA;
+            break;
+        default:
+            record->reg = REG_F;
+            break;
+    }
+    switch (ins->operation) {
+        case OP_RMMOVQ:
+            record->memAddr = (vm_quad_t)((uint64_t)vm->registers[ins->rB] + (uint64_t)ins->valC);
+            break;
+        case OP_PUSHQ: case OP_CALL:
+            record->memAddr = vm->registers[REG_RSP] - 8;
+            break;
+        default:
+            record->memAddr = -1;
+            break;
+    }
+    record->regOld = record->reg != REG_F ? vm->registers[record->reg] : 0;
+    record->memOld = addrInMem(vm, record->memAddr, 8) ? m8r(vm, record->memAddr) : 0;
+    return record;
+}
+
+void traceEnd(VM* vm, TraceRecord* record) {
+    Trace* trace = vm->cold->trace;
+    record->nextPc = vm->pc;
+    record->status = vm->statusCondition;
+    record->ccNew  = conditionCodesOf(vm);
+    record->regNew = record->reg != REG_F ? vm->registers[record->reg] : 0;
+    record->memNew = 0;
+    /* Faulting instructions do not change anything */
+    if (vm->statusCondition == STAT_AOK || vm->statusCondition == STAT_HLT) {
+        if (record->reg != REG_F) {
+            record->wrote |= TRACE_WROTE_REG;
+        }
+        if (addrInMem(vm, record->memAddr, 8)) {
+            record->wrote |= TRACE_WROTE_MEM;
+            record->memNew = m8r(vm, record->memAddr);
+        }
+        switch (record->operation) {
+            case OP_PUSHQ: case OP_POPQ: case OP_CALL: case OP_RET:
+                record->wrote |= TRACE_MOVED_RSP;
+                break;
+        }
+    }
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+    if (trace->mode == TRACE_FAULT && (vm->statusCondition == STAT_ADR || vm->statusCondition == STAT_INS)) {
+        dumpTrace(vm);
+    }
+}
+
+/* Replays a record onto the VM, or undoes it */
+void applyTraceRecord(VM* vm, const TraceRecord* record, bool forward) {
+    bool pop    = record->operation == OP_POPQ || record->operation == OP_RET;
+    vm_quad_t delta = pop ? 8 : -8;
+    if (forward) {
+        if (record->wrote & TRACE_MOVED_RSP) {
+            vm->registers[REG_RSP] += delta;
+        }
+        if (record->wrote & TRACE_WROTE_REG) {
+            vm->registers[record->reg] = record->regNew;
+        }
+        if (record->wrote & TRACE_WROTE_MEM) {
+            m8w(vm, record->memAddr, record->memNew);
+        }
+        vm->pc              = record->nextPc;
+        vm->statusCondition = (StatusCondition)record->status;
+        vm->conditionCodes  = record->ccNew;
+    } else {
+        if (record->wrote & TRACE_WROTE_MEM) {
+            m8w(vm, record->memAddr, record->memOld);
+        }
+        if (record->wrote & TRACE_WROTE_REG) {
+            vm->registers[record->reg] = record->regOld;
+        }
+        /* popq into RSP itself restored the previous RSP above */
+        if ((record->wrote & TRACE_MOVED_RSP) && !((record->wrote & TRACE_WROTE_REG) && record->reg == REG_RSP)) {
+            vm->registers[REG_RSP] -= delta;
+        }
+        vm->pc              = record->pc;
+        vm->statusCondition = STAT_AOK;
+        vm->conditionCodes  = record->ccOld;
+    }
+    vm->flags = FLAGS_EAGER;
+}
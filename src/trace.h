@@ -0,0 +1,75 @@
+#ifndef cero_trace_h
+#define cero_trace_h
+
+#include "common.h"
+#include "vm.h"
+
+/* Number of records the ring buffer holds, a power of two */
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE (1 << 16)
+#endif
+
+#define TRACE_MAGIC   "CEROTRC"
+#define TRACE_VERSION (3)
+
+/* Which parts of the VM the traced instruction changed */
+#define TRACE_WROTE_REG (0x01) /* reg was written                          */
+#define TRACE_WROTE_MEM (0x02) /* The quad at memAddr was written          */
+#define TRACE_MOVED_RSP (0x04) /* RSP was moved by pushq/popq/call/ret */
+
+typedef enum {
+    TRACE_STREAM, /* A background thread writes every record to the file   */
+    TRACE_FAULT   /* Only the last records are kept, written out on a fault */
+} TraceMode;
+
+/* The state of the VM stored in the header is the one before the first record
+ * for TRACE_STREAM files, and the one after the last record for TRACE_FAULT
+ * dumps. Both are followed by pageCount pages, each a vm_quad_t page number
+ * and PAGE_SIZE bytes, and then the records until EOF. */
+typedef enum {
+    TRACE_STATE_BEFORE,
+    TRACE_STATE_AFTER
+} TraceState;
+
+/* The effects of one instruction, with the previous values such that a trace
+ * can be replayed backwards from the state it was dumped at */
+typedef struct {
+    vm_quad_t pc;          /* PC of the instruction                */
+    vm_quad_t nextPc;      /* PC after it                          */
+    vm_quad_t regOld;      /* Value of reg before the instruction  */
+    vm_quad_t regNew;      /* Value of reg after it                */
+    vm_quad_t memAddr;     /* Address of the quad written          */
+    vm_quad_t memOld;      /* The quad at memAddr before           */
+    vm_quad_t memNew;      /* The quad at memAddr after            */
+    vm_ubyte_t operation;  /* The Operation (never a fusion)       */
+    vm_ubyte_t reg;        /* The register written, REG_F if none  */
+    vm_ubyte_t ccOld;      /* Condition codes before               */
+    vm_ubyte_t ccNew;      /* Condition codes after                */
+    vm_ubyte_t status;     /* StatusCondition after                */
+    vm_ubyte_t wrote;      /* TRACE_WROTE_X                        */
+    vm_ubyte_t padding[2];
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t state;        /* TraceState                           */
+    uint32_t status;       /* StatusCondition                      */
+    vm_quad_t pageCount;   /* Pages of memory after the header     */
+    vm_quad_t pc;
+    vm_quad_t registers[REG_COUNT];
+    vm_ubyte_t conditionCodes;
+    vm_ubyte_t bigEndian;  /* Whether the pages hold big-endian quads */
+    vm_ubyte_t padding[6];
+} TraceHeader;
+
+bool startTrace(VM* vm, const char* path, TraceMode mode);
+bool beginTrace(VM* vm);
+bool dumpTrace(VM* vm);
+void stopTrace(VM* vm);
+TraceRecord* traceBegin(VM* vm, const Instruction* ins);
+void traceEnd(VM* vm, TraceRecord* record);
+void applyTraceRecord(VM* vm, const TraceRecord* record, bool forward);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "vm.h"
+#include "memory.h"
+#include "printer.h"
+#include "trace.h"
+
+/* Replays the record onto the VM and prints the VM after it */
+static void printRecord(VM* vm, const TraceRecord* record) {
+    CERO_DEBUG("0x%04" PRIx64 " %s\n", record->pc, operationName((Operation)record->operation));
+    applyTraceRecord(vm, record, true);
+    printMemory(vm);
+    printRegisters(vm);
+    printStack(vm);
+    printFlagsAndStatusAndPc(vm);
+}
+
+/* Renders a binary trace written by trace.c the way the tracing build prints
+ * the VM after every step. Built with every log level compiled in (make tracedump) */
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        CERO_FATAL("Usage: tracedump FILE\n");
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        CERO_FATAL("Unable to read '%s'\n", argv[1]);
+        return 1;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord) ||
+        header.bigEndian != VM_MEMORY_BIG_ENDIAN) {
+        CERO_FATAL("'%s' is not a trace of this VM\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    VM vm;
+    initVM(&vm);
+    vm_ubyte_t bytes[PAGE_SIZE];
+    for (vm_quad_t i = 0; i < header.pageCount; ++i) {
+        vm_quad_t pageNumber;
+        if (fread(&pageNumber, sizeof(pageNumber), 1, file) != 1 || fread(bytes, 1, PAGE_SIZE, file) != PAGE_SIZE ||
+            pageNumber < 0 || pageNumber >= VM_ADDRESS_LIMIT / PAGE_SIZE) {
+            CERO_FATAL("'%s' is truncated\n", argv[1]);
+            fclose(file);
+            freeVM(&vm);
+            return 1;
+        }
+        copyToMemory(&vm, pageNumber * PAGE_SIZE, bytes, PAGE_SIZE);
+    }
+    memcpy(vm.registers, header.registers, sizeof(header.registers));
+    vm.pc              = header.pc;
+    vm.statusCondition = (StatusCondition)header.status;
+    vm.conditionCodes  = header.conditionCodes;
+
+    /* Streams are read a record at a time whatever their length. Dumps hold
+     * the state after their last record, at most TRACE_RING_SIZE of them are
+     * read first and the state is rewound to the first one */
+    if (header.state == TRACE_STATE_BEFORE) {
+        TraceRecord record;
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+            printRecord(&vm, &record);
+        }
+        fclose(file);
+        freeVM(&vm);
+        return 0;
+    }
+    TraceRecord* records = INIT_ARRAY(TraceRecord, NULL, TRACE_RING_SIZE + 1);
+    uint32_t count       = (uint32_t)fread(records, sizeof(TraceRecord), TRACE_RING_SIZE + 1, file);
+    fclose(file);
+    if (count > TRACE_RING_SIZE) {
+        CERO_FATAL("'%s' holds more records than a dump\n", argv[1]);
+        FREE_ARRAY(TraceRecord, records, TRACE_RING_SIZE + 1);
+        freeVM(&vm);
+        return 1;
+    }
+    for (uint32_t i = count; i > 0; --i) {
+        applyTraceRecord(&vm, &records[i - 1], false);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        printRecord(&vm, &records[i]);
+    }
+
+    FREE_ARRAY(TraceRecord, records, TRACE_RING_SIZE + 1);
+    freeVM(&vm);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef cero_value_h
 #define cero_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef uint8_t vm_ubyte_t;
@@ -9,4 +11,33 @@ typedef int16_t vm_word_t;
 typedef int32_t vm_double_t;
 typedef int64_t vm_quad_t;
 
+/* Quads are stored little-endian in guest memory and in encoded instructions,
+ * as on Y86-64. VM_BIG_ENDIAN_MEMORY selects the big-endian layout instead.
+ * Either way a quad is moved with one unaligned host load or store, swapped
+ * when the host has the other byte order. */
+#if defined(VM_BIG_ENDIAN_MEMORY)
+#define VM_MEMORY_BIG_ENDIAN (1)
+#define VM_MEMORY_SWAPPED    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#else
+#define VM_MEMORY_BIG_ENDIAN (0)
+#define VM_MEMORY_SWAPPED    (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#endif
+
+static inline vm_quad_t loadQuad(const vm_ubyte_t* bytes) {
+    uint64_t quad;
+    memcpy(&quad, bytes, sizeof(quad));
+#if VM_MEMORY_SWAPPED
+    quad = __builtin_bswap64(quad);
+#endif
+    return (vm_quad_t)quad;
+}
+
+static inline void storeQuad(vm_ubyte_t* bytes, vm_quad_t quad) {
+    uint64_t value = (uint64_t)quad;
+#if VM_MEMORY_SWAPPED
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
 #endif
\ No newline at end of file
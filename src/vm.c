@@ -1,80 +1,587 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <math.h>
+#include <string.h>
+#include <strings.h>
 
 #include "common.h"
 #include "vm.h"
 #include "memory.h"
 #include "writer.h"
 #include "printer.h"
+#include "jit.h"
+#include "aot.h"
+#include "trace.h"
+#include "profile.h"
+#include "counters.h"
+#include "metrics.h"
 
 void initVM(VM* vm) {
-    vm->registers = NULL;
-    vm->memory    = NULL;
-    vm->registers = INIT_ARRAY(vm_quad_t, vm->registers, REG_COUNT);
-    vm->memory    = INIT_ARRAY(vm_byte_t, vm->memory, MEM_MAX);
-    vm->pc        = 0;
-    vm->registers[REG_RBP] = MEM_MAX;
+    vm->cold        = INIT_ARRAY(VMCold, NULL, 1);
+    vm->cold->jit   = NULL;
+    vm->cold->aot   = NULL;
+    vm->cold->trace   = NULL;
+    vm->cold->profile = NULL;
+    vm->cold->counters = NULL;
+    vm->cold->metrics  = NULL;
+    initAddressSpace(&vm->memory);
+    resetVM(vm);
+}
+
+void freeVM(VM* vm) {
+    freeJit(vm);
+    freeAot(vm);
+    stopTrace(vm);
+    stopProfile(vm);
+    stopCounters(vm);
+    stopMetrics(vm);
+    freeAddressSpace(&vm->memory);
+    FREE_ARRAY(VMCold, vm->cold, 1);
+    vm->cold         = NULL;
+    vm->fetchPage    = -1;
+    vm->fetchDecoded = NULL;
+    vm->fetchEntry   = NULL;
+}
+
+/* Empties the memory of the VM for another image, along with everything that
+ * was derived from the previous one: decoded instructions, translations of the
+ * JIT (discarded) and of the AOT engine (closed), and mapped files */
+void resetMemory(VM* vm) {
+    resetJit(vm);
+    freeAot(vm);
+    resetAddressSpace(&vm->memory);
+    vm->fetchPage    = -1;
+    vm->fetchDecoded = NULL;
+    vm->fetchEntry   = NULL;
+}
+
+/* Brings the architectural state and the memory of a VM back to what initVM
+ * leaves them in without allocating. Only the pages the previous runs wrote are
+ * cleared, see resetAddressSpace. A trace, a profile, host counters or metrics
+ * keep observing the VM, freeVM and releaseVM close them */
+void resetVM(VM* vm) {
+    resetMemory(vm);
+    memset(vm->registers, 0, sizeof(vm->registers));
+    vm->registers[REG_RBP] = VM_STACK_TOP;
     vm->registers[REG_RSP] = vm->registers[REG_RBP];
+    vm->pc                 = 0;
     vm->statusCondition    = STAT_AOK;
+    vm->conditionCodes     = 0;
+    vm->flags              = FLAGS_EAGER;
+    vm->flagsA             = 0;
+    vm->flagsB             = 0;
+    vm->flagsE             = 0;
+    vm->cold->engine       = VM_DEFAULT_ENGINE;
+    vm->cold->fusion       = true;
+    vm->cold->guard        = NULL;
+#ifdef VM_FUSION_STATS
+    memset(vm->cold->executed, 0, sizeof(vm->cold->executed));
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    vm->cold->steps         = 0;
+    vm->cold->fullDumpEvery = TRACE_FULL_DUMP_EVERY;
+    clearDirty(vm);
+#endif
 }
 
-void freeVM(VM* vm) {
+/* -----Snapshots-----
+ * A snapshot holds the state of a VM and maps the pages of its memory, sharing
+ * their frames copy-on-write (see shareAddressSpace). Taking one or forking a
+ * VM from one only allocates page tables, every VM then copies a page the
+ * first time it writes to it. Decode caches are shared along with the frames,
+ * translations are not: forked VMs translate the code they run again. */
+void snapshotVM(VM* vm, VMSnapshot* snapshot) {
+    memcpy(snapshot->registers, vm->registers, sizeof(snapshot->registers));
+    snapshot->pc              = vm->pc;
+    snapshot->flagsA          = vm->flagsA;
+    snapshot->flagsB          = vm->flagsB;
+    snapshot->flagsE          = vm->flagsE;
+    snapshot->flags           = vm->flags;
+    snapshot->statusCondition = vm->statusCondition;
+    snapshot->conditionCodes  = vm->conditionCodes;
+    snapshot->engine          = vm->cold->engine;
+    snapshot->fusion          = vm->cold->fusion;
+    initAddressSpace(&snapshot->memory);
+    shareAddressSpace(&snapshot->memory, &vm->memory);
+}
+
+/* Releases the frames of the snapshot, VMs forked from it keep theirs */
+void freeSnapshot(VMSnapshot* snapshot) {
+    freeAddressSpace(&snapshot->memory);
+}
+
+/* Replaces the state of an initialised VM with that of the snapshot. The pages
+ * of a VM that ran before (a pooled one for instance) are reused, its trace,
+ * profile, counters and metrics go on observing it */
+void forkVM(VMSnapshot* snapshot, VM* vm) {
+    resetVM(vm);
+    shareAddressSpace(&vm->memory, &snapshot->memory);
+    memcpy(vm->registers, snapshot->registers, sizeof(vm->registers));
+    vm->pc               = snapshot->pc;
+    vm->flagsA           = snapshot->flagsA;
+    vm->flagsB           = snapshot->flagsB;
+    vm->flagsE           = snapshot->flagsE;
+    vm->flags            = snapshot->flags;
+    vm->statusCondition  = snapshot->statusCondition;
+    vm->conditionCodes   = snapshot->conditionCodes;
+    vm->cold->engine     = snapshot->engine;
+    vm->cold->fusion     = snapshot->fusion;
+}
+
+/* -----Dirty tracking-----
+ * Only the tracing build records writes, everywhere else the marks compile to
+ * nothing. Registers and condition codes are marked by the handlers writing
+ * them, memory by m1w and m8w. */
+#ifdef DEBUG_TRACE_EXECUTION
+#define MARK_REGISTER_DIRTY(vm, r) ((vm)->cold->dirtyRegisters |= 1u << (r))
+#define MARK_FLAGS_DIRTY(vm)       ((vm)->cold->dirtyFlags = true)
 
+static void markMemoryDirty(VM* vm, vm_quad_t offset, vm_quad_t length) {
+    vm_quad_t first = offset & ~(vm_quad_t)(DIRTY_GRANULE - 1);
+    for (vm_quad_t granule = first; granule < offset + length; granule += DIRTY_GRANULE) {
+        bool known = false;
+        for (uint32_t i = 0; i < vm->cold->dirtyMemoryCount && i < DIRTY_MEMORY_MAX; ++i) {
+            known |= vm->cold->dirtyMemory[i] == granule;
+        }
+        if (known) {
+            continue;
+        }
+        if (vm->cold->dirtyMemoryCount < DIRTY_MEMORY_MAX) {
+            vm->cold->dirtyMemory[vm->cold->dirtyMemoryCount] = granule;
+        }
+        vm->cold->dirtyMemoryCount++;
+    }
+}
+#define MARK_MEMORY_DIRTY(vm, offset, length) markMemoryDirty(vm, offset, length)
+#else
+#define MARK_REGISTER_DIRTY(vm, r)            ((void)0)
+#define MARK_FLAGS_DIRTY(vm)                  ((void)0)
+#define MARK_MEMORY_DIRTY(vm, offset, length) ((void)0)
+#endif
+
+void clearDirty(VM* vm) {
+#ifdef DEBUG_TRACE_EXECUTION
+    vm->cold->dirtyRegisters   = 0;
+    vm->cold->dirtyFlags       = false;
+    vm->cold->dirtyMemoryCount = 0;
+#endif
 }
 
 bool inline zf(VM* vm) {
+    if (vm->flags != FLAGS_EAGER) {
+        return vm->flagsE == 0;
+    }
     return (vm->conditionCodes & 0b0001) >> CC_ZF;
 }
 
 bool inline sf(VM* vm) {
+    if (vm->flags != FLAGS_EAGER) {
+        return vm->flagsE < 0;
+    }
     return (vm->conditionCodes & 0b0010) >> CC_SF;
 }
 
 bool inline of(VM* vm) {
-    return (vm->conditionCodes & 0b0100) >> CC_OF;
+    vm_quad_t valA = vm->flagsA;
+    vm_quad_t valB = vm->flagsB;
+    switch (vm->flags) {
+        case FLAGS_ADD:   return (valA > 0 && valB > INT64_MAX - valA) || (valA < 0 && valB < INT64_MIN - valA);
+        case FLAGS_SUB:   return (valA < 0 && valB > INT64_MAX + valA) || (valA > 0 && valB < INT64_MIN + valA);
+        case FLAGS_LOGIC: return false;
+        default:          return (vm->conditionCodes & 0b0100) >> CC_OF;
+    }
+}
+
+/* Rebuilds the conditionCodes byte for anything reading it directly */
+void syncConditionCodes(VM* vm) {
+    if (vm->flags != FLAGS_EAGER) {
+        vm->conditionCodes = zf(vm) << CC_ZF | sf(vm) << CC_SF | of(vm) << CC_OF;
+        vm->flags          = FLAGS_EAGER;
+    }
+}
+
+bool inline addrInMem(VM* vm, vm_quad_t addr, vm_quad_t length) {
+    return addr >= 0 && addr <= VM_ADDRESS_LIMIT - length;
 }
 
-static bool inline addrInHighMem(VM* vm, vm_quad_t addr) {
-    vm_quad_t rsp = vm->registers[REG_RSP];
-    return addr >= rsp;
+/* -----Memory accesses-----
+ * The page of an address is looked up in the TLB of the access first, and
+ * the page table only walked on a miss (see paging.c). Quads crossing the end
+ * of a page are accessed a byte at a time.
+ *
+ * There is no bounds check on the fast path: addresses outside of the address
+ * space never hit in a TLB, and the miss jumps to the guard run() armed, which
+ * stops the VM with STAT_ADR. Handlers update the registers and the PC after
+ * their memory accesses, so the PC is left at the faulting instruction and
+ * nothing it would have written is. Outside of run() such reads return zeros
+ * and such writes are dropped. */
+static const vm_ubyte_t outsideBytes[PAGE_SIZE];
+static vm_ubyte_t droppedBytes[PAGE_SIZE];
+static Page droppedPage = { .bytes = droppedBytes };
+
+static void memoryFault(VM* vm) {
+    if (vm->cold->guard != NULL) {
+        longjmp(*vm->cold->guard, 1);
+    }
+}
+
+static vm_ubyte_t* readMiss(VM* vm, vm_quad_t pageNumber) {
+    vm_ubyte_t* bytes = fillReadTlb(&vm->memory, pageNumber);
+    if (bytes == NULL) {
+        memoryFault(vm);
+        return (vm_ubyte_t*)outsideBytes;
+    }
+    return bytes;
+}
+
+static Page* writeMiss(VM* vm, vm_quad_t pageNumber) {
+    Page* page = fillWriteTlb(&vm->memory, pageNumber);
+    if (page == NULL) {
+        memoryFault(vm);
+        return &droppedPage;
+    }
+    /* A shared frame was copied, the decode cache fetched from is its */
+    if (page == vm->fetchEntry) {
+        vm->fetchPage = -1;
+    }
+    return page;
+}
+
+static inline vm_ubyte_t* readable(VM* vm, vm_quad_t offset) {
+    vm_quad_t pageNumber = offset >> PAGE_BITS;
+    TlbEntry* entry      = &vm->memory.readTlb[pageNumber & (TLB_SIZE - 1)];
+    vm_ubyte_t* bytes    = entry->tag == pageNumber ? entry->bytes : readMiss(vm, pageNumber);
+    return bytes + (offset & PAGE_MASK);
 }
 
-static bool inline addrInLowMem(VM* vm, vm_quad_t addr) {
-    vm_quad_t rsp = vm->registers[REG_RSP];
-    return addr < rsp;
+static inline Page* writable(VM* vm, vm_quad_t offset) {
+    vm_quad_t pageNumber = offset >> PAGE_BITS;
+    TlbEntry* entry      = &vm->memory.writeTlb[pageNumber & (TLB_SIZE - 1)];
+    return entry->tag == pageNumber ? entry->page : writeMiss(vm, pageNumber);
 }
 
 vm_ubyte_t inline m1r(VM* vm, vm_quad_t offset) {
-    return vm->memory[offset];
+    return *readable(vm, offset);
 }
 
 vm_quad_t inline m8r(VM* vm, vm_quad_t offset) {
-    vm_quad_t quad = 0;
-    quad |= m1r(vm, offset + 0); quad <<= 8;
-    quad |= m1r(vm, offset + 1); quad <<= 8;
-    quad |= m1r(vm, offset + 2); quad <<= 8;
-    quad |= m1r(vm, offset + 3); quad <<= 8;
-    quad |= m1r(vm, offset + 4); quad <<= 8;
-    quad |= m1r(vm, offset + 5); quad <<= 8;
-    quad |= m1r(vm, offset + 6); quad <<= 8;
-    quad |= m1r(vm, offset + 7); quad <<= 0;
-    return quad;
+    if ((offset & PAGE_MASK) > PAGE_SIZE - 8) {
+        vm_ubyte_t bytes[8];
+        for (vm_quad_t i = 0; i < 8; ++i) {
+            bytes[i] = m1r(vm, offset + i);
+        }
+        return loadQuad(bytes);
+    }
+    return loadQuad(readable(vm, offset));
 }
 
 vm_ubyte_t m1w(VM* vm, vm_quad_t offset, vm_ubyte_t byte) {
-    vm->memory[offset] = byte;
+    Page* page = writable(vm, offset);
+    page->bytes[offset & PAGE_MASK] = byte;
+    if (page->code) {
+        invalidateDecoded(vm, offset, 1);
+    }
+    MARK_MEMORY_DIRTY(vm, offset, 1);
+    return byte;
 }
 
 vm_quad_t m8w(VM* vm, vm_quad_t offset, vm_quad_t quad) {
-    m1w(vm, offset + 7, (quad >>  0) & 0xFF);
-    m1w(vm, offset + 6, (quad >>  8) & 0xFF);
-    m1w(vm, offset + 5, (quad >> 16) & 0xFF);
-    m1w(vm, offset + 4, (quad >> 24) & 0xFF);
-    m1w(vm, offset + 3, (quad >> 32) & 0xFF);
-    m1w(vm, offset + 2, (quad >> 40) & 0xFF);
-    m1w(vm, offset + 1, (quad >> 48) & 0xFF);
-    m1w(vm, offset + 0, (quad >> 56) & 0xFF);
+    if ((offset & PAGE_MASK) > PAGE_SIZE - 8) {
+        /* Faults on the second page before anything was written to the first */
+        writable(vm, offset + 7);
+        vm_ubyte_t bytes[8];
+        storeQuad(bytes, quad);
+        for (vm_quad_t i = 0; i < 8; ++i) {
+            m1w(vm, offset + i, bytes[i]);
+        }
+        return quad;
+    }
+    Page* page = writable(vm, offset);
+    storeQuad(page->bytes + (offset & PAGE_MASK), quad);
+    if (page->code) {
+        invalidateDecoded(vm, offset, 8);
+    }
+    MARK_MEMORY_DIRTY(vm, offset, 8);
+    return quad;
+}
+
+/* Writes a host buffer (a program, an image) into guest memory a page at a time */
+void copyToMemory(VM* vm, vm_quad_t offset, const vm_ubyte_t* bytes, vm_quad_t length) {
+    while (length > 0) {
+        vm_quad_t chunk = PAGE_SIZE - (offset & PAGE_MASK);
+        if (chunk > length) {
+            chunk = length;
+        }
+        Page* page = writable(vm, offset);
+        memcpy(page->bytes + (offset & PAGE_MASK), bytes, chunk);
+        if (page->code) {
+            invalidateDecoded(vm, offset, chunk);
+        }
+        MARK_MEMORY_DIRTY(vm, offset, chunk);
+        offset += chunk;
+        bytes  += chunk;
+        length -= chunk;
+    }
+}
+
+/* -----Decode cache-----
+ * Every byte of a page code is fetched from has an Instruction entry in the
+ * decode cache of its frame, allocated with the first fetch from the page.
+ * The first time the PC reaches an address the bytes there are decoded
+ * into the entry, and from then on the fetch stage only reads the entry.
+ * The operation of an entry is what was decoded from the bytes, the handler is
+ * what executes it which can be a superinstruction (see below).
+ *
+ * Pages sharing a frame share its decode cache, so forks of a snapshot decode
+ * the code they run once between them. An entry therefore only depends on the
+ * bytes of its frame: instructions running into the next page are decoded
+ * into vm->cold->straddling on every fetch instead, and sequences running into
+ * it are not fused. Whether entries are fused is decided by the VM decoding
+ * them first.
+ *
+ * An entry stays valid until one of the bytes it was decoded from is written.
+ * Writes through m1w/m8w to a page marked as code therefore reset the entries
+ * that overlap the written bytes, which are the ones starting at most
+ * FUSION_MAX_SPAN - 1 bytes before it. Writes only reach frames the page owns,
+ * a shared one is copied first and the copy starts with an empty cache.
+ * Instructions running into the next page mark that one as code as well, for
+ * the translations of the JIT.
+ */
+static void decode(VM* vm, vm_quad_t pc, Instruction* ins) {
+    vm_ubyte_t insFun = m1r(vm, pc);
+    vm_ubyte_t length;
+    switch (insFun) {
+        case INS_HALT:   ins->operation = OP_HALT;   length =  1; break;
+        case INS_NOP:    ins->operation = OP_NOP;    length =  1; break;
+        case INS_RRMOVQ: ins->operation = OP_RRMOVQ; length =  2; break;
+        case INS_IRMOVQ: ins->operation = OP_IRMOVQ; length = 10; break;
+        case INS_RMMOVQ: ins->operation = OP_RMMOVQ; length = 10; break;
+        case INS_MRMOVQ: ins->operation = OP_MRMOVQ; length = 10; break;
+        case INS_ADDQ:   ins->operation = OP_ADDQ;   length =  2; break;
+        case INS_SUBQ:   ins->operation = OP_SUBQ;   length =  2; break;
+        case INS_ANDQ:   ins->operation = OP_ANDQ;   length =  2; break;
+        case INS_XORQ:   ins->operation = OP_XORQ;   length =  2; break;
+        case INS_JMP:    ins->operation = OP_JMP;    length =  9; break;
+        case INS_JLE:    ins->operation = OP_JLE;    length =  9; break;
+        case INS_JL:     ins->operation = OP_JL;     length =  9; break;
+        case INS_JE:     ins->operation = OP_JE;     length =  9; break;
+        case INS_JNE:    ins->operation = OP_JNE;    length =  9; break;
+        case INS_JGE:    ins->operation = OP_JGE;    length =  9; break;
+        case INS_JG:     ins->operation = OP_JG;     length =  9; break;
+        case INS_CMOVLE: ins->operation = OP_CMOVLE; length =  2; break;
+        case INS_CMOVL:  ins->operation = OP_CMOVL;  length =  2; break;
+        case INS_CMOVE:  ins->operation = OP_CMOVE;  length =  2; break;
+        case INS_CMOVNE: ins->operation = OP_CMOVNE; length =  2; break;
+        case INS_CMOVGE: ins->operation = OP_CMOVGE; length =  2; break;
+        case INS_CMOVG:  ins->operation = OP_CMOVG;  length =  2; break;
+        case INS_CALL:   ins->operation = OP_CALL;   length =  9; break;
+        case INS_RET:    ins->operation = OP_RET;    length =  1; break;
+        case INS_PUSHQ:  ins->operation = OP_PUSHQ;  length =  2; break;
+        case INS_POPQ:   ins->operation = OP_POPQ;   length =  2; break;
+        default:         ins->operation = OP_INVALID; length = 1; break;
+    }
+    ins->rA     = REG_F;
+    ins->rB     = REG_F;
+    ins->valC   = 0;
+    ins->length = length;
+    ins->span   = length;
+    ins->valP   = pc + length;
+    if (!addrInMem(vm, pc, length)) {
+        ins->operation = OP_BAD_FETCH;
+        return;
+    }
+    if ((pc & PAGE_MASK) + length > PAGE_SIZE) {
+        findPage(&vm->memory, (pc >> PAGE_BITS) + 1, true)->code = true;
+    }
+    switch (length) {
+        case 2:
+            ins->rA   = REG_SPEC_DEC_RA(m1r(vm, pc + 1));
+            ins->rB   = REG_SPEC_DEC_RB(m1r(vm, pc + 1));
+            break;
+        case 9:
+            ins->valC = m8r(vm, pc + 1);
+            break;
+        case 10:
+            ins->rA   = REG_SPEC_DEC_RA(m1r(vm, pc + 1));
+            ins->rB   = REG_SPEC_DEC_RB(m1r(vm, pc + 1));
+            ins->valC = m8r(vm, pc + 2);
+            break;
+    }
+}
+
+/* Grows the range of entries resetAddressSpace clears */
+static void markDecoded(Frame* frame, vm_quad_t offset) {
+    if (frame->decodedEnd == frame->decodedFirst) {
+        frame->decodedFirst = offset;
+        frame->decodedEnd   = offset + 1;
+    } else if (offset < frame->decodedFirst) {
+        frame->decodedFirst = offset;
+    } else if (offset >= frame->decodedEnd) {
+        frame->decodedEnd = offset + 1;
+    }
+}
+
+/* Returns the decoded entry at pc without fusing it, or NULL outside the memory */
+static Instruction* decoded(VM* vm, vm_quad_t pc) {
+    if (!addrInMem(vm, pc, 1)) {
+        return NULL;
+    }
+    vm_quad_t pageNumber = pc >> PAGE_BITS;
+    if (pageNumber != vm->fetchPage) {
+        Page* page   = findPage(&vm->memory, pageNumber, true);
+        Frame* frame = codeFrame(&vm->memory, page, pageNumber);
+        if (frame->decoded == NULL) {
+            frame->decoded = INIT_ARRAY(Instruction, NULL, PAGE_SIZE);
+        }
+        page->code       = true;
+        vm->fetchPage    = pageNumber;
+        vm->fetchDecoded = frame->decoded;
+        vm->fetchEntry   = page;
+    }
+    Instruction* ins = &vm->fetchDecoded[pc & PAGE_MASK];
+    if (ins->operation == OP_UNDECODED) {
+        decode(vm, pc, ins);
+        if ((pc & PAGE_MASK) + ins->length > PAGE_SIZE) {
+            vm->cold->straddling = *ins;
+            ins->handler   = OP_UNDECODED;
+            ins->operation = OP_UNDECODED;
+            return &vm->cold->straddling;
+        }
+        markDecoded(vm->fetchEntry->frame, pc & PAGE_MASK);
+    }
+    return ins;
+}
+
+/* -----Superinstructions-----
+ * When an instruction is about to be executed for the first time the
+ * instructions following it are matched against the patterns below. On a match
+ * its handler is replaced by the fusion, which executes the whole sequence in
+ * one dispatch by calling the handlers of the instructions in turn. Once inlined
+ * the PC updates in between are dead stores the compiler removes, and the flags
+ * a subq writes are forwarded straight into the condition of the jXX.
+ * 
+ * The instructions following the first one keep their own entries such that
+ * jumping into the middle of a sequence executes them unfused. Their entries are
+ * decoded with the handler left UNDECODED, they are fused once fetched themselves.
+ * The span of the first entry covers the bytes of the whole sequence, so a write
+ * to any of them resets it.
+ * 
+ * Patterns are tried in order, hence the triples must come before their pairs.
+ */
+typedef struct {
+    Operation first;
+    Operation second;
+    Operation third;  /* OP_UNDECODED for pairs */
+    Operation fusion;
+} FusionPattern;
+
+static const FusionPattern fusionPatterns[] = {
+    { OP_IRMOVQ, OP_SUBQ,  OP_JLE,       OP_IRMOVQ_SUBQ_JLE },
+    { OP_IRMOVQ, OP_SUBQ,  OP_JL,        OP_IRMOVQ_SUBQ_JL  },
+    { OP_IRMOVQ, OP_SUBQ,  OP_JE,        OP_IRMOVQ_SUBQ_JE  },
+    { OP_IRMOVQ, OP_SUBQ,  OP_JNE,       OP_IRMOVQ_SUBQ_JNE },
+    { OP_IRMOVQ, OP_SUBQ,  OP_JGE,       OP_IRMOVQ_SUBQ_JGE },
+    { OP_IRMOVQ, OP_SUBQ,  OP_JG,        OP_IRMOVQ_SUBQ_JG  },
+    { OP_SUBQ,   OP_JLE,   OP_UNDECODED, OP_SUBQ_JLE        },
+    { OP_SUBQ,   OP_JL,    OP_UNDECODED, OP_SUBQ_JL         },
+    { OP_SUBQ,   OP_JE,    OP_UNDECODED, OP_SUBQ_JE         },
+    { OP_SUBQ,   OP_JNE,   OP_UNDECODED, OP_SUBQ_JNE        },
+    { OP_SUBQ,   OP_JGE,   OP_UNDECODED, OP_SUBQ_JGE        },
+    { OP_SUBQ,   OP_JG,    OP_UNDECODED, OP_SUBQ_JG         },
+    { OP_IRMOVQ, OP_ADDQ,  OP_UNDECODED, OP_IRMOVQ_ADDQ     },
+    { OP_MRMOVQ, OP_ADDQ,  OP_UNDECODED, OP_MRMOVQ_ADDQ     },
+    { OP_PUSHQ,  OP_CALL,  OP_UNDECODED, OP_PUSHQ_CALL      },
+    { OP_POPQ,   OP_RET,   OP_UNDECODED, OP_POPQ_RET        },
+};
+
+#define FUSION_PATTERN_COUNT (sizeof(fusionPatterns) / sizeof(fusionPatterns[0]))
+
+Operation fusionLeader(Operation fusion, vm_quad_t* length) {
+    for (size_t i = 0; i < FUSION_PATTERN_COUNT; ++i) {
+        if (fusionPatterns[i].fusion == fusion) {
+            *length = fusionPatterns[i].third == OP_UNDECODED ? 2 : 3;
+            return fusionPatterns[i].first;
+        }
+    }
+    *length = 1;
+    return OP_UNDECODED;
+}
+
+static void fuse(VM* vm, vm_quad_t pc, Instruction* ins) {
+    ins->handler = ins->operation;
+    ins->span    = ins->length;
+    if (!vm->cold->fusion) {
+        return;
+    }
+    /* The fusions find the instructions following the first one by indexing
+     * the decode cache, so all of them have to start on the same page */
+    vm_quad_t pageNumber = pc >> PAGE_BITS;
+    if (ins->valP >> PAGE_BITS != pageNumber) {
+        return;
+    }
+    vm_quad_t room = PAGE_SIZE - (pc & PAGE_MASK);
+    Instruction* second = decoded(vm, ins->valP);
+    if (second == NULL || second->operation == OP_BAD_FETCH) {
+        return;
+    }
+    Instruction* third = second->valP >> PAGE_BITS == pageNumber ? decoded(vm, second->valP) : NULL;
+    for (size_t i = 0; i < FUSION_PATTERN_COUNT; ++i) {
+        const FusionPattern* pattern = &fusionPatterns[i];
+        if (pattern->first != ins->operation || pattern->second != second->operation) {
+            continue;
+        }
+        if (pattern->third == OP_UNDECODED) {
+            if (ins->length + second->length > room) {
+                return;
+            }
+            ins->handler = pattern->fusion;
+            ins->span    = ins->length + second->length;
+            return;
+        }
+        if (third != NULL && pattern->third == third->operation && ins->length + second->length + third->length <= room) {
+            ins->handler = pattern->fusion;
+            ins->span    = ins->length + second->length + third->length;
+            return;
+        }
+    }
+}
+
+Instruction* fetch(VM* vm, vm_quad_t pc) {
+    static Instruction badFetch = { OP_BAD_FETCH, OP_BAD_FETCH, REG_F, REG_F, 0, 0, 0, 0 };
+    Instruction* ins = decoded(vm, pc);
+    if (ins == NULL) {
+        return &badFetch;
+    }
+    if (ins->handler == OP_UNDECODED) {
+        fuse(vm, pc, ins);
+    }
+    return ins;
+}
+
+void invalidateDecoded(VM* vm, vm_quad_t offset, vm_quad_t length) {
+    vm_quad_t first = offset - (FUSION_MAX_SPAN - 1);
+    if (first < 0) {
+        first = 0;
+    }
+    Page* page           = NULL;
+    vm_quad_t pageNumber = -1;
+    for (vm_quad_t pc = first; pc < offset + length; ++pc) {
+        if (pc >> PAGE_BITS != pageNumber) {
+            pageNumber = pc >> PAGE_BITS;
+            page       = findPage(&vm->memory, pageNumber, false);
+        }
+        if (page == NULL || page->frame == NULL || page->frame->decoded == NULL) {
+            continue;
+        }
+        Instruction* ins = &page->frame->decoded[pc & PAGE_MASK];
+        if (ins->operation != OP_UNDECODED && pc + ins->span > offset) {
+            ins->handler   = OP_UNDECODED;
+            ins->operation = OP_UNDECODED;
+        }
+    }
+    if (vm->cold->jit != NULL) {
+        jitInvalidate(vm, offset, length);
+    }
 }
 
 /* -----Information about standards-----
@@ -95,10 +602,10 @@ vm_quad_t m8w(VM* vm, vm_quad_t offset, vm_quad_t quad) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  00                              */
-static inline void halt(VM* vm) {
+static inline void halt(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::halt\n");
     /* Fetch      */
-    vm_quad_t valP = vm->pc + 1;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     /* Execute    */
     /* Memory     */
@@ -110,10 +617,10 @@ static inline void halt(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  10                              */
-static inline void nop(VM* vm) {
+static inline void nop(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::nop\n");
     /* Fetch      */
-    vm_quad_t valP = vm->pc + 1;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     /* Execute    */
     /* Memory     */
@@ -124,64 +631,60 @@ static inline void nop(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  20 AB                           */
-static inline void rrmovq(VM* vm) {
+static inline void rrmovq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::rrmovq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP  = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
-    vm_quad_t valB  = vm->registers[rB];
+    vm_quad_t valA  = vm->registers[rA];
     /* Execute    */
+    vm_quad_t valE  = valA;
     /* Memory     */
     /* Write back */
-    vm->registers[rA] = valB;
+    vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  30 FB -----------V-----------   */
-static inline void irmovq(VM* vm) {
+static inline void irmovq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::irmovq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valC  = m8r(vm, vm->pc + 2);
-    vm_quad_t valP  = vm->pc + 10;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     vm_quad_t valE = valC;
     /* Memory     */
     /* Write back */
     vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  40 AB -----------D-----------   */
-static inline void rmmovq(VM* vm) {
+static inline void rmmovq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::rmmovq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valC  = m8r(vm, vm->pc + 2);
-    vm_quad_t valP  = vm->pc + 10;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
-    vm_quad_t valE  = valA + valC;
+    vm_quad_t valE  = valB + valC;
     CERO_DEBUG("valE %" PRId64 "\n", valE);
     /* Memory     */
-    if (addrInHighMem(vm, valE) || addrInHighMem(vm, valE + 8)) {
-        vm->statusCondition = STAT_ADR;
-        return;
-    }
-    m8w(vm, valE, valB);
+    m8w(vm, valE, valA);
     /* Write back */
     /* PC update  */
     vm->pc = valP;
@@ -189,16 +692,14 @@ static inline void rmmovq(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  50 AB -----------D-----------   */
-static inline void mrmovq(VM* vm) {
+static inline void mrmovq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::mrmovq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valC  = m8r(vm, vm->pc + 2);
-    vm_quad_t valP  = vm->pc + 10;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
-    vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
     vm_quad_t valE  = valB + valC;
@@ -206,117 +707,118 @@ static inline void mrmovq(VM* vm) {
     vm_quad_t valM  = m8r(vm, valE);
     /* Write back */
     vm->registers[rA] = valM;
+    MARK_REGISTER_DIRTY(vm, rA);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  60 AB                           */
-static inline void addq(VM* vm) {
+static inline void addq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::addq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP  = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
-    vm_quad_t valE = valB + valA;
-    vm->conditionCodes |=
-        (valE == 0 ? 1 : 0) << CC_ZF |
-        (valE < 0  ? 1 : 0) << CC_SF |
-        (((valA > 0 && valB > INT64_MAX - valA) || (valA < 0 && valB < INT64_MIN - valA)) ? 1 : 0) << CC_OF;
+    vm_quad_t valE = (vm_quad_t)((uint64_t)valB + (uint64_t)valA);
+    vm->flags  = FLAGS_ADD;
+    vm->flagsA = valA;
+    vm->flagsB = valB;
+    vm->flagsE = valE;
+    MARK_FLAGS_DIRTY(vm);
     /* Memory     */
     /* Write back */
     vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  61 AB                           */
-static inline void subq(VM* vm) {
+static inline void subq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::subq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP  = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
-    vm_quad_t valE = valB - valA;
-    vm->conditionCodes |=
-        (valE == 0 ? 1 : 0) << CC_ZF |
-        (valE < 0  ? 1 : 0) << CC_SF |
-        (((valA > 0 && valB > INT64_MAX - valA) || (valA < 0 && valB < INT64_MIN - valA)) ? 1 : 0) << CC_OF;
+    vm_quad_t valE = (vm_quad_t)((uint64_t)valB - (uint64_t)valA);
+    vm->flags  = FLAGS_SUB;
+    vm->flagsA = valA;
+    vm->flagsB = valB;
+    vm->flagsE = valE;
+    MARK_FLAGS_DIRTY(vm);
     /* Memory     */
     /* Write back */
     vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  62 AB                           */
-static inline void andq(VM* vm) {
+static inline void andq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::andq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP  = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
     vm_quad_t valE = valB & valA;
-    vm->conditionCodes |=
-        (valE == 0 ? 1 : 0) << CC_ZF |
-        (valE < 0  ? 1 : 0) << CC_SF |
-        (((valA > 0 && valB > INT64_MAX - valA) || (valA < 0 && valB < INT64_MIN - valA)) ? 1 : 0) << CC_OF;
+    vm->flags  = FLAGS_LOGIC;
+    vm->flagsE = valE;
+    MARK_FLAGS_DIRTY(vm);
     /* Memory     */
     /* Write back */
     vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  63 AB                           */
-static inline void xorq(VM* vm) {
+static inline void xorq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::xorq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP  = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     vm_quad_t valA  = vm->registers[rA];
     vm_quad_t valB  = vm->registers[rB];
     /* Execute    */
     vm_quad_t valE = valB ^ valA;
-    vm->conditionCodes |=
-        (valE == 0 ? 1 : 0) << CC_ZF |
-        (valE < 0  ? 1 : 0) << CC_SF |
-        (((valA > 0 && valB > INT64_MAX - valA) || (valA < 0 && valB < INT64_MIN - valA)) ? 1 : 0) << CC_OF;
+    vm->flags  = FLAGS_LOGIC;
+    vm->flagsE = valE;
+    MARK_FLAGS_DIRTY(vm);
     /* Memory     */
     /* Write back */
     vm->registers[rB] = valE;
+    MARK_REGISTER_DIRTY(vm, rB);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  70 ---------Dest----------      */
-static inline void jmp(VM* vm) {
+static inline void jmp(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jmp\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = true;
@@ -328,11 +830,11 @@ static inline void jmp(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  71 ---------Dest----------      */
-static inline void jle(VM* vm) {
+static inline void jle(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jle\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = sf(vm) | zf(vm);
@@ -344,11 +846,11 @@ static inline void jle(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  72 ---------Dest----------      */
-static inline void jl(VM* vm) {
+static inline void jl(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jl\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = sf(vm);
@@ -360,11 +862,11 @@ static inline void jl(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  73 ---------Dest----------      */
-static inline void je(VM* vm) {
+static inline void je(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::je\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = zf(vm);
@@ -376,11 +878,11 @@ static inline void je(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  74 ---------Dest----------      */
-static inline void jne(VM* vm) {
+static inline void jne(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jne\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = !zf(vm);
@@ -392,11 +894,11 @@ static inline void jne(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  75 ---------Dest----------      */
-static inline void jge(VM* vm) {
+static inline void jge(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jge\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = !sf(vm);
@@ -408,11 +910,11 @@ static inline void jge(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  76 ---------Dest----------      */
-static inline void jg(VM* vm) {
+static inline void jg(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::jg\n");
     /* Fetch      */
-    vm_quad_t valC  = m8r(vm, vm->pc + 1);
-    vm_quad_t valP  = vm->pc + 9;
+    vm_quad_t valC  = ins->valC;
+    vm_quad_t valP  = ins->valP;
     /* Decode     */
     /* Execute    */
     bool cnd = !sf(vm) & !zf(vm);
@@ -424,13 +926,12 @@ static inline void jg(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  21 AB                           */
-static inline void cmovle(VM* vm) {
+static inline void cmovle(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmovle\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -440,6 +941,7 @@ static inline void cmovle(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
@@ -447,13 +949,12 @@ static inline void cmovle(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  22 AB                           */
-static inline void cmovl(VM* vm) {
+static inline void cmovl(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmovl\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -463,6 +964,7 @@ static inline void cmovl(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
@@ -470,13 +972,12 @@ static inline void cmovl(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  23 AB                           */
-static inline void cmove(VM* vm) {
+static inline void cmove(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmove\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -486,6 +987,7 @@ static inline void cmove(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
@@ -493,13 +995,12 @@ static inline void cmove(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  24 AB                           */
-static inline void cmovne(VM* vm) {
+static inline void cmovne(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmovne\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -509,6 +1010,7 @@ static inline void cmovne(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
@@ -516,13 +1018,12 @@ static inline void cmovne(VM* vm) {
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  25 AB                           */
-static inline void cmovge(VM* vm) {
+static inline void cmovge(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmovge\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -532,20 +1033,20 @@ static inline void cmovge(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
-/*  80 ---------Dest----------      */
-static inline void cmovg(VM* vm) {
+/*  26 AB                           */
+static inline void cmovg(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::cmovg\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_ubyte_t rB   = REG_SPEC_DEC_RB(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_ubyte_t rB   = ins->rB;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     /* Execute    */
@@ -555,40 +1056,37 @@ static inline void cmovg(VM* vm) {
     /* Write back */
     if (cnd) {
         vm->registers[rB] = valE;
+        MARK_REGISTER_DIRTY(vm, rB);
     }
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
-/*  80 AB                           */
-static inline void call(VM* vm) {
+/*  80 ---------Dest----------      */
+static inline void call(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::call\n");
     /* Fetch      */
-    vm_quad_t valC = m8r(vm, vm->pc + 1);
-    vm_quad_t valP = vm->pc + 9;
+    vm_quad_t valC = ins->valC;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valB = vm->registers[REG_RSP];
     /* Execute    */
     vm_quad_t valE = valB - 8;
     /* Memory     */
-    if (addrInHighMem(vm, valE) || addrInHighMem(vm, valE + 8)) {
-        vm->statusCondition = STAT_ADR;
-        return;
-    }
     m8w(vm, valE, valP);
     /* Write back */
     vm->registers[REG_RSP] = valE;
+    MARK_REGISTER_DIRTY(vm, REG_RSP);
     /* PC update  */
-    vm->pc = valP;
+    vm->pc = valC;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
 /*  90                              */
-static inline void ret(VM* vm) {
+static inline void ret(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::ret\n");
     /* Fetch      */
-    vm_quad_t valP = vm->pc + 1;
     /* Decode     */
     vm_quad_t valA = vm->registers[REG_RSP];
     vm_quad_t valB = vm->registers[REG_RSP];
@@ -598,18 +1096,18 @@ static inline void ret(VM* vm) {
     vm_quad_t valM = m8r(vm, valA);
     /* Write back */
     vm->registers[REG_RSP] = valE;
+    MARK_REGISTER_DIRTY(vm, REG_RSP);
     /* PC update  */
-    vm->pc = valP;
+    vm->pc = valM;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
-/*  20 AF                           */
-static inline void pushq(VM* vm) {
+/*  A0 AF                           */
+static inline void pushq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::pushq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[rA];
     vm_quad_t valB = vm->registers[REG_RSP];
@@ -619,18 +1117,18 @@ static inline void pushq(VM* vm) {
     m8w(vm, valE, valA);
     /* Write back */
     vm->registers[REG_RSP] = valE;
+    MARK_REGISTER_DIRTY(vm, REG_RSP);
     /* PC update  */
     vm->pc = valP;
 }
 
 /* 0  1  2  3  4  5  6  7  8  9  10 */
-/*  20 AF                           */
-static inline void popq(VM* vm) {
+/*  B0 AF                           */
+static inline void popq(VM* vm, const Instruction* ins) {
     CERO_DEBUG("ins::popq\n");
     /* Fetch      */
-    vm_ubyte_t rArB = m1r(vm, vm->pc + 1);
-    vm_ubyte_t rA   = REG_SPEC_DEC_RA(rArB);
-    vm_quad_t valP = vm->pc + 2;
+    vm_ubyte_t rA   = ins->rA;
+    vm_quad_t valP = ins->valP;
     /* Decode     */
     vm_quad_t valA = vm->registers[REG_RSP];
     vm_quad_t valB = vm->registers[REG_RSP];
@@ -640,46 +1138,602 @@ static inline void popq(VM* vm) {
     vm_quad_t valM = m8r(vm, valA);
     /* Write back */
     vm->registers[REG_RSP] = valE;
+    MARK_REGISTER_DIRTY(vm, REG_RSP);
     vm->registers[rA] = valM;
+    MARK_REGISTER_DIRTY(vm, rA);
     /* PC update  */
     vm->pc = valP;
 }
 
-void run(VM* vm) {
+/* Unknown icode:ifun */
+static inline void invalid(VM* vm, const Instruction* ins) {
+    CERO_DEBUG("ins::invalid\n");
+    vm->statusCondition = STAT_INS;
+}
+
+/* Instruction (partially) outside of the memory */
+static inline void badFetch(VM* vm, const Instruction* ins) {
+    CERO_DEBUG("ins::badFetch\n");
+    vm->statusCondition = STAT_ADR;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static inline void traceStep(VM* vm) {
+    printStep(vm);
+    clearDirty(vm);
+}
+#else
+#define traceStep(vm) ((void)0)
+#endif
+
+/* -----Fused handlers-----
+ * The instructions following the first one of a superinstruction are found by
+ * their offset in the decode cache. Memory faults jump out of the handler
+ * before it updated anything, so a faulting sequence stops with the PC at the
+ * faulting instruction, exactly as if it had been executed unfused.
+ */
+#define FUSE_PAIR(name, first, second)                                  \
+    static inline void name(VM* vm, const Instruction* ins) {           \
+        const Instruction* ins2 = ins + ins->length;                    \
+        first(vm, ins);                                                 \
+        second(vm, ins2);                                               \
+    }
+
+#define FUSE_TRIPLE(name, first, second, third)                         \
+    static inline void name(VM* vm, const Instruction* ins) {           \
+        const Instruction* ins2 = ins + ins->length;                    \
+        const Instruction* ins3 = ins2 + ins2->length;                  \
+        first(vm, ins);                                                 \
+        second(vm, ins2);                                               \
+        third(vm, ins3);                                                \
+    }
+
+FUSE_TRIPLE(irmovqSubqJle, irmovq, subq, jle)
+FUSE_TRIPLE(irmovqSubqJl,  irmovq, subq, jl)
+FUSE_TRIPLE(irmovqSubqJe,  irmovq, subq, je)
+FUSE_TRIPLE(irmovqSubqJne, irmovq, subq, jne)
+FUSE_TRIPLE(irmovqSubqJge, irmovq, subq, jge)
+FUSE_TRIPLE(irmovqSubqJg,  irmovq, subq, jg)
+FUSE_PAIR(subqJle,     subq,   jle)
+FUSE_PAIR(subqJl,      subq,   jl)
+FUSE_PAIR(subqJe,      subq,   je)
+FUSE_PAIR(subqJne,     subq,   jne)
+FUSE_PAIR(subqJge,     subq,   jge)
+FUSE_PAIR(subqJg,      subq,   jg)
+FUSE_PAIR(irmovqAddq,  irmovq, addq)
+FUSE_PAIR(mrmovqAddq,  mrmovq, addq)
+FUSE_PAIR(popqRet,     popq,   ret)
+
+#undef FUSE_PAIR
+#undef FUSE_TRIPLE
+
+/* The only fusion writing memory before its second instruction. A push over
+ * the call invalidates its record, the fusion then stops after the push with
+ * the PC at the overwritten bytes, which the next dispatch decodes and runs as
+ * any other instruction. Only the push retired of the two counted for it */
+static inline void pushqCall(VM* vm, const Instruction* ins) {
+    const Instruction* ins2 = ins + ins->length;
+    pushq(vm, ins);
+    if (ins2->operation != OP_CALL) {
+        unretire(vm, 1);
+        return;
+    }
+    call(vm, ins2);
+}
+
+bool endsBasicBlock(Operation handler) {
+    switch (handler) {
+        case OP_HALT:
+        case OP_JMP: case OP_JLE: case OP_JL: case OP_JE: case OP_JNE: case OP_JGE: case OP_JG:
+        case OP_CALL:
+        case OP_RET:
+        case OP_IRMOVQ_SUBQ_JLE: case OP_IRMOVQ_SUBQ_JL: case OP_IRMOVQ_SUBQ_JE:
+        case OP_IRMOVQ_SUBQ_JNE: case OP_IRMOVQ_SUBQ_JGE: case OP_IRMOVQ_SUBQ_JG:
+        case OP_SUBQ_JLE: case OP_SUBQ_JL: case OP_SUBQ_JE:
+        case OP_SUBQ_JNE: case OP_SUBQ_JGE: case OP_SUBQ_JG:
+        case OP_PUSHQ_CALL:
+        case OP_POPQ_RET:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Guest instructions retired by each handler, none by the ones raising a fault */
+static const vm_ubyte_t retiredBy[OP_COUNT] = {
+    [OP_HALT]   = 1, [OP_NOP]    = 1, [OP_RRMOVQ] = 1, [OP_IRMOVQ] = 1, [OP_RMMOVQ] = 1, [OP_MRMOVQ] = 1,
+    [OP_ADDQ]   = 1, [OP_SUBQ]   = 1, [OP_ANDQ]   = 1, [OP_XORQ]   = 1,
+    [OP_JMP]    = 1, [OP_JLE]    = 1, [OP_JL]     = 1, [OP_JE]     = 1, [OP_JNE]    = 1, [OP_JGE]    = 1, [OP_JG] = 1,
+    [OP_CMOVLE] = 1, [OP_CMOVL]  = 1, [OP_CMOVE]  = 1, [OP_CMOVNE] = 1, [OP_CMOVGE] = 1, [OP_CMOVG]  = 1,
+    [OP_CALL]   = 1, [OP_RET]    = 1, [OP_PUSHQ]  = 1, [OP_POPQ]   = 1,
+    [OP_IRMOVQ_SUBQ_JLE] = 3, [OP_IRMOVQ_SUBQ_JL] = 3, [OP_IRMOVQ_SUBQ_JE] = 3,
+    [OP_IRMOVQ_SUBQ_JNE] = 3, [OP_IRMOVQ_SUBQ_JGE] = 3, [OP_IRMOVQ_SUBQ_JG] = 3,
+    [OP_SUBQ_JLE] = 2, [OP_SUBQ_JL] = 2, [OP_SUBQ_JE] = 2, [OP_SUBQ_JNE] = 2, [OP_SUBQ_JGE] = 2, [OP_SUBQ_JG] = 2,
+    [OP_IRMOVQ_ADDQ] = 2, [OP_MRMOVQ_ADDQ] = 2, [OP_PUSHQ_CALL] = 2, [OP_POPQ_RET] = 2,
+};
+
+#ifdef VM_FUSION_STATS
+#define COUNT_EXECUTED(vm, ins) ((vm)->cold->executed[(ins)->handler]++)
+#else
+#define COUNT_EXECUTED(vm, ins) ((void)0)
+#endif
+
+static inline void execute(VM* vm, const Instruction* ins) {
+    COUNT_EXECUTED(vm, ins);
+    switch (ins->handler) {
+        case OP_HALT:      halt(vm, ins);     break;
+        case OP_NOP:       nop(vm, ins);      break;
+        case OP_RRMOVQ:    rrmovq(vm, ins);   break;
+        case OP_IRMOVQ:    irmovq(vm, ins);   break;
+        case OP_RMMOVQ:    rmmovq(vm, ins);   break;
+        case OP_MRMOVQ:    mrmovq(vm, ins);   break;
+        case OP_ADDQ:      addq(vm, ins);     break;
+        case OP_SUBQ:      subq(vm, ins);     break;
+        case OP_ANDQ:      andq(vm, ins);     break;
+        case OP_XORQ:      xorq(vm, ins);     break;
+        case OP_JMP:       jmp(vm, ins);      break;
+        case OP_JLE:       jle(vm, ins);      break;
+        case OP_JL:        jl(vm, ins);       break;
+        case OP_JE:        je(vm, ins);       break;
+        case OP_JNE:       jne(vm, ins);      break;
+        case OP_JGE:       jge(vm, ins);      break;
+        case OP_JG:        jg(vm, ins);       break;
+        case OP_CMOVLE:    cmovle(vm, ins);   break;
+        case OP_CMOVL:     cmovl(vm, ins);    break;
+        case OP_CMOVE:     cmove(vm, ins);    break;
+        case OP_CMOVNE:    cmovne(vm, ins);   break;
+        case OP_CMOVGE:    cmovge(vm, ins);   break;
+        case OP_CMOVG:     cmovg(vm, ins);    break;
+        case OP_CALL:      call(vm, ins);     break;
+        case OP_RET:       ret(vm, ins);      break;
+        case OP_PUSHQ:     pushq(vm, ins);    break;
+        case OP_POPQ:      popq(vm, ins);     break;
+        case OP_BAD_FETCH: badFetch(vm, ins); break;
+        case OP_IRMOVQ_SUBQ_JLE: irmovqSubqJle(vm, ins); break;
+        case OP_IRMOVQ_SUBQ_JL:  irmovqSubqJl(vm, ins);  break;
+        case OP_IRMOVQ_SUBQ_JE:  irmovqSubqJe(vm, ins);  break;
+        case OP_IRMOVQ_SUBQ_JNE: irmovqSubqJne(vm, ins); break;
+        case OP_IRMOVQ_SUBQ_JGE: irmovqSubqJge(vm, ins); break;
+        case OP_IRMOVQ_SUBQ_JG:  irmovqSubqJg(vm, ins);  break;
+        case OP_SUBQ_JLE:        subqJle(vm, ins);       break;
+        case OP_SUBQ_JL:         subqJl(vm, ins);        break;
+        case OP_SUBQ_JE:         subqJe(vm, ins);        break;
+        case OP_SUBQ_JNE:        subqJne(vm, ins);       break;
+        case OP_SUBQ_JGE:        subqJge(vm, ins);       break;
+        case OP_SUBQ_JG:         subqJg(vm, ins);        break;
+        case OP_IRMOVQ_ADDQ:     irmovqAddq(vm, ins);    break;
+        case OP_MRMOVQ_ADDQ:     mrmovqAddq(vm, ins);    break;
+        case OP_PUSHQ_CALL:      pushqCall(vm, ins);     break;
+        case OP_POPQ_RET:        popqRet(vm, ins);       break;
+        default:           invalid(vm, ins);  break;
+    }
+    traceStep(vm);
+}
+
+/* Adds the instructions of the block the engine was running when a memory
+ * fault left it, the ones before the faulting instruction at vm->pc. Blocks
+ * run straight from vm->cold->blockStart up to there. The walk steps over one
+ * guest instruction at a time, fused or not, so each counts once */
+static void retireFault(VM* vm) {
+    if (vm->cold->metrics == NULL) {
+        return;
+    }
+    uint64_t retired = 0;
+    vm_quad_t pc     = vm->cold->blockStart;
+    while (pc < vm->pc) {
+        const Instruction* ins = fetch(vm, pc);
+        if (ins->operation == OP_BAD_FETCH || ins->valP <= pc) {
+            break;
+        }
+        pc = ins->valP;
+        retired++;
+    }
+    retireBlock(vm, retired);
+}
+
+static void runSwitch(VM* vm) {
+    const bool metered = vm->cold->metrics != NULL;
+    uint64_t retired   = 0;
+    while(vm->statusCondition == STAT_AOK) {
+        const Instruction* ins = fetch(vm, vm->pc);
+        Operation handler = ins->handler;
+        retired += retiredBy[handler];
+        execute(vm, ins);
+        if (metered && endsBasicBlock(handler)) {
+            retireBlock(vm, retired);
+            retired = 0;
+        }
+    }
+    if (metered) {
+        retireBlock(vm, retired);
+    }
+}
+
+/* Executes every instruction on its own (never fused) and records it into vm->cold->trace.
+ * The record of an instruction faulting on memory is completed by its own guard */
+static void runTraced(VM* vm) {
+    if (!beginTrace(vm)) {
+        stopTrace(vm);
+        runSwitch(vm);
+        return;
+    }
+    TraceRecord* volatile record = NULL;
+    jmp_buf* outer = vm->cold->guard;
+    jmp_buf guard;
+    if (setjmp(guard) != 0) {
+        vm->cold->guard     = outer;
+        vm->statusCondition = STAT_ADR;
+        traceStep(vm);
+        traceEnd(vm, record);
+        return;
+    }
+    vm->cold->guard = &guard;
+    while(vm->statusCondition == STAT_AOK) {
+        Instruction ins = *fetch(vm, vm->pc);
+        ins.handler = ins.operation;
+        record = traceBegin(vm, &ins);
+        execute(vm, &ins);
+        traceEnd(vm, record);
+        if (vm->cold->metrics != NULL) {
+            retireBlock(vm, retiredBy[ins.handler]);
+        }
+    }
+    vm->cold->guard = outer;
+}
+
+/* Whether the jXX or cmovXX jumps or moves, as its handler decides */
+static bool conditionHolds(VM* vm, Operation operation) {
+    switch (operation) {
+        case OP_JLE: case OP_CMOVLE: return sf(vm) | zf(vm);
+        case OP_JL:  case OP_CMOVL:  return sf(vm);
+        case OP_JE:  case OP_CMOVE:  return zf(vm);
+        case OP_JNE: case OP_CMOVNE: return !zf(vm);
+        case OP_JGE: case OP_CMOVGE: return !sf(vm);
+        case OP_JG:  case OP_CMOVG:  return !sf(vm) & !zf(vm);
+        default:                     return false;
+    }
+}
+
+/* Executes every instruction on its own (never fused) and counts it into vm->cold->profile, see profile.c */
+static void runProfiled(VM* vm) {
+    while(vm->statusCondition == STAT_AOK) {
+        vm_quad_t pc    = vm->pc;
+        Instruction ins = *fetch(vm, pc);
+        ins.handler = ins.operation;
+        bool taken  = conditionHolds(vm, (Operation)ins.operation);
+        execute(vm, &ins);
+        profileStep(vm, &ins, pc, taken);
+        if (vm->cold->metrics != NULL) {
+            retireBlock(vm, retiredBy[ins.handler]);
+        }
+    }
+}
+
+void runBasicBlock(VM* vm) {
+    uint64_t retired = 0;
     while(vm->statusCondition == STAT_AOK) {
-        switch ((vm_ubyte_t)m1r(vm, vm->pc)) {
-            case INS_HALT:   halt(vm);              break;
-            case INS_NOP:    nop(vm);               break;
-            case INS_RRMOVQ: rrmovq(vm);            break;
-            case INS_IRMOVQ: irmovq(vm);            break;
-            case INS_RMMOVQ: rmmovq(vm);            break;
-            case INS_MRMOVQ: mrmovq(vm);            break;
-            case INS_ADDQ:   addq(vm);              break;
-            case INS_SUBQ:   subq(vm);              break;
-            case INS_ANDQ:   andq(vm);              break;
-            case INS_XORQ:   xorq(vm);              break;
-            case INS_JMP:    jmp(vm);               break;
-            case INS_JLE:    jle(vm);               break;
-            case INS_JL:     jl(vm);                break;
-            case INS_JE:     je(vm);                break;
-            case INS_JNE:    jne(vm);               break;
-            case INS_JGE:    jge(vm);               break;
-            case INS_JG:     jg(vm);                break;
-            case INS_CMOVLE: cmovle(vm);            break;
-            case INS_CMOVL:  cmovl(vm);             break;
-            case INS_CMOVE:  cmove(vm);             break;
-            case INS_CMOVNE: cmovne(vm);            break;
-            case INS_CMOVGE: cmovge(vm);            break;
-            case INS_CMOVG:  cmovg(vm);             break;
-            case INS_CALL:   call(vm);              break;
-            case INS_RET:    ret(vm);               break;
-            case INS_PUSHQ:  pushq(vm);             break;
-            case INS_POPQ:   popq(vm);              break;
-            default: vm->conditionCodes = STAT_INS; break;
+        const Instruction* ins = fetch(vm, vm->pc);
+        Operation handler = ins->handler;
+        retired += retiredBy[handler];
+        execute(vm, ins);
+        if (endsBasicBlock(handler)) {
+            break;
         }
-        printMemory(vm);
-        printRegisters(vm);
-        printStack(vm);
-        printFlagsAndStatusAndPc(vm);
     }
+    if (vm->cold->metrics != NULL) {
+        retireBlock(vm, retired);
+    }
+}
+
+#if defined(__GNUC__)
+/* Direct threaded dispatch through GCC's labels as values.
+ * Instead of returning to a shared switch every handler ends with its own
+ * indirect jump to the handler of the next instruction. This gives the branch
+ * predictor one dispatch site per handler, which captures pairs such as a
+ * subq being followed by a jne. Only the handlers that can change the status
+ * check it before dispatching the next instruction.
+ * https://gcc.gnu.org/onlinedocs/gcc/Labels-as-Values.html
+ */
+
+/* Tells the host counters of runCounted the handler dispatched, counted is a
+ * constant such that the uncounted instance has no trace of it */
+#define COUNT_DISPATCH(ins)                              \
+    do {                                                 \
+        if (counted) {                                   \
+            counters->handler = (ins)->handler;          \
+            counters->dispatched[(ins)->handler]++;      \
+        }                                                \
+    } while (false)
+/* For handlers that never change the status, memory faults leave through vm->cold->guard */
+#define DISPATCH()                            \
+    do {                                      \
+        traceStep(vm);                        \
+        ins = fetch(vm, vm->pc);              \
+        COUNT_EXECUTED(vm, ins);              \
+        COUNT_DISPATCH(ins);                  \
+        retired += retiredBy[ins->handler];   \
+        goto *labels[ins->handler];           \
+    } while (false)
+/* For handlers that may halt or fault */
+#define DISPATCH_CHECKED()                        \
+    do {                                          \
+        traceStep(vm);                            \
+        if (vm->statusCondition != STAT_AOK) {    \
+            if (metered) {                        \
+                retireBlock(vm, retired);         \
+            }                                     \
+            return;                               \
+        }                                         \
+        ins = fetch(vm, vm->pc);                  \
+        COUNT_EXECUTED(vm, ins);                  \
+        COUNT_DISPATCH(ins);                      \
+        retired += retiredBy[ins->handler];       \
+        goto *labels[ins->handler];               \
+    } while (false)
+/* For handlers ending a basic block, the only ones publishing the metrics */
+#define DISPATCH_BLOCK()                  \
+    do {                                  \
+        if (metered) {                    \
+            retireBlock(vm, retired);     \
+            retired = 0;                  \
+        }                                 \
+        DISPATCH();                       \
+    } while (false)
+
+/* The engine, instantiated once counting dispatches for runCounted and once not */
+#define THREADED_ENGINE(name, COUNTED)                           \
+static void name(VM* vm) {                                       \
+    static void* labels[OP_COUNT] = {                            \
+        [OP_UNDECODED] = &&do_invalid,                           \
+        [OP_HALT]      = &&do_halt,                              \
+        [OP_NOP]       = &&do_nop,                               \
+        [OP_RRMOVQ]    = &&do_rrmovq,                            \
+        [OP_IRMOVQ]    = &&do_irmovq,                            \
+        [OP_RMMOVQ]    = &&do_rmmovq,                            \
+        [OP_MRMOVQ]    = &&do_mrmovq,                            \
+        [OP_ADDQ]      = &&do_addq,                              \
+        [OP_SUBQ]      = &&do_subq,                              \
+        [OP_ANDQ]      = &&do_andq,                              \
+        [OP_XORQ]      = &&do_xorq,                              \
+        [OP_JMP]       = &&do_jmp,                               \
+        [OP_JLE]       = &&do_jle,                               \
+        [OP_JL]        = &&do_jl,                                \
+        [OP_JE]        = &&do_je,                                \
+        [OP_JNE]       = &&do_jne,                               \
+        [OP_JGE]       = &&do_jge,                               \
+        [OP_JG]        = &&do_jg,                                \
+        [OP_CMOVLE]    = &&do_cmovle,                            \
+        [OP_CMOVL]     = &&do_cmovl,                             \
+        [OP_CMOVE]     = &&do_cmove,                             \
+        [OP_CMOVNE]    = &&do_cmovne,                            \
+        [OP_CMOVGE]    = &&do_cmovge,                            \
+        [OP_CMOVG]     = &&do_cmovg,                             \
+        [OP_CALL]      = &&do_call,                              \
+        [OP_RET]       = &&do_ret,                               \
+        [OP_PUSHQ]     = &&do_pushq,                             \
+        [OP_POPQ]      = &&do_popq,                              \
+        [OP_INVALID]   = &&do_invalid,                           \
+        [OP_BAD_FETCH] = &&do_badFetch,                          \
+        [OP_IRMOVQ_SUBQ_JLE] = &&do_irmovqSubqJle,               \
+        [OP_IRMOVQ_SUBQ_JL]  = &&do_irmovqSubqJl,                \
+        [OP_IRMOVQ_SUBQ_JE]  = &&do_irmovqSubqJe,                \
+        [OP_IRMOVQ_SUBQ_JNE] = &&do_irmovqSubqJne,               \
+        [OP_IRMOVQ_SUBQ_JGE] = &&do_irmovqSubqJge,               \
+        [OP_IRMOVQ_SUBQ_JG]  = &&do_irmovqSubqJg,                \
+        [OP_SUBQ_JLE]        = &&do_subqJle,                     \
+        [OP_SUBQ_JL]         = &&do_subqJl,                      \
+        [OP_SUBQ_JE]         = &&do_subqJe,                      \
+        [OP_SUBQ_JNE]        = &&do_subqJne,                     \
+        [OP_SUBQ_JGE]        = &&do_subqJge,                     \
+        [OP_SUBQ_JG]         = &&do_subqJg,                      \
+        [OP_IRMOVQ_ADDQ]     = &&do_irmovqAddq,                  \
+        [OP_MRMOVQ_ADDQ]     = &&do_mrmovqAddq,                  \
+        [OP_PUSHQ_CALL]      = &&do_pushqCall,                   \
+        [OP_POPQ_RET]        = &&do_popqRet,                     \
+    };                                                           \
+    const Instruction* ins;                                      \
+    const bool counted = COUNTED;                                \
+    Counters* counters = counted ? vm->cold->counters : NULL;    \
+    const bool metered = vm->cold->metrics != NULL;              \
+    uint64_t retired   = 0;                                      \
+                                                                 \
+    if (vm->statusCondition != STAT_AOK) {                       \
+        return;                                                  \
+    }                                                            \
+    ins = fetch(vm, vm->pc);                                     \
+    COUNT_EXECUTED(vm, ins);                                     \
+    COUNT_DISPATCH(ins);                                         \
+    retired += retiredBy[ins->handler];                          \
+    goto *labels[ins->handler];                                  \
+                                                                 \
+    do_halt:      halt(vm, ins);     DISPATCH_CHECKED();         \
+    do_nop:       nop(vm, ins);      DISPATCH();                 \
+    do_rrmovq:    rrmovq(vm, ins);   DISPATCH();                 \
+    do_irmovq:    irmovq(vm, ins);   DISPATCH();                 \
+    do_rmmovq:    rmmovq(vm, ins);   DISPATCH();                 \
+    do_mrmovq:    mrmovq(vm, ins);   DISPATCH();                 \
+    do_addq:      addq(vm, ins);     DISPATCH();                 \
+    do_subq:      subq(vm, ins);     DISPATCH();                 \
+    do_andq:      andq(vm, ins);     DISPATCH();                 \
+    do_xorq:      xorq(vm, ins);     DISPATCH();                 \
+    do_jmp:       jmp(vm, ins);      DISPATCH_BLOCK();           \
+    do_jle:       jle(vm, ins);      DISPATCH_BLOCK();           \
+    do_jl:        jl(vm, ins);       DISPATCH_BLOCK();           \
+    do_je:        je(vm, ins);       DISPATCH_BLOCK();           \
+    do_jne:       jne(vm, ins);      DISPATCH_BLOCK();           \
+    do_jge:       jge(vm, ins);      DISPATCH_BLOCK();           \
+    do_jg:        jg(vm, ins);       DISPATCH_BLOCK();           \
+    do_cmovle:    cmovle(vm, ins);   DISPATCH();                 \
+    do_cmovl:     cmovl(vm, ins);    DISPATCH();                 \
+    do_cmove:     cmove(vm, ins);    DISPATCH();                 \
+    do_cmovne:    cmovne(vm, ins);   DISPATCH();                 \
+    do_cmovge:    cmovge(vm, ins);   DISPATCH();                 \
+    do_cmovg:     cmovg(vm, ins);    DISPATCH();                 \
+    do_call:      call(vm, ins);     DISPATCH_BLOCK();           \
+    do_ret:       ret(vm, ins);      DISPATCH_BLOCK();           \
+    do_pushq:     pushq(vm, ins);    DISPATCH();                 \
+    do_popq:      popq(vm, ins);     DISPATCH();                 \
+    do_invalid:   invalid(vm, ins);  DISPATCH_CHECKED();         \
+    do_badFetch:  badFetch(vm, ins); DISPATCH_CHECKED();         \
+    do_irmovqSubqJle: irmovqSubqJle(vm, ins); DISPATCH_BLOCK();  \
+    do_irmovqSubqJl:  irmovqSubqJl(vm, ins);  DISPATCH_BLOCK();  \
+    do_irmovqSubqJe:  irmovqSubqJe(vm, ins);  DISPATCH_BLOCK();  \
+    do_irmovqSubqJne: irmovqSubqJne(vm, ins); DISPATCH_BLOCK();  \
+    do_irmovqSubqJge: irmovqSubqJge(vm, ins); DISPATCH_BLOCK();  \
+    do_irmovqSubqJg:  irmovqSubqJg(vm, ins);  DISPATCH_BLOCK();  \
+    do_subqJle:       subqJle(vm, ins);       DISPATCH_BLOCK();  \
+    do_subqJl:        subqJl(vm, ins);        DISPATCH_BLOCK();  \
+    do_subqJe:        subqJe(vm, ins);        DISPATCH_BLOCK();  \
+    do_subqJne:       subqJne(vm, ins);       DISPATCH_BLOCK();  \
+    do_subqJge:       subqJge(vm, ins);       DISPATCH_BLOCK();  \
+    do_subqJg:        subqJg(vm, ins);        DISPATCH_BLOCK();  \
+    do_irmovqAddq:    irmovqAddq(vm, ins);    DISPATCH();        \
+    do_mrmovqAddq:    mrmovqAddq(vm, ins);    DISPATCH();        \
+    do_pushqCall:     pushqCall(vm, ins);     DISPATCH_BLOCK();  \
+    do_popqRet:       popqRet(vm, ins);       DISPATCH_BLOCK();  \
+}
+
+THREADED_ENGINE(runThreaded, false)
+THREADED_ENGINE(runThreadedCounted, true)
+
+#undef THREADED_ENGINE
+#undef COUNT_DISPATCH
+#undef DISPATCH
+#undef DISPATCH_CHECKED
+#undef DISPATCH_BLOCK
+#else
+static void runThreaded(VM* vm) {
+    runSwitch(vm);
+}
+
+static void runThreadedCounted(VM* vm) {
+    runSwitch(vm);
 }
+#endif
+
+/* Runs the engine of the VM telling vm->cold->counters which handler is
+ * dispatched, such that the host events sampled are charged to it, see
+ * counters.c. THREADED publishes from its own dispatch, the others are
+ * measured on the dispatch of SWITCH as the JIT and AOT engines run
+ * translated code no handler is dispatched in.
+ * Counting is paused on memory faults by its own guard */
+static void runCounted(VM* vm) {
+    Counters* counters = vm->cold->counters;
+    counters->engine   = vm->cold->engine == ENGINE_THREADED ? ENGINE_THREADED : ENGINE_SWITCH;
+    if (!resumeCounters(vm)) {
+        CERO_ERROR("counters::resume unable to count, running uncounted\n");
+        runSwitch(vm);
+        return;
+    }
+    jmp_buf* outer = vm->cold->guard;
+    jmp_buf guard;
+    if (setjmp(guard) != 0) {
+        pauseCounters(vm);
+        vm->cold->guard     = outer;
+        vm->statusCondition = STAT_ADR;
+        traceStep(vm);
+        retireFault(vm);
+        return;
+    }
+    vm->cold->guard = &guard;
+    if (counters->engine == ENGINE_THREADED) {
+        runThreadedCounted(vm);
+    } else {
+        const bool metered = vm->cold->metrics != NULL;
+        uint64_t retired   = 0;
+        while(vm->statusCondition == STAT_AOK) {
+            const Instruction* ins = fetch(vm, vm->pc);
+            Operation handler = ins->handler;
+            counters->handler = handler;
+            counters->dispatched[handler]++;
+            retired += retiredBy[handler];
+            execute(vm, ins);
+            if (metered && endsBasicBlock(handler)) {
+                retireBlock(vm, retired);
+                retired = 0;
+            }
+        }
+        if (metered) {
+            retireBlock(vm, retired);
+        }
+    }
+    pauseCounters(vm);
+    vm->cold->guard = outer;
+}
+
+#define GENERATE_OPERATION_STRING(NAME) #NAME,
+
+static const char* operationStrings[OP_COUNT] = {
+    FOREACH_OPERATION(GENERATE_OPERATION_STRING)
+};
+
+#undef GENERATE_OPERATION_STRING
+
+const char* operationName(Operation operation) {
+    return operation < OP_COUNT ? operationStrings[operation] : "UNKNOWN";
+}
+
+#define GENERATE_ENGINE_STRING(NAME) #NAME,
+
+static const char* engineStrings[ENGINE_COUNT] = {
+    FOREACH_ENGINE(GENERATE_ENGINE_STRING)
+};
+
+#undef GENERATE_ENGINE_STRING
+
+const char* engineName(Engine engine) {
+    return engine < ENGINE_COUNT ? engineStrings[engine] : "UNKNOWN";
+}
+
+bool engineFromName(const char* name, Engine* engine) {
+    for (int i = 0; i < ENGINE_COUNT; ++i) {
+        if (strcasecmp(name, engineStrings[i]) == 0) {
+            *engine = (Engine)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Arms the guard memory faults jump to, in place of a check in every handler.
+ * The engines publish the metrics themselves, the end of the run publishes the
+ * instructions retired since */
+void run(VM* vm) {
+    vm->cold->retired    = 0;
+    vm->cold->blockStart = vm->pc;
+    /* Frames may have moved between runs, by a dedup scan or a mapped file */
+    vm->fetchPage        = -1;
+    if (vm->cold->metrics != NULL) {
+        beginMetrics(vm);
+    }
+    jmp_buf guard;
+    if (setjmp(guard) != 0) {
+        vm->cold->guard     = NULL;
+        vm->statusCondition = STAT_ADR;
+        traceStep(vm);
+        if (vm->cold->metrics != NULL) {
+            retireFault(vm);
+            endMetrics(vm, vm->cold->retired);
+        }
+        return;
+    }
+    vm->cold->guard = &guard;
+    if (vm->cold->trace != NULL) {
+        runTraced(vm);
+    } else if (vm->cold->profile != NULL) {
+        runProfiled(vm);
+    } else if (vm->cold->counters != NULL) {
+        runCounted(vm);
+    } else {
+        switch (vm->cold->engine) {
+            case ENGINE_THREADED: runThreaded(vm); break;
+            case ENGINE_JIT:      runJit(vm);      break;
+            case ENGINE_AOT:      runAot(vm);      break;
+            default:              runSwitch(vm);   break;
+        }
+    }
+    vm->cold->guard = NULL;
+    if (vm->cold->metrics != NULL) {
+        endMetrics(vm, vm->cold->retired);
+    }
+}
\ No newline at end of file
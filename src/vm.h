@@ -1,12 +1,10 @@
 #ifndef creo_vm_h
 #define creo_vm_h
 
-#include "value.h"
-
-/* This is the memory for the VM */
-#define MEM_MAX    (256)
+#include <setjmp.h>
 
-/* How to reserve memory: Expand the */
+#include "value.h"
+#include "paging.h"
 
 /* Conceptually, the stack is divided into two areas:
  * high addresses are all in use and reserved (you can't change these values!),       
@@ -73,6 +71,16 @@
 #define CC_SF      (0x01) /* Negative sign  */
 #define CC_OF      (0x02) /* Overflow       */
 
+/* The instruction the condition codes are derived from. ALU instructions only
+ * record their operands and result, ZF, SF and OF are worked out when zf(), sf()
+ * or of() is called, as most flags are overwritten before anything reads them */
+typedef enum {
+    FLAGS_EAGER, /* The conditionCodes byte holds the flags */
+    FLAGS_ADD,   /* addq                                    */
+    FLAGS_SUB,   /* subq                                    */
+    FLAGS_LOGIC  /* andq and xorq, which clear OF           */
+} FlagsOperation;
+
 typedef enum {
     STAT_AOK, /* Normal operation                                      */
     STAT_HLT, /* Halt instruciton  encountered                         */
@@ -80,26 +88,230 @@ typedef enum {
     STAT_INS  /* Invalid  instruction encountered                      */
 } StatusCondition;
 
+/* Longest encoding of a single instruction (irmovq, rmmovq and mrmovq) */
+#define INS_MAX_LENGTH (10)
+/* Most guest bytes a superinstruction is fused from (irmovq, subq and jXX) */
+#define FUSION_MAX_SPAN (21)
+
+/* Superinstructions executing a common sequence of instructions as one.
+ * Named by the instructions they fuse, see the fusion patterns in vm.c */
+#define FOREACH_FUSION(wrapper)\
+        wrapper(IRMOVQ_SUBQ_JLE)\
+        wrapper(IRMOVQ_SUBQ_JL)\
+        wrapper(IRMOVQ_SUBQ_JE)\
+        wrapper(IRMOVQ_SUBQ_JNE)\
+        wrapper(IRMOVQ_SUBQ_JGE)\
+        wrapper(IRMOVQ_SUBQ_JG)\
+        wrapper(SUBQ_JLE)\
+        wrapper(SUBQ_JL)\
+        wrapper(SUBQ_JE)\
+        wrapper(SUBQ_JNE)\
+        wrapper(SUBQ_JGE)\
+        wrapper(SUBQ_JG)\
+        wrapper(IRMOVQ_ADDQ)\
+        wrapper(MRMOVQ_ADDQ)\
+        wrapper(PUSHQ_CALL)\
+        wrapper(POPQ_RET)\
+
+/* The handlers an instruction can be decoded into. UNDECODED must stay first
+ * such that a zeroed decode cache holds no instructions. INVALID is decoded
+ * from unknown icode:ifun bytes and BAD_FETCH from instructions that do not
+ * fit inside the memory of the VM. */
+#define FOREACH_OPERATION(wrapper)\
+        wrapper(UNDECODED)\
+        wrapper(HALT)\
+        wrapper(NOP)\
+        wrapper(RRMOVQ)\
+        wrapper(IRMOVQ)\
+        wrapper(RMMOVQ)\
+        wrapper(MRMOVQ)\
+        wrapper(ADDQ)\
+        wrapper(SUBQ)\
+        wrapper(ANDQ)\
+        wrapper(XORQ)\
+        wrapper(JMP)\
+        wrapper(JLE)\
+        wrapper(JL)\
+        wrapper(JE)\
+        wrapper(JNE)\
+        wrapper(JGE)\
+        wrapper(JG)\
+        wrapper(CMOVLE)\
+        wrapper(CMOVL)\
+        wrapper(CMOVE)\
+        wrapper(CMOVNE)\
+        wrapper(CMOVGE)\
+        wrapper(CMOVG)\
+        wrapper(CALL)\
+        wrapper(RET)\
+        wrapper(PUSHQ)\
+        wrapper(POPQ)\
+        wrapper(INVALID)\
+        wrapper(BAD_FETCH)\
+        FOREACH_FUSION(wrapper)\
+
+#define GENERATE_OPERATION_ENUM(NAME) OP_##NAME,
+
+typedef enum {
+    FOREACH_OPERATION(GENERATE_OPERATION_ENUM)
+    OP_COUNT
+} Operation;
+
+#undef GENERATE_OPERATION_ENUM
+
+/* An instruction decoded once from the guest bytes at some PC.
+ * The fetch stage of every handler reads its operands from here instead of
+ * from memory, such that re-executing an instruction skips the decoding. */
+typedef struct Instruction {
+    vm_ubyte_t handler;   /* The Operation executing the instruction, may be a fusion */
+    vm_ubyte_t operation; /* The Operation decoded from the bytes of the instruction  */
+    vm_ubyte_t rA;        /* Decoded rA of the register specifier byte (or REG_F)     */
+    vm_ubyte_t rB;        /* Decoded rB of the register specifier byte (or REG_F)     */
+    vm_ubyte_t length;    /* Number of guest bytes the instruction was decoded from   */
+    vm_ubyte_t span;      /* Number of guest bytes the handler was decoded from       */
+    vm_quad_t valC;       /* The constant word (immediate, displacement or Dest)      */
+    vm_quad_t valP;       /* The PC of the instruction following this one            */
+} Instruction;
+
+/* The dispatch engines run() can execute the decoded instructions with.
+ * SWITCH:   A single switch on the handler of every instruction.
+ * THREADED: Computed goto (direct threading) where every handler jumps straight
+ *           to the handler of the next instruction. Only available with GCC/Clang,
+ *           elsewhere it falls back to SWITCH.
+ * JIT:      Interprets cold code and translates hot basic blocks into x86-64
+ *           machine code, see jit.c. Falls back to SWITCH on other hosts.
+ * AOT:      Runs the C translation loaded with loadAot, interpreting the code it
+ *           does not cover, see aot.c. Without one it behaves like SWITCH. */
+#define FOREACH_ENGINE(wrapper)\
+        wrapper(SWITCH)\
+        wrapper(THREADED)\
+        wrapper(JIT)\
+        wrapper(AOT)\
+
+#define GENERATE_ENGINE_ENUM(NAME) ENGINE_##NAME,
+
+typedef enum {
+    FOREACH_ENGINE(GENERATE_ENGINE_ENUM)
+    ENGINE_COUNT
+} Engine;
+
+#undef GENERATE_ENGINE_ENUM
+
+/* The engine used by VMs unless told otherwise, can be set at build time */
+#ifndef VM_DEFAULT_ENGINE
+#define VM_DEFAULT_ENGINE ENGINE_THREADED
+#endif
+
+/* The tracing build records what every step wrote such that the printer only
+ * prints that (see printStep). Memory is tracked in granules of 8 bytes, a step
+ * writing more than DIRTY_MEMORY_MAX of them prints everything. */
+#define DIRTY_GRANULE    (8)
+#define DIRTY_MEMORY_MAX (8)
+
+/* Steps between two full dumps of the state, 0 for the first step only */
+#ifndef TRACE_FULL_DUMP_EVERY
+#define TRACE_FULL_DUMP_EVERY (0)
+#endif
+
+#define VM_CACHE_LINE (64)
+
+/* The state of a VM that is not touched on every step, kept out of line such
+ * that it does not share cache lines with the hot state of the VM */
+typedef struct VMCold {
+    Engine engine;                   /* The dispatch engine used by run()                                           */
+    bool fusion;                     /* Whether newly decoded instructions are fused into superinstructions         */
+    jmp_buf* guard;                  /* Where accesses outside of the address space jump to, NULL outside of run()  */
+    struct Jit* jit;                 /* Translated blocks of the JIT engine, NULL until it first runs               */
+    struct Aot* aot;                 /* Translation run by the AOT engine, NULL until loadAot                       */
+    struct Trace* trace;             /* Binary trace recorded by runTraced, NULL unless startTrace was called       */
+    struct Profile* profile;         /* Counts kept by runProfiled, NULL unless startProfile was called             */
+    struct Counters* counters;       /* Host events sampled by runCounted, NULL unless startCounters was called     */
+    struct MetricsSlot* metrics;     /* Where the engines publish, NULL unless startMetrics was called              */
+    uint64_t retired;                /* Instructions retired before blockStart and not published yet                */
+    vm_quad_t blockStart;            /* PC of the block being run when metrics are published, see retireBlock       */
+    Instruction straddling;          /* The last instruction fetched running into the next page, see decoded()      */
+#ifdef VM_FUSION_STATS
+    uint64_t executed[OP_COUNT];     /* Number of times each handler has been executed                              */
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    uint32_t dirtyRegisters;                /* Bit r is set if register r was written during the step               */
+    bool dirtyFlags;                        /* Whether the condition codes were set during the step                 */
+    vm_quad_t dirtyMemory[DIRTY_MEMORY_MAX];/* Addresses of the granules written during the step                    */
+    uint32_t dirtyMemoryCount;              /* Number of them, above DIRTY_MEMORY_MAX if some were not recorded     */
+    uint64_t steps;                         /* Steps printed so far                                                 */
+    uint64_t fullDumpEvery;                 /* Steps between two full dumps, see TRACE_FULL_DUMP_EVERY              */
+#endif
+} VMCold;
+
+/* The register file fills the first two cache lines of the VM and the rest of
+ * the state every step touches the third one. The TLBs follow, only the entry
+ * of the page accessed is touched. Everything else is behind cold. */
 typedef struct {
+    _Alignas(VM_CACHE_LINE)
+    vm_quad_t registers[REG_COUNT];  /* The 16 registers used by the y86-64 mapped with REG_X                       */
+    _Alignas(VM_CACHE_LINE)
     vm_quad_t pc;                    /* The Program Counter pointing at the current isntruction in the chunk opCode */
+    vm_quad_t fetchPage;             /* Number of the page the last instruction was fetched from                    */
+    Instruction* fetchDecoded;       /* Its decode cache                                                            */
+    Page* fetchEntry;                /* Its page, for the decode misses                                             */
+    vm_quad_t flagsA;                /* valA of the last instruction setting the condition codes                    */
+    vm_quad_t flagsB;                /* Its valB                                                                    */
+    vm_quad_t flagsE;                /* Its valE                                                                    */
     StatusCondition statusCondition; /* The status of the VM                                                        */
-    vm_ubyte_t conditionCodes;       /* Byte container for the CC_ZF, CC_SF and CC_OF                               */
-    vm_quad_t* registers;            /* The 16 registers used by the y86-64 mapped with REG_X                       */
-    vm_ubyte_t* memory;              /* The virtual memory stack used by this VM                                    */
+    vm_ubyte_t flags;                /* The FlagsOperation of that instruction, a byte to keep the line full        */
+    vm_ubyte_t conditionCodes;       /* Byte container for the CC_ZF, CC_SF and CC_OF if flags is FLAGS_EAGER       */
+    _Alignas(VM_CACHE_LINE)
+    AddressSpace memory;             /* The TLBs and the pages of guest memory                                      */
+    VMCold* cold;                    /* Everything else                                                             */
 } VM;
 
+/* The state of a VM captured by snapshotVM, see forkVM */
+typedef struct {
+    vm_quad_t registers[REG_COUNT];
+    vm_quad_t pc;
+    vm_quad_t flagsA;
+    vm_quad_t flagsB;
+    vm_quad_t flagsE;
+    FlagsOperation flags;
+    StatusCondition statusCondition;
+    vm_ubyte_t conditionCodes;
+    Engine engine;
+    bool fusion;
+    AddressSpace memory;             /* Shares the frames of the VM copy-on-write */
+} VMSnapshot;
+
 void initVM(VM* vm);
 void freeVM(VM* vm);
+void resetVM(VM* vm);
+void resetMemory(VM* vm);
+void snapshotVM(VM* vm, VMSnapshot* snapshot);
+void freeSnapshot(VMSnapshot* snapshot);
+void forkVM(VMSnapshot* snapshot, VM* vm);
 
 bool zf(VM* vm);
 bool sf(VM* vm);
 bool of(VM* vm);
+void syncConditionCodes(VM* vm);
+void clearDirty(VM* vm);
 
 vm_ubyte_t m1r(VM* vm, vm_quad_t offset);
 vm_quad_t m8r(VM* vm, vm_quad_t offset);
 vm_ubyte_t m1w(VM* vm, vm_quad_t offset, vm_ubyte_t byte);
 vm_quad_t m8w(VM* vm, vm_quad_t offset, vm_quad_t quad);
+void copyToMemory(VM* vm, vm_quad_t offset, const vm_ubyte_t* bytes, vm_quad_t length);
+
+bool addrInMem(VM* vm, vm_quad_t addr, vm_quad_t length);
+
+Instruction* fetch(VM* vm, vm_quad_t pc);
+void invalidateDecoded(VM* vm, vm_quad_t offset, vm_quad_t length);
+
+const char* operationName(Operation operation);
+Operation fusionLeader(Operation fusion, vm_quad_t* length);
+const char* engineName(Engine engine);
+bool engineFromName(const char* name, Engine* engine);
 
+bool endsBasicBlock(Operation handler);
+void runBasicBlock(VM* vm);
 void run(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "metrics.h"
+
+/* -----vmtop-----
+ * Samples the metrics segments VMs started with --metrics publish, see
+ * metrics.c. Without pids every segment in /dev/shm is sampled. The segment
+ * of a process that is gone is shown once as DEAD and unlinked, such a process
+ * ended without stopping its metrics.
+ *     vmtop [PID...] [--interval=MS] [--count=N]
+ */
+
+/* Most segments and VMs sampled at a time */
+#define VMTOP_MAX_SEGMENTS (64)
+#define VMTOP_MAX_VMS      (1024)
+
+/* What the previous sample of a VM read, its MIPS are worked out from it */
+typedef struct {
+    int32_t pid;
+    uint32_t slot;
+    uint64_t generation;
+    uint64_t retired;
+    uint64_t sampled;
+} Sampled;
+
+static Sampled sampled[VMTOP_MAX_VMS];
+static uint32_t sampledCount = 0;
+
+static const char* statusNames[METRICS_STATUS_COUNT] = { "AOK", "HLT", "ADR", "INS" };
+
+static uint64_t monotonicNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void segmentName(int32_t pid, char name[32]) {
+    snprintf(name, 32, METRICS_PREFIX "%d", (int)pid);
+}
+
+/* Maps the segment of pid, NULL if there is none or it is not of this version.
+ * *size is the number of bytes mapped */
+static const MetricsSegment* openSegment(int32_t pid, size_t* size) {
+    char name[32];
+    segmentName(pid, name);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(MetricsSegment)) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)status.st_size;
+    const MetricsSegment* segment = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(segment->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0 || segment->version != METRICS_VERSION ||
+        segment->slotSize != sizeof(MetricsSlot)) {
+        CERO_WARN("%s is not a metrics segment of this version\n", name);
+        munmap((void*)segment, *size);
+        return NULL;
+    }
+    return segment;
+}
+
+/* The pids of the segments in /dev/shm */
+static uint32_t findSegments(int32_t pids[VMTOP_MAX_SEGMENTS]) {
+    DIR* directory = opendir("/dev/shm");
+    if (directory == NULL) {
+        return 0;
+    }
+    uint32_t count = 0;
+    size_t prefixLength = strlen(METRICS_PREFIX) - 1;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL && count < VMTOP_MAX_SEGMENTS) {
+        if (strncmp(entry->d_name, METRICS_PREFIX + 1, prefixLength) == 0) {
+            pids[count++] = (int32_t)atoi(entry->d_name + prefixLength);
+        }
+    }
+    closedir(directory);
+    return count;
+}
+
+/* The MIPS of the VM since its previous sample, negative on its first one */
+static double sampleMips(int32_t pid, uint32_t slot, uint64_t generation, uint64_t retired, uint64_t now) {
+    Sampled* previous = NULL;
+    for (uint32_t i = 0; i < sampledCount && previous == NULL; ++i) {
+        if (sampled[i].pid == pid && sampled[i].slot == slot) {
+            previous = &sampled[i];
+        }
+    }
+    if (previous == NULL) {
+        if (sampledCount == VMTOP_MAX_VMS) {
+            return -1.0;
+        }
+        previous             = &sampled[sampledCount++];
+        previous->pid        = pid;
+        previous->slot       = slot;
+        previous->generation = generation - 1;
+    }
+    double mips = -1.0;
+    if (previous->generation == generation && now > previous->sampled && retired >= previous->retired) {
+        mips = (double)(retired - previous->retired) * 1e3 / (double)(now - previous->sampled);
+    }
+    previous->generation = generation;
+    previous->retired    = retired;
+    previous->sampled    = now;
+    return mips;
+}
+
+static void printSegment(int32_t pid, const MetricsSegment* segment, size_t size, uint64_t now, bool alive) {
+    /* The segment may have grown since it was mapped */
+    uint32_t slotCount = atomic_load_explicit(&segment->slotCount, memory_order_acquire);
+    uint32_t mapped    = (uint32_t)((size - sizeof(MetricsSegment)) / sizeof(MetricsSlot));
+    for (uint32_t i = 0; i < slotCount && i < mapped; ++i) {
+        const MetricsSlot* slot = &segment->slots[i];
+        if (atomic_load_explicit(&slot->live, memory_order_relaxed) == 0) {
+            continue;
+        }
+        uint64_t generation = atomic_load_explicit(&slot->generation, memory_order_relaxed);
+        uint64_t retired    = atomic_load_explicit(&slot->retired, memory_order_relaxed);
+        uint64_t runNanos   = atomic_load_explicit(&slot->runNanos, memory_order_relaxed);
+        uint64_t published  = atomic_load_explicit(&slot->published, memory_order_relaxed);
+        uint32_t status     = atomic_load_explicit(&slot->status, memory_order_relaxed);
+        double mips         = sampleMips(pid, i, generation, retired, now);
+        char live[16];
+        if (mips < 0.0) {
+            snprintf(live, sizeof(live), "-");
+        } else {
+            snprintf(live, sizeof(live), "%.1f", mips);
+        }
+        CERO_INFO("%8d %4u %-4s 0x%012" PRIx64 " %14" PRIu64 " %9s %9.1f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %9.1f\n",
+                  (int)pid, i, alive ? (status < METRICS_STATUS_COUNT ? statusNames[status] : "?") : "DEAD",
+                  (uint64_t)atomic_load_explicit(&slot->pc, memory_order_relaxed), retired, live,
+                  runNanos == 0 ? 0.0 : (double)retired * 1e3 / (double)runNanos,
+                  atomic_load_explicit(&slot->pages, memory_order_relaxed),
+                  atomic_load_explicit(&slot->runs[STAT_HLT], memory_order_relaxed),
+                  atomic_load_explicit(&slot->runs[STAT_ADR], memory_order_relaxed),
+                  atomic_load_explicit(&slot->runs[STAT_INS], memory_order_relaxed),
+                  now > published ? (double)(now - published) / 1e6 : 0.0);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int32_t pids[VMTOP_MAX_SEGMENTS];
+    uint32_t pidCount  = 0;
+    uint64_t interval  = 1000;
+    uint64_t remaining = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--interval=", 11) == 0) {
+            interval = strtoull(argv[i] + 11, NULL, 10);
+        } else if (strncmp(argv[i], "--count=", 8) == 0) {
+            remaining = strtoull(argv[i] + 8, NULL, 10);
+        } else if (strncmp(argv[i], "--", 2) != 0 && atoi(argv[i]) > 0 && pidCount < VMTOP_MAX_SEGMENTS) {
+            pids[pidCount++] = (int32_t)atoi(argv[i]);
+        } else {
+            CERO_FATAL("Usage: vmtop [PID...] [--interval=MS] [--count=N]\n");
+            return 1;
+        }
+    }
+    bool scan = pidCount == 0;
+    for (uint64_t sample = 0; remaining == 0 || sample < remaining; ++sample) {
+        if (sample != 0) {
+            struct timespec pause = { (time_t)(interval / 1000), (long)(interval % 1000) * 1000000 };
+            nanosleep(&pause, NULL);
+        }
+        if (scan) {
+            pidCount = findSegments(pids);
+        }
+        uint64_t now = monotonicNanos();
+        CERO_INFO("%8s %4s %-4s %14s %14s %9s %9s %8s %8s %8s %8s %9s\n", "PID", "SLOT", "STAT", "PC", "RETIRED", "MIPS",
+                  "AVG MIPS", "PAGES", "HLT", "ADR", "INS", "AGE MS");
+        for (uint32_t i = 0; i < pidCount; ++i) {
+            size_t size;
+            const MetricsSegment* segment = openSegment(pids[i], &size);
+            if (segment != NULL) {
+                bool alive = kill(pids[i], 0) == 0 || errno == EPERM;
+                printSegment(pids[i], segment, size, now, alive);
+                munmap((void*)segment, size);
+                if (!alive) {
+                    char name[32];
+                    segmentName(pids[i], name);
+                    shm_unlink(name);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -1,22 +1,148 @@
-#include "writer.h"
-#include "vm.h"
+#include <string.h>
 
-void initWriter(Writer* writer, vm_byte_t* destination, uint32_t offset) {
-    writer->offset      = offset;
-    writer->destination = destination;
+#include "writer.h"
+#include "memory.h"
+#include "object.h"
+
+/* -----Writer-----
+ * Instructions are encoded on the stack and copied to the destination in one
+ * memcpy. A growable writer keeps a zeroed chunk per page it writes to, in a
+ * sorted array, so a .pos far into the address space costs a chunk instead of
+ * every byte below it. Emitting is sequential, so the chunk written last is
+ * checked before searching, and reserveWriter sizes the array up front for
+ * callers knowing how much they are about to write.
+ *
+ * Branches and quads naming a label that is not bound yet are written as 0
+ * and recorded as fixups, which resolveLabels sets once every label is bound.
+ * Programs are thereby generated in a single pass whatever their jumps.
+ */
+
+struct WriterFixup {
+    uint32_t address;        /* Of the quad to set         */
+    WriterLabel label;
+};
+
+struct WriterChunk {
+    uint32_t page;           /* Address / PAGE_SIZE        */
+    vm_ubyte_t* bytes;       /* PAGE_SIZE of them          */
+};
+
+void initWriter(Writer* writer, vm_byte_t* destination, uint32_t capacity, uint32_t offset) {
+    writer->offset        = offset;
+    writer->destination   = destination;
+    writer->capacity      = destination != NULL ? capacity : UINT32_MAX;
+    writer->size          = 0;
+    writer->growable      = destination == NULL;
+    writer->failed        = false;
+    writer->chunks        = NULL;
+    writer->chunkCount    = 0;
+    writer->chunkCapacity = 0;
+    writer->lastChunk     = 0;
+    writer->labels        = NULL;
+    writer->labelCount    = 0;
+    writer->labelCapacity = 0;
+    writer->fixups        = NULL;
+    writer->fixupCount    = 0;
+    writer->fixupCapacity = 0;
 }
 
 void freeWriter(Writer* writer) {
-    initWriter(writer, NULL, 0);
+    for (uint32_t i = 0; i < writer->chunkCount; ++i) {
+        FREE_ARRAY(vm_ubyte_t, writer->chunks[i].bytes, PAGE_SIZE);
+    }
+    FREE_ARRAY(WriterChunk, writer->chunks, writer->chunkCapacity);
+    FREE_ARRAY(vm_quad_t, writer->labels, writer->labelCapacity);
+    FREE_ARRAY(WriterFixup, writer->fixups, writer->fixupCapacity);
+    initWriter(writer, NULL, 0, 0);
+}
+
+static void growChunks(Writer* writer, uint32_t count) {
+    if (count <= writer->chunkCapacity) {
+        return;
+    }
+    uint32_t oldCapacity  = writer->chunkCapacity;
+    uint32_t capacity     = GROW_CAPACITY(oldCapacity);
+    writer->chunkCapacity = capacity < count ? count : capacity;
+    writer->chunks        = GROW_ARRAY(WriterChunk, writer->chunks, oldCapacity, writer->chunkCapacity);
+}
+
+/* Makes room for length bytes at offset, false once the writer failed */
+bool reserveWriter(Writer* writer, uint32_t length) {
+    uint64_t end = (uint64_t)writer->offset + length;
+    if (end > writer->capacity) {
+        if (!writer->failed) {
+            CERO_ERROR("writer::write of %u bytes at 0x%x past the capacity of %u bytes\n", length, writer->offset, writer->capacity);
+        }
+        writer->failed = true;
+        return false;
+    }
+    if (writer->growable && length > 0) {
+        uint64_t pages = (end - 1) / PAGE_SIZE - writer->offset / PAGE_SIZE + 1;
+        growChunks(writer, writer->chunkCount + (uint32_t)pages);
+    }
+    return !writer->failed;
+}
+
+/* The bytes of the chunk of the page, a new one of zeros if not written yet */
+static vm_ubyte_t* chunkBytes(Writer* writer, uint32_t page) {
+    if (writer->chunkCount > 0 && writer->chunks[writer->lastChunk].page == page) {
+        return writer->chunks[writer->lastChunk].bytes;
+    }
+    uint32_t low  = 0;
+    uint32_t high = writer->chunkCount;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (writer->chunks[middle].page < page) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == writer->chunkCount || writer->chunks[low].page != page) {
+        growChunks(writer, writer->chunkCount + 1);
+        memmove(&writer->chunks[low + 1], &writer->chunks[low], (writer->chunkCount - low) * sizeof(WriterChunk));
+        writer->chunks[low].page  = page;
+        writer->chunks[low].bytes = INIT_ARRAY(vm_ubyte_t, NULL, PAGE_SIZE);
+        writer->chunkCount++;
+    }
+    writer->lastChunk = low;
+    return writer->chunks[low].bytes;
 }
 
-static inline void writeBytes(Writer* writer, vm_ubyte_t* bytes, uint32_t length) {
-    for (uint32_t i = 0; i < length; ++i) {
-        writer->destination[writer->offset + i] = bytes[i];
+/* Copies the bytes to address, which the caller checked lies in capacity */
+static void storeBytes(Writer* writer, uint32_t address, const vm_ubyte_t* bytes, uint32_t length) {
+    if (!writer->growable) {
+        memcpy(writer->destination + address, bytes, length);
+        return;
+    }
+    while (length > 0) {
+        uint32_t inPage = address & PAGE_MASK;
+        uint32_t part   = PAGE_SIZE - inPage < length ? PAGE_SIZE - inPage : length;
+        memcpy(chunkBytes(writer, address / PAGE_SIZE) + inPage, bytes, part);
+        address += part;
+        bytes   += part;
+        length  -= part;
     }
+}
+
+static inline void writeBytes(Writer* writer, const vm_ubyte_t* bytes, uint32_t length) {
+    if ((uint64_t)writer->offset + length > writer->capacity && !reserveWriter(writer, length)) {
+        return;
+    }
+    storeBytes(writer, writer->offset, bytes, length);
     writer->offset += length;
+    if (writer->offset > writer->size) {
+        writer->size = writer->offset;
+    }
 }
 
+static void storeLabel(Writer* writer, uint32_t address, vm_quad_t label) {
+    if ((uint64_t)address + sizeof(vm_quad_t) <= writer->capacity) {
+        vm_ubyte_t bytes[8];
+        storeQuad(bytes, label);
+        storeBytes(writer, address, bytes, sizeof(bytes));
+    }
+}
 static inline void writeInsFun(Writer* writer, vm_ubyte_t insFun) {
     vm_ubyte_t bytes[1];
     bytes[0] = insFun;
@@ -34,31 +160,165 @@ static inline void writeInsFunRegsQuad(Writer* writer, vm_ubyte_t insFun, vm_uby
     vm_ubyte_t bytes[10];
     bytes[0] = insFun;
     bytes[1] = rArB;
-    bytes[9] = (q >>  0) & 0xFF;
-    bytes[8] = (q >>  8) & 0xFF;
-    bytes[7] = (q >> 16) & 0xFF;
-    bytes[6] = (q >> 24) & 0xFF;
-    bytes[5] = (q >> 32) & 0xFF;
-    bytes[4] = (q >> 40) & 0xFF;
-    bytes[3] = (q >> 48) & 0xFF;
-    bytes[2] = (q >> 56) & 0xFF;
+    storeQuad(bytes + 2, q);
     writeBytes(writer, bytes, 10);
 }
 
 static inline void writeInsFunQuad(Writer* writer, vm_ubyte_t insFun, vm_quad_t q) {
     vm_ubyte_t bytes[9];
     bytes[0] = insFun;
-    bytes[8] = (q >>  0) & 0xFF;
-    bytes[7] = (q >>  8) & 0xFF;
-    bytes[6] = (q >> 16) & 0xFF;
-    bytes[5] = (q >> 24) & 0xFF;
-    bytes[4] = (q >> 32) & 0xFF;
-    bytes[3] = (q >> 40) & 0xFF;
-    bytes[2] = (q >> 48) & 0xFF;
-    bytes[1] = (q >> 56) & 0xFF;
+    storeQuad(bytes + 1, q);
     writeBytes(writer, bytes, 9);
 }
 
+/* -----Labels----- */
+WriterLabel newLabel(Writer* writer) {
+    if (writer->labelCount == writer->labelCapacity) {
+        uint32_t oldCapacity  = writer->labelCapacity;
+        writer->labelCapacity = GROW_CAPACITY(oldCapacity);
+        writer->labels        = GROW_ARRAY(vm_quad_t, writer->labels, oldCapacity, writer->labelCapacity);
+    }
+    writer->labels[writer->labelCount] = WRITER_UNBOUND;
+    return writer->labelCount++;
+}
+
+/* Binds the label to the offset, the address of what is written next */
+void bindLabel(Writer* writer, WriterLabel label) {
+    writer->labels[label] = writer->offset;
+}
+
+vm_quad_t labelAddress(Writer* writer, WriterLabel label) {
+    return writer->labels[label];
+}
+
+/* Sets the quad at address to the address of the label, now if it is bound,
+ * otherwise once resolveLabels is called */
+void fixupQuad(Writer* writer, uint32_t address, WriterLabel label) {
+    if (writer->labels[label] != WRITER_UNBOUND) {
+        storeLabel(writer, address, writer->labels[label]);
+        return;
+    }
+    if (writer->fixupCount == writer->fixupCapacity) {
+        uint32_t oldCapacity  = writer->fixupCapacity;
+        writer->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        writer->fixups        = GROW_ARRAY(WriterFixup, writer->fixups, oldCapacity, writer->fixupCapacity);
+    }
+    WriterFixup* fixup = &writer->fixups[writer->fixupCount++];
+    fixup->address = address;
+    fixup->label   = label;
+}
+
+/* Sets the quads of the labels that were not bound when written, false if
+ * some still are not or a write was dropped */
+bool resolveLabels(Writer* writer) {
+    for (uint32_t i = 0; i < writer->fixupCount; ++i) {
+        WriterFixup* fixup = &writer->fixups[i];
+        vm_quad_t address  = writer->labels[fixup->label];
+        if (address == WRITER_UNBOUND) {
+            CERO_ERROR("writer::resolve label %u is not bound\n", fixup->label);
+            writer->failed = true;
+            break;
+        }
+        storeLabel(writer, fixup->address, address);
+    }
+    writer->fixupCount = 0;
+    return !writer->failed;
+}
+
+/* The label is bound, or 0 with a fixup of the quad quadOffset bytes into
+ * the instruction about to be written */
+static inline vm_quad_t labelQuad(Writer* writer, WriterLabel label, uint32_t quadOffset) {
+    vm_quad_t address = writer->labels[label];
+    if (address == WRITER_UNBOUND) {
+        fixupQuad(writer, writer->offset + quadOffset, label);
+        return 0;
+    }
+    return address;
+}
+
+/* -----Images-----
+ * Only the pages holding a byte that is not zero are copied or saved, the
+ * pages a .pos skipped over, or a write left zero, read zeros anyway. The
+ * last page ends at the size of the writer. */
+static void nonZeroPages(Writer* writer, void (*visit)(void* context, vm_quad_t address, vm_quad_t size, const vm_ubyte_t* bytes), void* context) {
+    static const vm_ubyte_t zeros[PAGE_SIZE];
+    uint32_t count = writer->growable ? writer->chunkCount : (uint32_t)((writer->size + PAGE_MASK) / PAGE_SIZE);
+    for (uint32_t i = 0; i < count; ++i) {
+        vm_quad_t address       = (writer->growable ? writer->chunks[i].page : i) * PAGE_SIZE;
+        const vm_ubyte_t* bytes = writer->growable ? writer->chunks[i].bytes : (const vm_ubyte_t*)writer->destination + address;
+        vm_quad_t length        = writer->size - address < PAGE_SIZE ? writer->size - address : PAGE_SIZE;
+        if (memcmp(bytes, zeros, length) != 0) {
+            visit(context, address, length, bytes);
+        }
+    }
+}
+
+static void copyPage(void* context, vm_quad_t address, vm_quad_t size, const vm_ubyte_t* bytes) {
+    copyToMemory(context, address, bytes, size);
+}
+
+/* Copies what was written into the memory of the VM, at the same addresses */
+void loadWriter(Writer* writer, VM* vm) {
+    nonZeroPages(writer, copyPage, vm);
+}
+
+/* The sections point into image, where the pages are copied one after the
+ * other such that the pages of a run of addresses are a single section */
+typedef struct {
+    ObjectSectionData* sections;
+    uint32_t count;
+    uint32_t capacity;
+    vm_ubyte_t* image;
+    vm_quad_t imageSize;
+} SectionList;
+
+static void addPage(void* context, vm_quad_t address, vm_quad_t size, const vm_ubyte_t* bytes) {
+    SectionList* list = context;
+    vm_ubyte_t* copy  = list->image + list->imageSize;
+    memcpy(copy, bytes, size);
+    list->imageSize += size;
+    ObjectSectionData* last = list->count > 0 ? &list->sections[list->count - 1] : NULL;
+    if (last != NULL && last->address + last->size == address) {
+        last->size += size;
+        return;
+    }
+    if (list->count == list->capacity) {
+        uint32_t oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->sections = GROW_ARRAY(ObjectSectionData, list->sections, oldCapacity, list->capacity);
+    }
+    ObjectSectionData section = { SECTION_CODE, address, size, copy };
+    list->sections[list->count++] = section;
+}
+
+/* Writes what was written out as an object file (see object.h) */
+bool saveWriter(Writer* writer, const char* path, vm_quad_t entry, vm_quad_t stack) {
+    vm_quad_t pages  = writer->growable ? writer->chunkCount : (writer->size + PAGE_MASK) / PAGE_SIZE;
+    SectionList list = { NULL, 0, 0, NULL, 0 };
+    list.image = INIT_ARRAY(vm_ubyte_t, NULL, pages * PAGE_SIZE);
+    nonZeroPages(writer, addPage, &list);
+    bool written = writeObject(path, entry, stack, list.sections, list.count);
+    FREE_ARRAY(ObjectSectionData, list.sections, list.capacity);
+    FREE_ARRAY(vm_ubyte_t, list.image, pages * PAGE_SIZE);
+    return written;
+}
+
+/* -----Data----- */
+void bytesWrite(Writer* writer, const vm_ubyte_t* bytes, uint32_t length) {
+    writeBytes(writer, bytes, length);
+}
+
+void quadWrite(Writer* writer, vm_quad_t quad) {
+    vm_ubyte_t bytes[8];
+    storeQuad(bytes, quad);
+    writeBytes(writer, bytes, 8);
+}
+
+void quadLabelWrite(Writer* writer, WriterLabel label) {
+    quadWrite(writer, labelQuad(writer, label, 0));
+}
+
+/* -----Instructions----- */
 void haltWrite(Writer* writer) {
     writeInsFun(writer, INS_HALT);
 }
@@ -83,6 +343,10 @@ void mrmovqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB, vm_quad_t d) {
     writeInsFunRegsQuad(writer, INS_MRMOVQ, REG_SPEC_ENC_RARB(rA, rB), d);
 }
 
+void irmovqLabelWrite(Writer* writer, vm_ubyte_t rB, WriterLabel label) {
+    irmovqWrite(writer, rB, labelQuad(writer, label, 2));
+}
+
 void addqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB) {
     writeInsFunRegs(writer, INS_ADDQ, REG_SPEC_ENC_RARB(rA, rB));
 }
@@ -127,6 +391,34 @@ void jgWrite(Writer* writer, vm_quad_t dest) {
     writeInsFunQuad(writer, INS_JG, dest);
 }
 
+void jmpLabelWrite(Writer* writer, WriterLabel label) {
+    jmpWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jleLabelWrite(Writer* writer, WriterLabel label) {
+    jleWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jlLabelWrite(Writer* writer, WriterLabel label) {
+    jlWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jeLabelWrite(Writer* writer, WriterLabel label) {
+    jeWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jneLabelWrite(Writer* writer, WriterLabel label) {
+    jneWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jgeLabelWrite(Writer* writer, WriterLabel label) {
+    jgeWrite(writer, labelQuad(writer, label, 1));
+}
+
+void jgLabelWrite(Writer* writer, WriterLabel label) {
+    jgWrite(writer, labelQuad(writer, label, 1));
+}
+
 void cmovleWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB) {
     writeInsFunRegs(writer, INS_CMOVLE, REG_SPEC_ENC_RARB(rA, rB));
 }
@@ -155,6 +447,10 @@ void callWrite(Writer* writer, vm_quad_t dest) {
     writeInsFunQuad(writer, INS_CALL, dest);
 }
 
+void callLabelWrite(Writer* writer, WriterLabel label) {
+    callWrite(writer, labelQuad(writer, label, 1));
+}
+
 void retWrite(Writer* writer) {
     writeInsFun(writer, INS_RET);
 }
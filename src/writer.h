@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "value.h"
+#include "vm.h"
 
 /* Encodings                                            */
 #define REG_SPEC_ENC_RARB(rA, rB) ((rA << 4) | rB)        
@@ -12,13 +13,55 @@
 #define REG_SPEC_DEC_RA(regSpec) (regSpec >> 4)  
 #define REG_SPEC_DEC_RB(regSpec) (regSpec & 0x0F)
 
+/* Label returned by newLabel, its address is WRITER_UNBOUND until bindLabel */
+typedef uint32_t WriterLabel;
+
+#define WRITER_UNBOUND (-1)
+
+typedef struct WriterFixup WriterFixup;
+typedef struct WriterChunk WriterChunk;
+
+/* Writes instructions at offset into destination, offset being the guest
+ * address they are meant for. Writers given no destination keep the pages
+ * they write to in chunks of their own, zeroed, and free them with
+ * freeWriter. Writes past the capacity of a destination given by the caller
+ * are dropped and fail the writer instead. */
 typedef struct {
     uint32_t offset;
     vm_byte_t* destination;
+    uint32_t capacity;       /* Of destination, UINT32_MAX if growable        */
+    uint32_t size;           /* One past the highest byte written             */
+    bool growable;           /* Whether the writer owns its chunks            */
+    bool failed;             /* Whether a write was dropped                   */
+    WriterChunk* chunks;     /* Pages written, by ascending page number       */
+    uint32_t chunkCount;
+    uint32_t chunkCapacity;
+    uint32_t lastChunk;      /* Index of the chunk written last               */
+    vm_quad_t* labels;       /* Address of every label, by WriterLabel        */
+    uint32_t labelCount;
+    uint32_t labelCapacity;
+    WriterFixup* fixups;     /* Quads to set to labels not bound yet          */
+    uint32_t fixupCount;
+    uint32_t fixupCapacity;
 } Writer;
 
-void initWriter(Writer* writer, vm_byte_t* destination, uint32_t offset);
+void initWriter(Writer* writer, vm_byte_t* destination, uint32_t capacity, uint32_t offset);
 void freeWriter(Writer* writer);
+bool reserveWriter(Writer* writer, uint32_t length);
+void loadWriter(Writer* writer, VM* vm);
+bool saveWriter(Writer* writer, const char* path, vm_quad_t entry, vm_quad_t stack);
+
+/* Labels     */
+WriterLabel newLabel(Writer* writer);
+void bindLabel(Writer* writer, WriterLabel label);
+vm_quad_t labelAddress(Writer* writer, WriterLabel label);
+void fixupQuad(Writer* writer, uint32_t address, WriterLabel label);
+bool resolveLabels(Writer* writer);
+
+/* Data       */
+void bytesWrite(Writer* writer, const vm_ubyte_t* bytes, uint32_t length);
+void quadWrite(Writer* writer, vm_quad_t quad);
+void quadLabelWrite(Writer* writer, WriterLabel label);
 
 /* Execution  */
 void haltWrite(Writer* writer);
@@ -28,6 +71,7 @@ void rrmovqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
 void irmovqWrite(Writer* writer, vm_ubyte_t rB, vm_quad_t v);
 void rmmovqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB, vm_quad_t d);
 void mrmovqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB, vm_quad_t d);
+void irmovqLabelWrite(Writer* writer, vm_ubyte_t rB, WriterLabel label);
 /* Operations */
 void addqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
 void subqWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
@@ -41,6 +85,13 @@ void jeWrite(Writer* writer,  vm_quad_t dest);
 void jneWrite(Writer* writer, vm_quad_t dest);
 void jgeWrite(Writer* writer, vm_quad_t dest);
 void jgWrite(Writer* writer,  vm_quad_t dest);
+void jmpLabelWrite(Writer* writer, WriterLabel label);
+void jleLabelWrite(Writer* writer, WriterLabel label);
+void jlLabelWrite(Writer* writer,  WriterLabel label);
+void jeLabelWrite(Writer* writer,  WriterLabel label);
+void jneLabelWrite(Writer* writer, WriterLabel label);
+void jgeLabelWrite(Writer* writer, WriterLabel label);
+void jgLabelWrite(Writer* writer,  WriterLabel label);
 /* Moves      */
 void cmovleWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
 void cmovlWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
@@ -50,6 +101,7 @@ void cmovgeWrite(Writer* writer, vm_ubyte_t rA, vm_ubyte_t rB);
 void cmovgWrite(Writer* writer,  vm_ubyte_t rA, vm_ubyte_t rB);
 /* Computation */
 void callWrite(Writer* writer, vm_quad_t dest);
+void callLabelWrite(Writer* writer, WriterLabel label);
 void retWrite(Writer* writer);
 /* Stack      */
 void pushqWrite(Writer* writer, vm_ubyte_t rA);